@@ -8,4 +8,6 @@ int add_main(int argc, const char **argv);
 int status_main(int argc, const char **argv);
 int log_main(int argc, const char **argv);
 int defrag_main(int argc, const char **argv);
-int restore_main(int argc, const char **argv);
\ No newline at end of file
+int restore_main(int argc, const char **argv);
+int iostat_main(int argc, const char **argv);
+int compact_main(int argc, const char **argv);
\ No newline at end of file
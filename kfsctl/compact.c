@@ -0,0 +1,25 @@
+#include <stdio.h>
+#include <unistd.h>
+
+#include "cmd.h"
+#include "ctl.h"
+
+int compact_main(int argc, const char **argv) {
+    if (argc != 2) {
+        fprintf(stderr, "usage: kfsctl compact <dir>\n");
+        return -1;
+    }
+
+    if (ctl_init() < 0) {
+        fprintf(stderr, "ctl init failed\n");
+        return -1;
+    }
+
+    // the directory is compacted even if most of its blocks are in use, kfs answers with its new size
+    if (ctl_cmd(CMD_COMPACT, argv[1], -1) < 0) {
+        return -1;
+    }
+
+    ctl_destroy();
+    return 0;
+}
@@ -65,10 +65,20 @@ int ctl_cmd(enum kfs_cmd cmd, const char *filename, int version) {
         return -1;
     }
 
+    // the response may arrive in several segments
     struct Response resp;
-    if (read(kfsctl_fd, &resp, sizeof(resp)) < 0) {
-        perror("read failed");
-        return -1;
+    size_t read_bytes = 0;
+    while (read_bytes < sizeof(resp)) {
+        ssize_t ret = read(kfsctl_fd, (char *)&resp + read_bytes, sizeof(resp) - read_bytes);
+        if (ret < 0) {
+            perror("read failed");
+            return -1;
+        }
+        if (ret == 0) {
+            fprintf(stderr, "connection closed by kfs\n");
+            return -1;
+        }
+        read_bytes += ret;
     }
 
     if (resp.need_print) {
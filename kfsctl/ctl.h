@@ -3,7 +3,7 @@
 #include <stdint.h>
 #include <pthread.h>
 
-enum kfs_cmd { CMD_STATUS = 1, CMD_LOG, CMD_ADD, CMD_RESTORE };
+enum kfs_cmd { CMD_STATUS = 1, CMD_LOG, CMD_ADD, CMD_RESTORE, CMD_IOSTAT, CMD_COMPACT };
 
 struct Request {
     enum kfs_cmd cmd;
@@ -13,7 +13,7 @@ struct Request {
 
 struct Response {
     int need_print;
-    char msg[1024];
+    char msg[4096];
 };
 
 int ctl_init();
@@ -0,0 +1,26 @@
+#include <stdio.h>
+#include <unistd.h>
+
+#include "cmd.h"
+#include "ctl.h"
+
+int iostat_main(int argc, const char **argv) {
+    if (argc != 1) {
+        fprintf(stderr, "usage: kfsctl iostat\n");
+        return -1;
+    }
+
+    if (ctl_init() < 0) {
+        fprintf(stderr, "ctl init failed\n");
+        return -1;
+    }
+
+    printf("Disk I/O by call site:\n");
+
+    if (ctl_cmd(CMD_IOSTAT, NULL, -1) < 0) {
+        return -1;
+    }
+
+    ctl_destroy();
+    return 0;
+}
@@ -29,7 +29,9 @@ int main(int argc, const char **argv) {
     XBOX_argparse_describe(&parser,
                            "kfsctl",
                            "\nTerminal control program for kfs.\n\nSub commands:\n\tstatus: \tcheck fs status"
-                           "\n\tadd \t\tmake snapshot for a file\n\tlog \t\tshow a file's snapshot log\n\trestore \trestore a file to a snapshot",
+                           "\n\tadd \t\tmake snapshot for a file\n\tlog \t\tshow a file's snapshot log\n\trestore \trestore a file to a snapshot"
+                           "\n\tiostat \t\tshow disk I/O latency by call site"
+                           "\n\tcompact \trepack a directory into fewer blocks",
                            "Documentation: https://github.com/luzhixing12345/kfs/kfsctl/README.md\n");
     XBOX_argparse_parse(&parser, argc, argv);
 
@@ -38,6 +40,8 @@ int main(int argc, const char **argv) {
         {"status", status_main},
         {"log", log_main},
         {"restore", restore_main},
+        {"iostat", iostat_main},
+        {"compact", compact_main},
     };
 
     if (XBOX_ismatch(&parser, "help")) {
@@ -74,7 +74,7 @@ int main(int argc, char **argv) {
         return EXIT_FAILURE;
     }
 
-    if (disk_open(argv[1]) < 0) {
+    if (disk_open(argv[1], 0) < 0) {
         fprintf(stderr, "disk_open: %s: %s\n", argv[1], strerror(errno));
         return EXIT_FAILURE;
     }
@@ -124,6 +124,17 @@ int main(int argc, char **argv) {
     sb.s_inode_size = MKFS_EXT4_INODE_SIZE;
     sb.s_inodes_per_group = inode_count / group_count;
     sb.s_desc_size = MKFS_EXT4_DESC_SIZE;
+    // directories past one block are indexed by hash
+    sb.s_feature_compat |= EXT4_FEATURE_COMPAT_DIR_INDEX;
+    sb.s_def_hash_version = EXT4_HASH_HALF_MD4;
+    sb.s_flags |= (char)-1 < 0 ? EXT4_FLAGS_SIGNED_HASH : EXT4_FLAGS_UNSIGNED_HASH;
+    FILE *urandom = fopen("/dev/urandom", "r");
+    if (urandom == NULL || fread(sb.s_hash_seed, sizeof(sb.s_hash_seed), 1, urandom) != 1) {
+        WARNING("no random hash seed, use the default one");
+    }
+    if (urandom) {
+        fclose(urandom);
+    }
 
     disk_write(BOOT_SECTOR_SIZE, sizeof(struct ext4_super_block), &sb);
     INFO("finish filling super block");
@@ -0,0 +1,244 @@
+#define _GNU_SOURCE  // MAP_HUGETLB, MADV_HUGEPAGE
+#include "arena.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "logging.h"
+
+/*
+ * One region of cap bytes is reserved at init, 2MiB aligned so that it can be backed by hugepages. It is
+ * cut into 64KiB slabs on demand, a new slab is split into buffers of one class and they are pushed on the
+ * free list of that class. A freed buffer goes back to its class (found by its slab), so the memory used
+ * by buffers is at most cap. arena_trim gives the pages of slabs with no buffer in use back to the kernel,
+ * such slabs are carved again before the untouched part of the region.
+ */
+#define ARENA_HUGEPAGE_SIZE (2 << 20)
+#define ARENA_SLAB_SIZE     (1 << ARENA_SLAB_SHIFT)
+#define ARENA_SLAB_FREE     0xff  // slab_class of a trimmed slab
+
+enum arena_backing { ARENA_NONE, ARENA_PAGES, ARENA_THP, ARENA_HUGETLB };
+
+static uint32_t arena_cap_mb = ARENA_DEFAULT_MB;
+static int arena_hugepage = 0;
+
+static struct {
+    pthread_mutex_t lock;
+    uint8_t *base;         // NULL if the arena is disabled
+    size_t cap;            // bytes reserved
+    size_t map_size;       // bytes mapped, cap plus the alignment slack
+    uint8_t *map;          // the mapping, base is aligned in it
+    size_t carved;         // bytes cut into slabs, from base
+    uint8_t *slab_class;   // class of every slab
+    uint16_t *slab_used;   // buffers in use in every slab
+    uint32_t *free_slabs;  // trimmed slabs, carved again first
+    uint32_t free_slab_cnt;
+    uint64_t trimmed;      // slabs given back by arena_trim
+    void *free[ARENA_CLASSES];
+    uint64_t in_use[ARENA_CLASSES];  // buffers handed out
+    uint64_t overflow;               // allocations that fell back to malloc because the arena is full
+    enum arena_backing backing;
+} arena = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+void arena_config(uint32_t cap_mb, int hugepage) {
+    arena_cap_mb = cap_mb;
+    arena_hugepage = hugepage;
+}
+
+static int arena_class(size_t size) {
+    int cls = 0;
+    while (((size_t)1 << (cls + ARENA_MIN_SHIFT)) < size) {
+        cls++;
+    }
+    return cls;
+}
+
+int arena_init() {
+    if (arena_cap_mb == 0) {
+        INFO("buffer arena disabled");
+        return 0;
+    }
+    arena.cap = (size_t)arena_cap_mb << 20;
+    arena.cap = (arena.cap + ARENA_HUGEPAGE_SIZE - 1) & ~((size_t)ARENA_HUGEPAGE_SIZE - 1);
+
+#ifdef MAP_HUGETLB
+    if (arena_hugepage) {
+        // explicit hugepages are reserved at mmap, it fails early if the pool is too small
+        arena.map = mmap(NULL, arena.cap, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (arena.map != MAP_FAILED) {
+            arena.map_size = arena.cap;
+            arena.base = arena.map;
+            arena.backing = ARENA_HUGETLB;
+        } else {
+            WARNING("no explicit hugepages for the buffer arena: %s, try transparent hugepages", strerror(errno));
+        }
+    }
+#endif
+    if (arena.base == NULL) {
+        // over-map by one hugepage to align base, pages are only committed when slabs are carved
+        arena.map_size = arena.cap + ARENA_HUGEPAGE_SIZE;
+        arena.map =
+            mmap(NULL, arena.map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (arena.map == MAP_FAILED) {
+            ERR("fail to reserve %zu bytes for the buffer arena: %s", arena.cap, strerror(errno));
+            arena.map = NULL;
+            return -1;
+        }
+        arena.base =
+            (uint8_t *)(((uintptr_t)arena.map + ARENA_HUGEPAGE_SIZE - 1) & ~((uintptr_t)ARENA_HUGEPAGE_SIZE - 1));
+        arena.backing = ARENA_PAGES;
+#ifdef MADV_HUGEPAGE
+        if (madvise(arena.base, arena.cap, MADV_HUGEPAGE) == 0) {
+            arena.backing = ARENA_THP;
+        } else if (arena_hugepage) {
+            WARNING("no transparent hugepages for the buffer arena: %s", strerror(errno));
+        }
+#endif
+    }
+
+    arena.slab_class = calloc(arena.cap >> ARENA_SLAB_SHIFT, sizeof(uint8_t));
+    arena.slab_used = calloc(arena.cap >> ARENA_SLAB_SHIFT, sizeof(uint16_t));
+    arena.free_slabs = calloc(arena.cap >> ARENA_SLAB_SHIFT, sizeof(uint32_t));
+    arena.free_slab_cnt = 0;
+    arena.carved = 0;
+    INFO("buffer arena init, %zu MiB at %p", arena.cap >> 20, arena.base);
+    return 0;
+}
+
+void arena_exit() {
+    if (arena.base == NULL) {
+        return;
+    }
+    munmap(arena.map, arena.map_size);
+    free(arena.slab_class);
+    free(arena.slab_used);
+    free(arena.free_slabs);
+    memset(arena.free, 0, sizeof(arena.free));
+    memset(arena.in_use, 0, sizeof(arena.in_use));
+    arena.base = NULL;
+    arena.map = NULL;
+    arena.slab_class = NULL;
+    arena.slab_used = NULL;
+    arena.free_slabs = NULL;
+    INFO("buffer arena exit");
+}
+
+// cut a new slab into buffers of cls, arena.lock must be held
+static int arena_carve(int cls) {
+    uint8_t *slab;
+    if (arena.free_slab_cnt) {
+        slab = arena.base + ((size_t)arena.free_slabs[--arena.free_slab_cnt] << ARENA_SLAB_SHIFT);
+    } else if (arena.carved + ARENA_SLAB_SIZE <= arena.cap) {
+        slab = arena.base + arena.carved;
+        arena.carved += ARENA_SLAB_SIZE;
+    } else {
+        return -1;
+    }
+    size_t size = (size_t)1 << (cls + ARENA_MIN_SHIFT);
+    arena.slab_class[(slab - arena.base) >> ARENA_SLAB_SHIFT] = cls;
+    for (size_t off = ARENA_SLAB_SIZE; off >= size; off -= size) {
+        void **p = (void **)(slab + off - size);
+        *p = arena.free[cls];
+        arena.free[cls] = p;
+    }
+    return 0;
+}
+
+void *arena_alloc(size_t size) {
+    if (arena.base == NULL || size > ARENA_SLAB_SIZE) {
+        return malloc(size);
+    }
+    int cls = arena_class(size);
+    pthread_mutex_lock(&arena.lock);
+    if (arena.free[cls] == NULL && arena_carve(cls) < 0) {
+        arena.overflow++;
+        pthread_mutex_unlock(&arena.lock);
+        DEBUG("buffer arena is full, malloc %zu bytes", size);
+        return malloc(size);
+    }
+    void **p = arena.free[cls];
+    arena.free[cls] = *p;
+    arena.in_use[cls]++;
+    arena.slab_used[((uint8_t *)p - arena.base) >> ARENA_SLAB_SHIFT]++;
+    pthread_mutex_unlock(&arena.lock);
+    return p;
+}
+
+void arena_free(void *p) {
+    uint8_t *b = p;
+    if (arena.base == NULL || b < arena.base || b >= arena.base + arena.cap) {
+        free(p);
+        return;
+    }
+    pthread_mutex_lock(&arena.lock);
+    size_t slab = (b - arena.base) >> ARENA_SLAB_SHIFT;
+    int cls = arena.slab_class[slab];
+    *(void **)p = arena.free[cls];
+    arena.free[cls] = p;
+    arena.in_use[cls]--;
+    arena.slab_used[slab]--;
+    pthread_mutex_unlock(&arena.lock);
+}
+
+uint64_t arena_trim() {
+    if (arena.base == NULL || arena.backing == ARENA_HUGETLB) {
+        // explicit hugepages can't be given back in pieces
+        return 0;
+    }
+    pthread_mutex_lock(&arena.lock);
+    uint32_t first = arena.free_slab_cnt;
+    for (int cls = 0; cls < ARENA_CLASSES; cls++) {
+        // unlink the buffers of unused slabs, their pages are only dropped once every list is rebuilt
+        void **link = &arena.free[cls];
+        while (*link) {
+            size_t slab = ((uint8_t *)*link - arena.base) >> ARENA_SLAB_SHIFT;
+            if (arena.slab_used[slab]) {
+                link = (void **)*link;
+                continue;
+            }
+            *link = *(void **)*link;
+            if (arena.slab_class[slab] != ARENA_SLAB_FREE) {
+                arena.slab_class[slab] = ARENA_SLAB_FREE;
+                arena.free_slabs[arena.free_slab_cnt++] = slab;
+            }
+        }
+    }
+    for (uint32_t i = first; i < arena.free_slab_cnt; i++) {
+        madvise(arena.base + ((size_t)arena.free_slabs[i] << ARENA_SLAB_SHIFT), ARENA_SLAB_SIZE, MADV_DONTNEED);
+    }
+    uint64_t bytes = (uint64_t)(arena.free_slab_cnt - first) << ARENA_SLAB_SHIFT;
+    arena.trimmed += arena.free_slab_cnt - first;
+    pthread_mutex_unlock(&arena.lock);
+    if (bytes) {
+        DEBUG("buffer arena trimmed %lu KiB", bytes >> 10);
+    }
+    return bytes;
+}
+
+int arena_status(char *buf) {
+    static const char *backing[] = {"disabled", "4KiB pages", "transparent hugepages", "hugetlb"};
+    int buf_cnt = 0;
+    if (arena.base == NULL) {
+        buf_cnt += sprintf(buf + buf_cnt, "  arena:\t\t\t disabled\n");
+        return buf_cnt;
+    }
+    uint64_t used = 0;
+    pthread_mutex_lock(&arena.lock);
+    for (int i = 0; i < ARENA_CLASSES; i++) {
+        used += arena.in_use[i] << (i + ARENA_MIN_SHIFT);
+    }
+    buf_cnt += sprintf(buf + buf_cnt,
+                       "  arena[used:carved:cap]\t [%lu/%zu/%zu] KiB, %s\n",
+                       used >> 10,
+                       arena.carved >> 10,
+                       arena.cap >> 10,
+                       backing[arena.backing]);
+    buf_cnt += sprintf(buf + buf_cnt, "  arena[overflow]\t %lu\n", arena.overflow);
+    buf_cnt += sprintf(buf + buf_cnt, "  arena[trimmed:free]\t [%lu/%u] slabs\n", arena.trimmed, arena.free_slab_cnt);
+    pthread_mutex_unlock(&arena.lock);
+    return buf_cnt;
+}
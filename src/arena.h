@@ -0,0 +1,44 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define ARENA_DEFAULT_MB 64  // default cap of the arena, -o arena=<MiB>
+
+#define ARENA_MIN_SHIFT  8   // smallest buffer class, 256 bytes
+#define ARENA_SLAB_SHIFT 16  // 64KiB slabs, each one holds buffers of a single class, also the largest class
+#define ARENA_CLASSES    (ARENA_SLAB_SHIFT - ARENA_MIN_SHIFT + 1)
+
+/**
+ * @brief set the cap of the arena and whether it is backed by hugepages, must be called before arena_init
+ *
+ * @param cap_mb 0 to disable the arena, every buffer is malloc'd then
+ */
+void arena_config(uint32_t cap_mb, int hugepage);
+int arena_init();
+void arena_exit();
+
+/**
+ * @brief allocate a buffer for a block, a bitmap or any metadata up to 64KiB
+ *
+ * Buffers come from power-of-two free lists carved from one reserved region, backed by 2MiB pages when
+ * possible. Larger requests, and requests beyond the cap, fall back to malloc.
+ */
+void *arena_alloc(size_t size);
+
+/**
+ * @brief free a buffer of arena_alloc, p may be NULL
+ */
+void arena_free(void *p);
+
+/**
+ * @brief give the pages of slabs that have no buffer in use back to the kernel
+ *
+ * @return uint64_t bytes given back
+ */
+uint64_t arena_trim();
+
+int arena_status(char *buf);
+
+#endif
@@ -4,14 +4,27 @@
 #include <stdint.h>
 #include <stdlib.h>
 
+#include "arena.h"
+#include "cache.h"
 #include "disk.h"
 #include "ext4/ext4.h"
 #include "ext4/ext4_inode.h"
 #include "logging.h"
+#include "readahead.h"
 
 struct bitmap i_bitmap;  // inode bitmap
 struct bitmap d_bitmap;  // data bitmap
 
+// bitmaps are used in place if the disk image is mapped, otherwise load a copy
+static uint8_t *bitmap_load(uint64_t off, uint64_t size) {
+    uint8_t *bitmap = disk_map(off, size);
+    if (bitmap == NULL) {
+        bitmap = arena_alloc(size);
+        disk_read(off, size, bitmap);
+    }
+    return bitmap;
+}
+
 int bitmap_init() {
     INFO("init bitmap");
 
@@ -26,14 +39,12 @@ int bitmap_init() {
         INFO("init inode & data bitmap for group %u", i);
         off = BLOCKS2BYTES(EXT4_DESC_INO_BITMAP(gdt[i]));
         size = EXT4_INODES_PER_GROUP(sb) / 8;
-        i_bitmap.group[i].bitmap = malloc(size);
-        disk_read(off, size, i_bitmap.group[i].bitmap);
+        i_bitmap.group[i].bitmap = bitmap_load(off, size);
         i_bitmap.group[i].off = off;
 
         off = BLOCKS2BYTES(EXT4_DESC_BLOCK_BITMAP(gdt[i]));
         size = EXT4_BLOCKS_PER_GROUP(sb) / 8;
-        d_bitmap.group[i].bitmap = malloc(size);
-        disk_read(off, size, d_bitmap.group[i].bitmap);
+        d_bitmap.group[i].bitmap = bitmap_load(off, size);
         d_bitmap.group[i].off = off;
     }
     return 0;
@@ -121,6 +132,17 @@ uint64_t bitmap_pblock_find(uint32_t inode_idx, uint64_t n) {
     return UINT64_MAX;
 }
 
+uint64_t bitmap_pblock_find_near(uint32_t inode_idx, uint64_t goal) {
+    uint32_t group_idx = goal / EXT4_BLOCKS_PER_GROUP(sb);
+    uint32_t index = goal % EXT4_BLOCKS_PER_GROUP(sb);
+    if (goal % EXT4_INODE_PBLOCK_NUM == 0 && group_idx < EXT4_N_BLOCK_GROUPS(sb) &&
+        BIT4(d_bitmap.group[group_idx].bitmap, index / EXT4_INODE_PBLOCK_NUM)) {
+        DEBUG("found free block %lu at goal", goal);
+        return goal;
+    }
+    return bitmap_pblock_find(inode_idx, EXT4_INODE_PBLOCK_NUM);
+}
+
 int bitmap_pblock_set(uint64_t block_idx, int len, int is_used) {
     uint32_t group_idx = block_idx / EXT4_BLOCKS_PER_GROUP(sb);
     uint32_t index = block_idx % EXT4_BLOCKS_PER_GROUP(sb);
@@ -141,9 +163,16 @@ int bitmap_pblock_free(struct pblock_arr *p_arr) {
     struct pblock_range *range;
     for (uint16_t i = 0; i < p_arr->len; i++) {
         range = &p_arr->arr[i];
-        for (uint16_t j = 0; j < range->len; j++) {
+        // blocks are allocated by EXT4_INODE_PBLOCK_NUM, an index block frees the blocks allocated with it
+        for (uint16_t j = 0; j < range->len; j += EXT4_INODE_PBLOCK_NUM) {
             INFO("free pblock %u", range->pblock + j);
-            bitmap_pblock_set(range->pblock + j, 1, 0);
+            bitmap_pblock_set(range->pblock + j, EXT4_INODE_PBLOCK_NUM, 0);
+        }
+        bcache_invalidate(range->pblock, range->len);
+        // a prefetch of the old content must not be served once the blocks belong to another file
+        racache_invalidate(range->pblock, range->len);
+        if (disk_discard(BLOCKS2BYTES(range->pblock), BLOCKS2BYTES(range->len)) < 0) {
+            DEBUG("fail to discard pblock %lu +%u", range->pblock, range->len);
         }
     }
     if (p_arr->len) {
@@ -185,6 +214,19 @@ void gdt_update(uint32_t inode_idx) {
          unused_inodes);
 }
 
+uint64_t bitmap_mem() {
+    uint64_t bytes = 0;
+    for (uint32_t i = 0; i < i_bitmap.group_num; i++) {
+        if (!disk_is_mapped(i_bitmap.group[i].bitmap)) {
+            bytes += EXT4_INODES_PER_GROUP(sb) / 8;
+        }
+        if (!disk_is_mapped(d_bitmap.group[i].bitmap)) {
+            bytes += EXT4_BLOCKS_PER_GROUP(sb) / 8;
+        }
+    }
+    return bytes;
+}
+
 int bitmap_inode_count(uint64_t *used_inode_num, uint64_t *free_inode_num) {
     *used_inode_num = 0;
     *free_inode_num = 0;
@@ -57,6 +57,15 @@ int bitmap_inode_set(uint32_t inode_idx, int is_used);
  */
 uint64_t bitmap_pblock_find(uint32_t inode_idx, uint64_t n);
 
+/**
+ * @brief find EXT4_INODE_PBLOCK_NUM free blocks, at goal if they are free so that a file stays contiguous
+ *
+ * @param inode_idx
+ * @param goal the block after the last one of the file
+ * @return uint64_t UINT64_MAX if no free block
+ */
+uint64_t bitmap_pblock_find_near(uint32_t inode_idx, uint64_t goal);
+
 /**
  * @brief set block bitmap to 1/0
  *
@@ -71,4 +80,9 @@ int bitmap_pblock_free(struct pblock_arr *arr);
 int bitmap_inode_count(uint64_t *used_inode_num, uint64_t *free_inode_num);
 int bitmap_pblock_count(uint64_t *used_pblock_num, uint64_t *free_pblock_num);
 
+/**
+ * @brief memory of the loaded bitmaps, 0 if they are used in the mapped image
+ */
+uint64_t bitmap_mem();
+
 void gdt_update(uint32_t inode_idx);
\ No newline at end of file
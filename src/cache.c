@@ -11,53 +11,376 @@
 
 #include <asm-generic/errno-base.h>
 #include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include "arena.h"
+#include "dentry.h"
 #include "disk.h"
 #include "ext4/ext4.h"
 #include "ext4/ext4_dentry.h"
 #include "ext4/ext4_inode.h"
+#include "extents.h"
 #include "inode.h"
 #include "logging.h"
 
-/* Locking for the dcache is tricky.  What we try to do is to keep insertions
- * and lookups threadsafe by atomic updates.  That keeps the tree safe, but
- * means that eventually there might be duplicated entries.
- * However, when entry pruning is implemented, there might be a need to take
- * real locks into use.
- *
- * About string handling in this file, it should be said that all strings are
- * provided with a length.  The idea is that usually strings are passed here as
- * they appear on the fuse call (with arbitrary directory depth) but we are
- * just interested on one path token.  Such calculation is done somewhere else,
- * so we just take it from whoever calls us.
- * All this hassle is basically to avoid copying around strings. */
-
-struct decache_entry *root;
 struct dcache *dcache;
 struct icache *icache;
 
+static uint32_t bcache_cap = BCACHE_DEFAULT_BLOCKS;
+static uint32_t icache_cap = ICACHE_DEFAULT_COUNT;
+static uint32_t decache_kb = DECACHE_DEFAULT_KB;
+static double decache_neg_timeout = DECACHE_NEG_TIMEOUT;
+static uint32_t pcache_cap = PCACHE_DEFAULT_COUNT;
+
+static void pcache_init();
+
+/*
+ * Buffers are preallocated descriptors, their data is allocated from the arena on first use. Misses
+ * read the block while holding the lock, metadata lookups are serialized by the dcache cursor anyway.
+ */
+static struct {
+    pthread_mutex_t lock;
+    struct bcache_buf *bufs;
+    uint32_t count;  // buffers in use, up to bcache_cap
+    uint32_t hand;   // CLOCK hand
+    struct bcache_buf **hash;
+    uint32_t hash_mask;
+    uint64_t hit;
+    uint64_t miss;
+    uint64_t evict;
+    uint64_t write_back;  // dirty buffers written back
+    uint64_t prefetch;    // blocks read by bcache_prefetch
+    uint32_t alloc;       // buffers holding data, the others were given back by bcache_shrink
+    uint64_t shrunk;      // buffers given back by bcache_shrink
+} bcache = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+void bcache_config(uint32_t blocks) {
+    bcache_cap = blocks < BCACHE_MIN_BLOCKS ? BCACHE_MIN_BLOCKS : blocks;
+}
+
+static void bcache_init() {
+    uint32_t buckets = 1;
+    while (buckets < bcache_cap * 2) {
+        buckets <<= 1;
+    }
+    bcache.bufs = calloc(bcache_cap, sizeof(struct bcache_buf));
+    bcache.hash = calloc(buckets, sizeof(struct bcache_buf *));
+    bcache.hash_mask = buckets - 1;
+    bcache.count = 0;
+    bcache.hand = 0;
+    INFO("bcache init, %u blocks", bcache_cap);
+}
+
+void bcache_exit() {
+    for (uint32_t i = 0; i < bcache.count; i++) {
+        if (bcache.bufs[i].dirty) {
+            WARNING("drop dirty pblock %lu", bcache.bufs[i].pblock);
+        }
+        arena_free(bcache.bufs[i].data);
+    }
+    free(bcache.bufs);
+    free(bcache.hash);
+    bcache.bufs = NULL;
+    bcache.hash = NULL;
+    bcache.count = 0;
+    INFO("bcache exit");
+}
+
+#define BCACHE_BUCKET(__pblock) (&bcache.hash[((__pblock) * 0x9E3779B97F4A7C15ULL >> 32) & bcache.hash_mask])
+
+static struct bcache_buf *bcache_lookup(uint64_t pblock) {
+    for (struct bcache_buf *b = *BCACHE_BUCKET(pblock); b; b = b->hnext) {
+        if (b->pblock == pblock) {
+            return b;
+        }
+    }
+    return NULL;
+}
+
+static void bcache_unhash(struct bcache_buf *b) {
+    struct bcache_buf **p = BCACHE_BUCKET(b->pblock);
+    while (*p != b) {
+        p = &(*p)->hnext;
+    }
+    *p = b->hnext;
+    b->hashed = 0;
+}
+
+// queue a dirty buffer for writing, bcache.lock must be held
+static int bcache_write_back(struct bcache_buf *b) {
+    int ret = disk_write_block_queued(b->pblock, b->data);
+    b->dirty = 0;
+    bcache.write_back++;
+    return ret < 0 ? ret : 0;
+}
+
+// take a free buffer, or evict one with CLOCK, bcache.lock must be held
+static struct bcache_buf *bcache_victim() {
+    if (bcache.count < bcache_cap) {
+        struct bcache_buf *b = &bcache.bufs[bcache.count++];
+        b->data = arena_alloc(BLOCK_SIZE);
+        bcache.alloc++;
+        return b;
+    }
+    // two rounds at most: the first one clears the referenced bits
+    for (uint32_t i = 0; i < bcache_cap * 2; i++) {
+        struct bcache_buf *b = &bcache.bufs[bcache.hand];
+        bcache.hand = (bcache.hand + 1) % bcache_cap;
+        if (b->ref) {
+            continue;
+        }
+        if (b->referenced) {
+            b->referenced = 0;
+            continue;
+        }
+        if (b->dirty && bcache_write_back(b) < 0) {
+            ERR("fail to write back pblock %lu", b->pblock);
+        }
+        if (b->hashed) {
+            bcache_unhash(b);
+            bcache.evict++;
+        }
+        if (b->data == NULL) {
+            b->data = arena_alloc(BLOCK_SIZE);
+            bcache.alloc++;
+        }
+        return b;
+    }
+    return NULL;
+}
+
+struct bcache_buf *bcache_get(uint64_t pblock, int read) {
+    pthread_mutex_lock(&bcache.lock);
+    struct bcache_buf *b = bcache_lookup(pblock);
+    if (b) {
+        b->ref++;
+        b->referenced = 1;
+        bcache.hit++;
+        if (!read && b->ref == 1) {
+            // not while someone else holds it, that would wipe the block under them
+            memset(b->data, 0, BLOCK_SIZE);
+        }
+        pthread_mutex_unlock(&bcache.lock);
+        return b;
+    }
+
+    bcache.miss++;
+    b = bcache_victim();
+    ASSERT(b != NULL);  // all the buffers are pinned, bcache_cap is too small
+    b->pblock = pblock;
+    b->ref = 1;
+    b->referenced = 1;
+    b->dirty = 0;
+    if (read) {
+        disk_read_block(pblock, b->data);
+    } else {
+        memset(b->data, 0, BLOCK_SIZE);
+    }
+    b->hnext = *BCACHE_BUCKET(pblock);
+    *BCACHE_BUCKET(pblock) = b;
+    b->hashed = 1;
+    pthread_mutex_unlock(&bcache.lock);
+    DEBUG("bcache miss pblock %lu", pblock);
+    return b;
+}
+
+void bcache_put(struct bcache_buf *b) {
+    pthread_mutex_lock(&bcache.lock);
+    ASSERT(b->ref > 0);
+    b->ref--;
+    pthread_mutex_unlock(&bcache.lock);
+}
+
+void bcache_mark_dirty(struct bcache_buf *b) {
+    pthread_mutex_lock(&bcache.lock);
+    // an unhashed buffer was invalidated while pinned, its pblock may belong to a file now
+    if (b->hashed) {
+        b->dirty = 1;
+    }
+    pthread_mutex_unlock(&bcache.lock);
+}
+
+int bcache_flush() {
+    int ret = 0;
+    pthread_mutex_lock(&bcache.lock);
+    for (uint32_t i = 0; i < bcache.count; i++) {
+        if (bcache.bufs[i].dirty && bcache_write_back(&bcache.bufs[i]) < 0) {
+            ret = -EIO;
+        }
+    }
+    pthread_mutex_unlock(&bcache.lock);
+    return ret;
+}
+
+int bcache_prefetch(const uint64_t *pblocks, int n) {
+    struct disk_iovec iov[DISK_BATCH_MAX];
+    struct bcache_buf *bufs[DISK_BATCH_MAX];
+    int cnt = 0;
+    ASSERT(n <= DISK_BATCH_MAX);
+
+    pthread_mutex_lock(&bcache.lock);
+    for (int i = 0; i < n; i++) {
+        if (bcache_lookup(pblocks[i])) {
+            continue;
+        }
+        struct bcache_buf *b = bcache_victim();
+        if (b == NULL) {
+            break;
+        }
+        // pinned until read, so that a later victim of this batch can't be one of them
+        b->pblock = pblocks[i];
+        b->ref = 1;
+        b->referenced = 0;
+        b->dirty = 0;
+        b->hnext = *BCACHE_BUCKET(b->pblock);
+        *BCACHE_BUCKET(b->pblock) = b;
+        b->hashed = 1;
+        iov[cnt] = (struct disk_iovec){.where = BLOCKS2BYTES(b->pblock), .size = BLOCK_SIZE, .p = b->data};
+        bufs[cnt++] = b;
+    }
+    int ret = cnt;
+    if (cnt && disk_readv(iov, cnt) != (int)BLOCKS2BYTES(cnt)) {
+        // leave nothing half read behind, the blocks are read again on demand
+        WARNING("fail to prefetch %d blocks", cnt);
+        ret = 0;
+    }
+    for (int i = 0; i < cnt; i++) {
+        bufs[i]->ref = 0;
+        if (ret == 0) {
+            bcache_unhash(bufs[i]);
+        }
+    }
+    bcache.prefetch += ret;
+    pthread_mutex_unlock(&bcache.lock);
+    return ret;
+}
+
+uint64_t bcache_mem() {
+    return (uint64_t)bcache.alloc * BLOCK_SIZE + bcache_cap * sizeof(struct bcache_buf);
+}
+
+uint64_t bcache_shrink(uint64_t bytes) {
+    uint64_t freed = 0;
+    pthread_mutex_lock(&bcache.lock);
+    // clean buffers the CLOCK hand would take first, then any clean one
+    for (int pass = 0; pass < 2 && freed < bytes; pass++) {
+        for (uint32_t i = 0; i < bcache.count && freed < bytes; i++) {
+            struct bcache_buf *b = &bcache.bufs[i];
+            if (b->data == NULL || b->ref || b->dirty || (pass == 0 && b->referenced)) {
+                continue;
+            }
+            if (b->hashed) {
+                bcache_unhash(b);
+            }
+            arena_free(b->data);
+            b->data = NULL;
+            b->referenced = 0;
+            bcache.alloc--;
+            bcache.shrunk++;
+            freed += BLOCK_SIZE;
+        }
+    }
+    pthread_mutex_unlock(&bcache.lock);
+    return freed;
+}
+
+void bcache_invalidate(uint64_t pblock, uint32_t count) {
+    pthread_mutex_lock(&bcache.lock);
+    for (uint32_t i = 0; i < count; i++) {
+        struct bcache_buf *b = bcache_lookup(pblock + i);
+        if (b) {
+            // the block may be reused as file data, a late write back would clobber it. A pinned buffer is
+            // only unhashed, it can't be marked dirty again and is reclaimed once unpinned
+            bcache_unhash(b);
+            b->dirty = 0;
+            b->referenced = 0;
+        }
+    }
+    pthread_mutex_unlock(&bcache.lock);
+}
+
+int bcache_status(char *buf) {
+    int buf_cnt = 0;
+    uint32_t dirty = 0;
+    pthread_mutex_lock(&bcache.lock);
+    for (uint32_t i = 0; i < bcache.count; i++) {
+        dirty += bcache.bufs[i].dirty;
+    }
+    buf_cnt +=
+        sprintf(buf + buf_cnt, "  bcache[used:dirty:cap]\t [%u/%u/%u] blocks\n", bcache.alloc, dirty, bcache_cap);
+    buf_cnt += sprintf(buf + buf_cnt,
+                       "  bcache[hit:miss:evict:write back:prefetch:shrunk]\t [%lu/%lu/%lu/%lu/%lu/%lu]\n",
+                       bcache.hit,
+                       bcache.miss,
+                       bcache.evict,
+                       bcache.write_back,
+                       bcache.prefetch,
+                       bcache.shrunk);
+    pthread_mutex_unlock(&bcache.lock);
+    return buf_cnt;
+}
+
 int cache_init() {
-    decache_init_root(EXT4_ROOT_INO);
-    dcache = malloc(sizeof(struct dcache) + BLOCK_SIZE);
+    decache_init();
+    pcache_init();
+    bcache_init();
+    dcache = malloc(sizeof(struct dcache));
+    dcache->buf = NULL;
+    dcache->bh = NULL;
     dcache->lblock = -1;
     dcache->pblock = -1;
     dcache->inode_idx = 0;
     INFO("dcache init");
 
-    icache = malloc(sizeof(struct icache));
-    icache->entries = calloc(ICACHE_MAX_COUNT, sizeof(struct icache_entry));
-    icache->count = 0;
-    INFO("icache init");
+    icache = calloc(1, sizeof(struct icache));
+    pthread_mutex_init(&icache->lock, NULL);
+    icache->cap = icache_cap;
+    icache->entries = calloc(icache->cap, sizeof(struct icache_entry));
+    uint32_t buckets = 1;
+    while (buckets < icache->cap) {
+        buckets <<= 1;
+    }
+    icache->hash = calloc(buckets, sizeof(struct icache_entry *));
+    icache->ghosts = calloc(icache->cap + 1, sizeof(struct icache_ghost));
+    for (uint32_t i = 0; i <= icache->cap; i++) {
+        icache->ghosts[i].list = ICACHE_NONE;
+        icache->ghosts[i].next = icache->ghost_free;
+        icache->ghost_free = &icache->ghosts[i];
+    }
+    icache->ghost_hash = calloc(buckets, sizeof(struct icache_ghost *));
+    icache->hash_mask = buckets - 1;
+    INFO("icache init, %u inodes", icache->cap);
     return 0;
 }
 
+// switch dcache to pblock, the previous block is unpinned
+static void dcache_set_pblock(uint64_t pblock, int read) {
+    if (dcache->bh) {
+        bcache_put(dcache->bh);
+        dcache->bh = NULL;
+    }
+    // borrow the block from the mapped image if possible, no copy needed
+    dcache->buf = disk_map_block(pblock);
+    if (dcache->buf == NULL) {
+        dcache->bh = bcache_get(pblock, read);
+        dcache->buf = dcache->bh->data;
+    }
+    dcache->pblock = pblock;
+}
+
 void dcache_load_lblock(struct ext4_inode *inode, uint32_t lblock) {
     uint64_t pblock = inode_get_data_pblock(inode, lblock, NULL);
-    disk_read_block(pblock, dcache->buf);
+    dcache_set_pblock(pblock, 1);
+    dcache->lblock = lblock;
+}
+
+void dcache_new_lblock(uint32_t inode_idx, uint32_t lblock, uint64_t pblock) {
+    dcache_set_pblock(pblock, 0);
+    dcache->inode_idx = inode_idx;
     dcache->lblock = lblock;
-    dcache->pblock = pblock;
 }
 
 /**
@@ -68,7 +391,6 @@ void dcache_load_lblock(struct ext4_inode *inode, uint32_t lblock) {
  */
 void dcache_init(struct ext4_inode *inode, uint32_t inode_idx) {
     ASSERT(inode_idx != 0);
-    ICACHE_LRU_INC(inode);  // update lru count
 
     // if already initialized
     if (dcache->inode_idx == inode_idx && dcache->lblock == 0) {
@@ -82,187 +404,675 @@ void dcache_init(struct ext4_inode *inode, uint32_t inode_idx) {
 }
 
 int dcache_write_back() {
-    INFO("write back data to disk");
-    return disk_write_block(dcache->pblock, dcache->buf);
-}
-
-int decache_init_root(uint32_t n) {
-    root = calloc(1, sizeof(struct decache_entry));
-    if (root->inode_idx) {
-        WARNING("Reinitializing dcache not allowed.  Skipped.");
-        return -1;
-    }
-
-    /* Root entry doesn't need most of the fields.  Namely, it only uses the
-     * inode field and the childs pointer. */
-    INFO("Initializing root dcache entry");
-    root->inode_idx = n;
-    root->parent = NULL;
-    root->childs = NULL;  // root entry has no childs for now
-    root->next = NULL;    // root is the root
-    root->count = 0;
-    strcpy(root->name, "/");
+    // a borrowed block is modified in place in the mapped image already
+    if (dcache->bh) {
+        bcache_mark_dirty(dcache->bh);
+    }
     return 0;
 }
 
-/* Inserts a node as a childs of a given parent.  The parent is updated to
- * point the newly inserted childs as the first childs.  We return the new
- * entry so that further entries can be inserted.
+void dcache_forget(uint32_t inode_idx) {
+    if (dcache->inode_idx == inode_idx) {
+        dcache->inode_idx = 0;
+    }
+}
+
+void dcache_exit() {
+    if (dcache->bh) {
+        bcache_put(dcache->bh);
+    }
+    free(dcache);
+    dcache = NULL;
+}
+
+/*
+ * About string handling, all strings are provided with a length. Usually strings are passed here as
+ * they appear on the fuse call (with arbitrary directory depth) but we are just interested on one path
+ * token, so we take its length from whoever calls us instead of copying it.
  */
-struct decache_entry *decache_insert(struct decache_entry *parent, const char *name, int namelen, uint32_t n) {
-    /* TODO: Deal with names that exceed the allocated size */
-    if (namelen + 1 > DCACHE_ENTRY_NAME_LEN)
+static struct {
+    pthread_mutex_t lock;
+    struct decache_entry **hash;
+    uint32_t hash_mask;
+    struct decache_entry *head, *tail;  // LRU list, head is the most recent
+    size_t bytes;                       // memory used by the entries
+    size_t cap;
+    uint32_t count;
+    uint32_t negative;  // negative entries
+    uint64_t hit;
+    uint64_t negative_hit;
+    uint64_t miss;
+    uint64_t evict;
+} decache = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+#define DECACHE_ENTRY_SIZE(__len) (sizeof(struct decache_entry) + (__len))
+#define DECACHE_AVG_SIZE          64  // sizes the hash, a typical entry with a short name
+
+void decache_config(uint32_t kb, double negative_timeout) {
+    decache_kb = kb < DECACHE_MIN_KB ? DECACHE_MIN_KB : kb;
+    decache_neg_timeout = negative_timeout;
+}
+
+double decache_negative_timeout() {
+    return decache_neg_timeout;
+}
+
+uint64_t decache_mem() {
+    return decache.bytes + (decache.hash_mask + 1) * sizeof(struct decache_entry *);
+}
+
+int decache_init() {
+    decache.cap = (size_t)decache_kb << 10;
+    uint32_t buckets = 1;
+    while (buckets < decache.cap / DECACHE_AVG_SIZE) {
+        buckets <<= 1;
+    }
+    decache.hash = calloc(buckets, sizeof(struct decache_entry *));
+    decache.hash_mask = buckets - 1;
+    INFO("decache init, %u KiB, %u buckets", decache_kb, buckets);
+    return 0;
+}
+
+void decache_exit() {
+    struct decache_entry *e = decache.head;
+    while (e) {
+        struct decache_entry *next = e->next;
+        free(e);
+        e = next;
+    }
+    free(decache.hash);
+    decache.hash = NULL;
+    decache.head = decache.tail = NULL;
+    decache.bytes = 0;
+    decache.count = 0;
+}
+
+// FNV-1a of the name, seeded with the parent inode
+static uint32_t decache_hash(uint32_t parent_idx, const char *name, uint64_t namelen) {
+    uint32_t h = 2166136261U ^ parent_idx;
+    for (uint64_t i = 0; i < namelen; i++) {
+        h = (h ^ (uint8_t)name[i]) * 16777619U;
+    }
+    return h;
+}
+
+static void decache_lru_del(struct decache_entry *e) {
+    if (e->prev)
+        e->prev->next = e->next;
+    else
+        decache.head = e->next;
+    if (e->next)
+        e->next->prev = e->prev;
+    else
+        decache.tail = e->prev;
+}
+
+static void decache_lru_push(struct decache_entry *e) {
+    e->prev = NULL;
+    e->next = decache.head;
+    if (decache.head)
+        decache.head->prev = e;
+    else
+        decache.tail = e;
+    decache.head = e;
+}
+
+// decache.lock must be held
+static struct decache_entry *decache_lookup(uint32_t parent_idx, const char *name, uint64_t namelen) {
+    if (namelen > EXT4_NAME_LEN) {
         return NULL;
+    }
+    uint32_t hash = decache_hash(parent_idx, name, namelen);
+    for (struct decache_entry *e = decache.hash[hash & decache.hash_mask]; e; e = e->hnext) {
+        if (e->hash == hash && e->parent_idx == parent_idx && e->name_len == namelen &&
+            memcmp(e->name, name, namelen) == 0) {
+            return e;
+        }
+    }
+    return NULL;
+}
 
-    if (parent == NULL) {
-        parent = root;
-        ASSERT(parent->inode_idx);
-    }
-
-    struct decache_entry *new_entry = calloc(1, sizeof(struct decache_entry));
-    strncpy(new_entry->name, name, namelen);
-    new_entry->name[namelen] = 0;
-    new_entry->inode_idx = n;
-    new_entry->parent = parent;
-
-    if (parent->count == 0) {
-        // add as first child
-        DEBUG("parent has no childs, add as first child %s", new_entry->name);
-        parent->childs = new_entry;
-        new_entry->next = NULL;
-        new_entry->prev = NULL;
-        parent->count = 1;
-        parent->last_child = new_entry;  // first child is the last one
-    } else {
-        // check if parent has enough space
-        if (parent->count == DCACHE_MAX_CHILDREN) {
-            WARNING("parent has no space for new child %s", new_entry->name);
-            // find and remove the last child
-            struct decache_entry *iter = parent->last_child;
-            iter->prev->next = NULL;
-            parent->last_child = iter->prev;
-            parent->count--;
-            INFO("free last child %s", iter->name);
-            decache_free(iter);
-        }
-        // new dentry is inserted as the first child
-        // because it may be used very soon
-        DEBUG("insert as the first child %s", new_entry->name);
-        new_entry->next = parent->childs;
-        new_entry->prev = NULL;
-        parent->childs->prev = new_entry;
-        parent->childs = new_entry;
-        parent->count++;
-        INFO("parent has %d children", parent->count);
-    }
-
-    return new_entry;
-}
-
-struct decache_entry *decache_find(const char **path) {
-    struct decache_entry *next = NULL;
-    struct decache_entry *ret;
-
-    do {
+// unlink e from the hash and the LRU list and free it, decache.lock must be held
+static void decache_remove(struct decache_entry *e) {
+    struct decache_entry **p = &decache.hash[e->hash & decache.hash_mask];
+    while (*p != e) {
+        p = &(*p)->hnext;
+    }
+    *p = e->hnext;
+    decache_lru_del(e);
+    decache.bytes -= DECACHE_ENTRY_SIZE(e->name_len);
+    decache.count--;
+    decache.negative -= e->inode_idx == 0;
+    free(e);
+}
+
+uint32_t decache_find(const char **path, struct pcache_trace *trace) {
+    uint32_t inode_idx = 0;
+    uint32_t parent_idx = EXT4_ROOT_INO;
+
+    pthread_mutex_lock(&decache.lock);
+    for (;;) {
         *path = skip_trailing_backslash(*path);
         uint64_t path_len = get_path_token_len(*path);
-        ret = next;
-
         if (path_len == 0) {
-            return ret;
+            break;
         }
-
-        next = decache_walk(ret, *path, path_len);
-        if (next) {
-            INFO("Found entry in cache: %s", next->name);
-            *path += path_len;
+        struct decache_entry *e = decache_lookup(parent_idx, *path, path_len);
+        if (e == NULL) {
+            decache.miss++;
+            break;
+        }
+        if (trace) {
+            pcache_trace_add(trace, parent_idx);
+        }
+        // move to the front of the LRU list
+        if (decache.head != e) {
+            decache_lru_del(e);
+            decache_lru_push(e);
+        }
+        *path += path_len;
+        if (e->inode_idx == 0) {
+            decache.negative_hit++;
+            DEBUG("Found negative entry in cache: %.*s", (int)path_len, *path - path_len);
+            inode_idx = DECACHE_NEGATIVE;
+            break;
         }
-    } while (next != NULL);
+        decache.hit++;
+        DEBUG("Found entry in cache: %.*s", (int)path_len, *path - path_len);
+        inode_idx = parent_idx = e->inode_idx;
+    }
+    pthread_mutex_unlock(&decache.lock);
+    return inode_idx;
+}
 
-    return ret;
+void decache_insert(uint32_t parent_idx, const char *name, int namelen, uint32_t inode_idx) {
+    if (namelen > EXT4_NAME_LEN) {
+        return;
+    }
+    pthread_mutex_lock(&decache.lock);
+    struct decache_entry *e = decache_lookup(parent_idx, name, namelen);
+    if (e) {
+        decache.negative += (inode_idx == 0) - (e->inode_idx == 0);
+        e->inode_idx = inode_idx;
+        pthread_mutex_unlock(&decache.lock);
+        return;
+    }
+
+    size_t size = DECACHE_ENTRY_SIZE(namelen);
+    while (decache.tail && decache.bytes + size > decache.cap) {
+        DEBUG("evict decache entry %.*s", decache.tail->name_len, decache.tail->name);
+        decache_remove(decache.tail);
+        decache.evict++;
+    }
+    e = malloc(size);
+    if (e == NULL) {
+        pthread_mutex_unlock(&decache.lock);
+        return;
+    }
+    e->parent_idx = parent_idx;
+    e->inode_idx = inode_idx;
+    e->hash = decache_hash(parent_idx, name, namelen);
+    e->name_len = namelen;
+    memcpy(e->name, name, namelen);
+    e->hnext = decache.hash[e->hash & decache.hash_mask];
+    decache.hash[e->hash & decache.hash_mask] = e;
+    decache_lru_push(e);
+    decache.bytes += size;
+    decache.count++;
+    decache.negative += inode_idx == 0;
+    pthread_mutex_unlock(&decache.lock);
+    DEBUG("insert decache entry %.*s in %u", namelen, name, parent_idx);
 }
 
-// Lookup a cache entry for a given file name.  Return value is a struct pointer
-// that can be used to both obtain the inode number and insert further child
-// entries.
-struct decache_entry *decache_walk(struct decache_entry *parent, const char *name, uint64_t namelen) {
-    /* TODO: Prune entries by using the LRU counter */
-    if (parent == NULL) {
-        parent = root;
+void decache_delete(uint32_t parent_idx, const char *name, int namelen) {
+    pthread_mutex_lock(&decache.lock);
+    struct decache_entry *e = decache_lookup(parent_idx, name, namelen);
+    if (e) {
+        INFO("free decache entry %.*s", e->name_len, e->name);
+        decache_remove(e);
     }
+    pthread_mutex_unlock(&decache.lock);
+}
 
-    if (!parent->childs || namelen > EXT4_NAME_LEN) {
-        ASSERT(parent->count == 0);
-        DEBUG("directory has no cached entry");
-        return NULL;
+uint64_t decache_shrink(uint64_t bytes) {
+    uint64_t freed = 0;
+    pthread_mutex_lock(&decache.lock);
+    while (decache.tail && freed < bytes) {
+        freed += DECACHE_ENTRY_SIZE(decache.tail->name_len);
+        decache_remove(decache.tail);
+        decache.evict++;
+    }
+    pthread_mutex_unlock(&decache.lock);
+    return freed;
+}
+
+int decache_status(char *buf) {
+    int buf_cnt = 0;
+    pthread_mutex_lock(&decache.lock);
+    buf_cnt += sprintf(buf + buf_cnt,
+                       "  decache[used:cap]\t [%zu/%zu] KiB, %u entries, %u negative\n",
+                       decache.bytes >> 10,
+                       decache.cap >> 10,
+                       decache.count,
+                       decache.negative);
+    buf_cnt += sprintf(buf + buf_cnt,
+                       "  decache[hit:negative hit:miss:evict]\t [%lu/%lu/%lu/%lu]\n",
+                       decache.hit,
+                       decache.negative_hit,
+                       decache.miss,
+                       decache.evict);
+    pthread_mutex_unlock(&decache.lock);
+    return buf_cnt;
+}
+
+struct pcache_entry {
+    struct pcache_entry *hnext;
+    struct pcache_entry *prev, *next;  // LRU list, most recent first
+    uint32_t hash;
+    uint32_t inode_idx;
+    uint32_t epoch;  // pcache.epoch when it was inserted
+    uint16_t len;
+    uint16_t depth;
+    char *path;  // after the trace, not NUL terminated
+    struct {
+        uint32_t dir;
+        uint32_t gen;
+    } dirs[];
+};
+
+#define PCACHE_ENTRY_SIZE(__depth, __len) \
+    (sizeof(struct pcache_entry) + (__depth) * sizeof(((struct pcache_entry *)0)->dirs[0]) + (__len))
+
+// generation of a directory, directories never changed have none and are at generation 0
+struct pcache_gen {
+    uint32_t dir;
+    uint32_t gen;
+    struct pcache_gen *hnext;
+};
+
+/*
+ * The generation table is bounded by the capacity of the cache. When it is full it is emptied and the
+ * epoch is bumped instead, which invalidates every path at once.
+ */
+static struct {
+    pthread_mutex_t lock;
+    struct pcache_entry **hash;
+    struct pcache_entry *head, *tail;
+    uint32_t count;
+    size_t bytes;  // memory used by the entries
+    struct pcache_gen *gens;
+    struct pcache_gen **gen_hash;
+    uint32_t gen_count;
+    uint32_t hash_mask;
+    uint32_t epoch;
+    uint64_t hit;
+    uint64_t miss;
+    uint64_t stale;
+    uint64_t evict;
+} pcache = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+void pcache_config(uint32_t count) {
+    pcache_cap = count;
+}
+
+static void pcache_init() {
+    if (pcache_cap == 0) {
+        INFO("pcache disabled");
+        return;
+    }
+    uint32_t buckets = 1;
+    while (buckets < pcache_cap) {
+        buckets <<= 1;
     }
+    pcache.hash = calloc(buckets, sizeof(struct pcache_entry *));
+    pcache.gens = calloc(pcache_cap, sizeof(struct pcache_gen));
+    pcache.gen_hash = calloc(buckets, sizeof(struct pcache_gen *));
+    pcache.hash_mask = buckets - 1;
+    INFO("pcache init, %u paths", pcache_cap);
+}
 
-    DEBUG("Looking up decache entry %s in %s", name, parent->name);
-    /* Iterate the list of childs to see if there is any match */
-    struct decache_entry *iter = parent->childs;
-    int idx = 1;
-    do {
-        DEBUG("get decache entry %s [%d/%d]", iter->name, idx, parent->count);
-        if (strncmp(iter->name, name, namelen) == 0 && iter->name[namelen] == 0) {
-            INFO("match decache entry %s == %s", iter->name, name);
-            return iter;
+void pcache_exit() {
+    struct pcache_entry *e = pcache.head;
+    while (e) {
+        struct pcache_entry *next = e->next;
+        free(e);
+        e = next;
+    }
+    free(pcache.hash);
+    free(pcache.gens);
+    free(pcache.gen_hash);
+    pcache.hash = NULL;
+    pcache.head = pcache.tail = NULL;
+    pcache.count = 0;
+    pcache.bytes = 0;
+}
+
+// pcache.lock must be held
+static uint32_t pcache_gen(uint32_t dir) {
+    for (struct pcache_gen *g = pcache.gen_hash[(dir * 0x9E3779B1U) & pcache.hash_mask]; g; g = g->hnext) {
+        if (g->dir == dir) {
+            return g->gen;
         }
-        iter = iter->next;
-        idx++;
-    } while (iter != NULL);
+    }
+    return 0;
+}
 
-    DEBUG("fail to get decached entry %s", name);
+void pcache_trace_add(struct pcache_trace *trace, uint32_t dir) {
+    if (pcache.hash == NULL || trace->depth++ >= PCACHE_MAX_DEPTH) {
+        return;
+    }
+    pthread_mutex_lock(&pcache.lock);
+    trace->dirs[trace->depth - 1].dir = dir;
+    trace->dirs[trace->depth - 1].gen = pcache_gen(dir);
+    pthread_mutex_unlock(&pcache.lock);
+}
+
+void pcache_dir_changed(uint32_t dir) {
+    if (pcache.hash == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&pcache.lock);
+    struct pcache_gen **bucket = &pcache.gen_hash[(dir * 0x9E3779B1U) & pcache.hash_mask];
+    struct pcache_gen *g = *bucket;
+    while (g && g->dir != dir) {
+        g = g->hnext;
+    }
+    if (g == NULL) {
+        if (pcache.gen_count == pcache_cap) {
+            // out of generations, start over from a new epoch
+            memset(pcache.gen_hash, 0, (pcache.hash_mask + 1) * sizeof(struct pcache_gen *));
+            pcache.gen_count = 0;
+            pcache.epoch++;
+            bucket = &pcache.gen_hash[(dir * 0x9E3779B1U) & pcache.hash_mask];
+            DEBUG("pcache generation table full, new epoch %u", pcache.epoch);
+        }
+        g = &pcache.gens[pcache.gen_count++];
+        g->dir = dir;
+        g->gen = 0;
+        g->hnext = *bucket;
+        *bucket = g;
+    }
+    g->gen++;
+    pthread_mutex_unlock(&pcache.lock);
+}
+
+// drop trailing slashes, but keep the root
+static size_t pcache_key_len(const char *path, size_t len) {
+    while (len > 1 && path[len - 1] == '/') {
+        len--;
+    }
+    return len;
+}
+
+static uint32_t pcache_hash(const char *path, size_t len) {
+    uint32_t h = 2166136261U;
+    for (size_t i = 0; i < len; i++) {
+        h = (h ^ (uint8_t)path[i]) * 16777619U;
+    }
+    return h;
+}
+
+// pcache.lock must be held
+static void pcache_remove(struct pcache_entry *e) {
+    struct pcache_entry **p = &pcache.hash[e->hash & pcache.hash_mask];
+    while (*p != e) {
+        p = &(*p)->hnext;
+    }
+    *p = e->hnext;
+    if (e->prev)
+        e->prev->next = e->next;
+    else
+        pcache.head = e->next;
+    if (e->next)
+        e->next->prev = e->prev;
+    else
+        pcache.tail = e->prev;
+    pcache.count--;
+    pcache.bytes -= PCACHE_ENTRY_SIZE(e->depth, e->len);
+    free(e);
+}
+
+static void pcache_lru_push(struct pcache_entry *e) {
+    e->prev = NULL;
+    e->next = pcache.head;
+    if (pcache.head)
+        pcache.head->prev = e;
+    else
+        pcache.tail = e;
+    pcache.head = e;
+}
+
+// pcache.lock must be held
+static struct pcache_entry *pcache_lookup(const char *path, size_t len, uint32_t hash) {
+    for (struct pcache_entry *e = pcache.hash[hash & pcache.hash_mask]; e; e = e->hnext) {
+        if (e->hash == hash && e->len == len && memcmp(e->path, path, len) == 0) {
+            return e;
+        }
+    }
     return NULL;
 }
 
-int decache_delete(const char *path) {
-    const char *tmp = strdup(path);
-    void *p = (void *)tmp;
-    struct decache_entry *entry = decache_find(&tmp);
-    if (!entry) {
-        DEBUG("path %s not found in decache", path);
-        free(p);
+// pcache.lock must be held
+static int pcache_valid(struct pcache_entry *e) {
+    if (e->epoch != pcache.epoch) {
         return 0;
     }
-    struct decache_entry *parent = entry->parent;
-    ASSERT(parent->count != 0);
-    parent->count--;
-    if (parent->count == 0) {
-        // no child
-        ASSERT(parent->childs);
-        free(entry);
-        parent->childs = NULL;
-        parent->last_child = NULL;
-        free(p);
+    for (int i = 0; i < e->depth; i++) {
+        if (pcache_gen(e->dirs[i].dir) != e->dirs[i].gen) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+uint32_t pcache_find(const char *path, size_t len) {
+    if (pcache.hash == NULL) {
         return 0;
     }
-    if (entry->prev == NULL) {
-        // the first child
-        entry->next->prev = NULL;
-        parent->childs = entry->next;
-    } else if (entry->next == NULL) {
-        // the last child
-        entry->prev->next = NULL;
-        parent->last_child = entry->prev;
-    }
-    INFO("free decache entry %s", entry->name);
-    decache_free(entry);
-    free(p);
-    return 0;
+    len = pcache_key_len(path, len);
+    uint32_t hash = pcache_hash(path, len);
+    uint32_t inode_idx = 0;
+
+    pthread_mutex_lock(&pcache.lock);
+    struct pcache_entry *e = pcache_lookup(path, len, hash);
+    if (e && !pcache_valid(e)) {
+        DEBUG("stale pcache entry %.*s", (int)len, path);
+        pcache_remove(e);
+        pcache.stale++;
+        e = NULL;
+    }
+    if (e) {
+        if (pcache.head != e) {
+            if (e->prev)
+                e->prev->next = e->next;
+            if (e->next)
+                e->next->prev = e->prev;
+            else
+                pcache.tail = e->prev;
+            pcache_lru_push(e);
+        }
+        inode_idx = e->inode_idx;
+        pcache.hit++;
+    } else {
+        pcache.miss++;
+    }
+    pthread_mutex_unlock(&pcache.lock);
+    return inode_idx;
 }
 
-void decache_free(struct decache_entry *entry) {
-    if (!entry) {
+void pcache_insert(const char *path, size_t len, uint32_t inode_idx, struct pcache_trace *trace) {
+    if (pcache.hash == NULL || trace->depth > PCACHE_MAX_DEPTH) {
+        return;
+    }
+    len = pcache_key_len(path, len);
+    if (len > UINT16_MAX) {
         return;
     }
-    struct decache_entry *iter = entry->childs;
-    struct decache_entry *iter_next;
-    for (int i = 0; i < entry->count; i++) {
-        iter_next = iter->next;
-        decache_free(iter);
-        iter = iter_next;
+    uint32_t hash = pcache_hash(path, len);
+
+    pthread_mutex_lock(&pcache.lock);
+    struct pcache_entry *e = pcache_lookup(path, len, hash);
+    if (e) {
+        pcache_remove(e);
+    } else if (pcache.count == pcache_cap) {
+        pcache_remove(pcache.tail);
+        pcache.evict++;
+    }
+    size_t dirs_size = trace->depth * sizeof(e->dirs[0]);
+    e = malloc(PCACHE_ENTRY_SIZE(trace->depth, len));
+    if (e == NULL) {
+        pthread_mutex_unlock(&pcache.lock);
+        return;
+    }
+    e->hash = hash;
+    e->inode_idx = inode_idx;
+    e->epoch = pcache.epoch;
+    e->len = len;
+    e->depth = trace->depth;
+    memcpy(e->dirs, trace->dirs, dirs_size);
+    e->path = (char *)e->dirs + dirs_size;
+    memcpy(e->path, path, len);
+    e->hnext = pcache.hash[hash & pcache.hash_mask];
+    pcache.hash[hash & pcache.hash_mask] = e;
+    pcache_lru_push(e);
+    pcache.count++;
+    pcache.bytes += PCACHE_ENTRY_SIZE(e->depth, len);
+    pthread_mutex_unlock(&pcache.lock);
+}
+
+uint64_t pcache_mem() {
+    if (pcache.hash == NULL) {
+        return 0;
+    }
+    uint64_t buckets = pcache.hash_mask + 1;
+    return pcache.bytes + buckets * (sizeof(struct pcache_entry *) + sizeof(struct pcache_gen *)) +
+           pcache_cap * sizeof(struct pcache_gen);
+}
+
+uint64_t pcache_shrink(uint64_t bytes) {
+    uint64_t freed = 0;
+    if (pcache.hash == NULL) {
+        return 0;
+    }
+    pthread_mutex_lock(&pcache.lock);
+    while (pcache.tail && freed < bytes) {
+        freed += PCACHE_ENTRY_SIZE(pcache.tail->depth, pcache.tail->len);
+        pcache_remove(pcache.tail);
+        pcache.evict++;
+    }
+    pthread_mutex_unlock(&pcache.lock);
+    return freed;
+}
+
+int pcache_status(char *buf) {
+    int buf_cnt = 0;
+    if (pcache.hash == NULL) {
+        buf_cnt += sprintf(buf + buf_cnt, "  pcache:\t\t\t disabled\n");
+        return buf_cnt;
+    }
+    pthread_mutex_lock(&pcache.lock);
+    buf_cnt += sprintf(buf + buf_cnt,
+                       "  pcache[used:cap]\t [%u/%u] paths, %u dirs changed, epoch %u\n",
+                       pcache.count,
+                       pcache_cap,
+                       pcache.gen_count,
+                       pcache.epoch);
+    buf_cnt += sprintf(buf + buf_cnt,
+                       "  pcache[hit:miss:stale:evict]\t [%lu/%lu/%lu/%lu]\n",
+                       pcache.hit,
+                       pcache.miss,
+                       pcache.stale,
+                       pcache.evict);
+    pthread_mutex_unlock(&pcache.lock);
+    return buf_cnt;
+}
+
+void icache_config(uint32_t count) {
+    icache_cap = count < ICACHE_MIN_COUNT ? ICACHE_MIN_COUNT : count;
+}
+
+#define ICACHE_BUCKET(__table, __idx) (&(__table)[((__idx) * 0x9E3779B1U) & icache->hash_mask])
+
+// append __e to the tail of list __id, __e is a struct icache_entry or a struct icache_ghost
+#define ICACHE_LIST_PUSH(__id, __e)                   \
+    do {                                              \
+        struct icache_list *__l = &icache->lists[__id]; \
+        typeof(__e) __tail = __l->tail;               \
+        (__e)->list = (__id);                         \
+        (__e)->prev = __tail;                         \
+        (__e)->next = NULL;                           \
+        if (__tail)                                   \
+            __tail->next = (__e);                     \
+        else                                          \
+            __l->head = (__e);                        \
+        __l->tail = (__e);                            \
+        __l->len++;                                   \
+    } while (0)
+
+#define ICACHE_LIST_DEL(__e)                                \
+    do {                                                    \
+        struct icache_list *__l = &icache->lists[(__e)->list]; \
+        if ((__e)->prev)                                    \
+            (__e)->prev->next = (__e)->next;                \
+        else                                                \
+            __l->head = (__e)->next;                        \
+        if ((__e)->next)                                    \
+            (__e)->next->prev = (__e)->prev;                \
+        else                                                \
+            __l->tail = (__e)->prev;                        \
+        __l->len--;                                         \
+        (__e)->list = ICACHE_NONE;                          \
+    } while (0)
+
+#define ICACHE_LEN(__id) (icache->lists[__id].len)
+
+static struct icache_entry *icache_lookup(uint32_t inode_idx) {
+    for (struct icache_entry *e = *ICACHE_BUCKET(icache->hash, inode_idx); e; e = e->hnext) {
+        if (e->inode_idx == inode_idx) {
+            return e;
+        }
+    }
+    return NULL;
+}
+
+static void icache_unhash(struct icache_entry *entry) {
+    struct icache_entry **p = ICACHE_BUCKET(icache->hash, entry->inode_idx);
+    while (*p != entry) {
+        p = &(*p)->hnext;
+    }
+    *p = entry->hnext;
+}
+
+static struct icache_ghost *icache_ghost_lookup(uint32_t inode_idx) {
+    for (struct icache_ghost *g = *ICACHE_BUCKET(icache->ghost_hash, inode_idx); g; g = g->hnext) {
+        if (g->inode_idx == inode_idx) {
+            return g;
+        }
+    }
+    return NULL;
+}
+
+// forget a ghost, its node goes back to the free ones
+static void icache_ghost_del(struct icache_ghost *ghost) {
+    struct icache_ghost **p = ICACHE_BUCKET(icache->ghost_hash, ghost->inode_idx);
+    while (*p != ghost) {
+        p = &(*p)->hnext;
     }
-    free(entry);
+    *p = ghost->hnext;
+    ICACHE_LIST_DEL(ghost);
+    ghost->next = icache->ghost_free;
+    icache->ghost_free = ghost;
+}
+
+// remember inode_idx as the most recent ghost of list id
+static void icache_ghost_add(uint32_t inode_idx, enum icache_list_id id) {
+    struct icache_ghost *ghost = icache->ghost_free;
+    ASSERT(ghost != NULL);
+    icache->ghost_free = ghost->next;
+    ghost->inode_idx = inode_idx;
+    ghost->hnext = *ICACHE_BUCKET(icache->ghost_hash, inode_idx);
+    *ICACHE_BUCKET(icache->ghost_hash, inode_idx) = ghost;
+    ICACHE_LIST_PUSH(id, ghost);
 }
 
 /**
@@ -272,58 +1082,86 @@ void decache_free(struct decache_entry *entry) {
  * @return struct ext4_inode* NULL if not found
  */
 struct ext4_inode *icache_find(uint32_t inode_idx) {
-    for (int i = 0; i < icache->count; i++) {
-        if (icache->entries[i].status != ICACHE_S_INVAL && icache->entries[i].inode_idx == inode_idx) {
-            return &icache->entries[i].inode;
-        }
+    pthread_mutex_lock(&icache->lock);
+    struct icache_entry *entry = icache_lookup(inode_idx);
+    if (entry && entry->status == ICACHE_S_INVAL) {
+        entry = NULL;
     }
-    return NULL;
+    if (entry) {
+        entry->referenced = 1;
+        icache->hit++;
+    } else {
+        icache->miss++;
+    }
+    pthread_mutex_unlock(&icache->lock);
+    return entry ? &entry->inode : NULL;
 }
 
-// if has invalid icache entry, then replace it
-// otherwise find the least recently used inode, and replace it with the given inode
-struct ext4_inode *icache_lru_replace(uint32_t inode_idx, int read_from_disk) {
-    int lru_idx = -1;
-    int lru_count = INT_MAX;
-    uint64_t off;
-    for (int i = 0; i < icache->count; i++) {
-        // find an invalid entry, repalce it
-        if (icache->entries[i].status == ICACHE_S_INVAL) {
-            if (read_from_disk) {
-                off = inode_get_offset(inode_idx);
-                disk_read(off, sizeof(struct ext4_inode), &icache->entries[i].inode);
-            }
-            icache->entries[i].inode_idx = inode_idx;
-            icache->entries[i].status = ICACHE_S_VALID;
-            icache->entries[i].lru_count = 0;
-            icache->entries[i].last_de = NULL;
-            INFO("replace invalid entry %d by inode %d", i, inode_idx + 1);
-            return &icache->entries[i].inode;
-        }
-        // find the least recently used entry
-        if (icache->entries[i].lru_count < lru_count) {
-            lru_idx = i;
-            lru_count = icache->entries[i].lru_count;
-        }
+struct ext4_inode *icache_pin(uint32_t inode_idx) {
+    pthread_mutex_lock(&icache->lock);
+    struct icache_entry *entry = icache_lookup(inode_idx);
+    if (entry && entry->status == ICACHE_S_INVAL) {
+        entry = NULL;
+    }
+    if (entry) {
+        entry->pins++;
+        entry->referenced = 1;
     }
+    pthread_mutex_unlock(&icache->lock);
+    return entry ? &entry->inode : NULL;
+}
 
-    // if the inode is dirty, write it back to disk
-    if (ICACHE_IS_DIRTY(&icache->entries[lru_idx].inode)) {
-        icache_write_back(&icache->entries[lru_idx]);
+void icache_unpin(struct ext4_inode *inode) {
+    struct icache_entry *entry = (struct icache_entry *)inode;
+    pthread_mutex_lock(&icache->lock);
+    ASSERT(entry->pins > 0);
+    entry->pins--;
+    pthread_mutex_unlock(&icache->lock);
+}
+
+// load the inode from its inode-table block, one block read serves all the inodes in it
+static void icache_read(struct icache_entry *entry) {
+    uint64_t off = inode_get_offset(entry->inode_idx);
+    if (disk_map_block(off / BLOCK_SIZE)) {
+        disk_read(off, sizeof(struct ext4_inode), &entry->inode);
+        return;
     }
-    if (read_from_disk) {
-        disk_read(inode_get_offset(inode_idx), sizeof(struct ext4_inode), &icache->entries[lru_idx].inode);
+    struct bcache_buf *b = bcache_get(off / BLOCK_SIZE, 1);
+    memcpy(&entry->inode, b->data + off % BLOCK_SIZE, sizeof(struct ext4_inode));
+    bcache_put(b);
+}
+
+// free one entry with the CAR replace routine, icache->lock must be held
+static struct icache_entry *icache_victim() {
+    for (;;) {
+        enum icache_list_id from = ICACHE_LEN(ICACHE_T1) >= (icache->p > 1 ? icache->p : 1) ? ICACHE_T1 : ICACHE_T2;
+        struct icache_entry *entry = icache->lists[from].head;
+        ICACHE_LIST_DEL(entry);
+        if (entry->pins || (entry->referenced && entry->status != ICACHE_S_INVAL)) {
+            // referenced since it was inserted or last passed by the hand, it moves to (the tail of) t2. A
+            // pinned one goes there too, t1 can't be left holding pinned entries only
+            entry->referenced = 0;
+            ICACHE_LIST_PUSH(ICACHE_T2, entry);
+            continue;
+        }
+        // if the inode is dirty, write it back to disk
+        if (ICACHE_IS_DIRTY(&entry->inode)) {
+            icache_write_back(entry);
+        }
+        icache_unhash(entry);
+        extent_map_drop(&entry->emap);
+        dentry_space_drop(&entry->dspace);
+        if (entry->status != ICACHE_S_INVAL) {
+            icache_ghost_add(entry->inode_idx, from == ICACHE_T1 ? ICACHE_B1 : ICACHE_B2);
+        }
+        icache->evict++;
+        DEBUG("evict inode %u from icache", entry->inode_idx);
+        return entry;
     }
-    icache->entries[lru_idx].inode_idx = inode_idx;
-    icache->entries[lru_idx].status = ICACHE_S_VALID;
-    icache->entries[lru_idx].lru_count = 0;
-    icache->entries[lru_idx].last_de = NULL;
-    INFO("replace lru entry %d by inode %d", lru_idx, inode_idx);
-    return &icache->entries[lru_idx].inode;
 }
 
 /**
- * @brief insert a new inode into icache (LRU if exchange)
+ * @brief insert a new inode into icache (CAR if exchange)
  *
  * @param inode_idx
  * @param read_from_disk if false, only register a new inode in i_cache instead of load from disk
@@ -331,24 +1169,131 @@ struct ext4_inode *icache_lru_replace(uint32_t inode_idx, int read_from_disk) {
  * @return struct ext4_inode*
  */
 struct ext4_inode *icache_insert(uint32_t inode_idx, int read_from_disk) {
-    if (icache->count == ICACHE_MAX_COUNT) {
-        INFO("icache is full");
-        return icache_lru_replace(inode_idx, read_from_disk);
-    } else {
-        icache->entries[icache->count].inode_idx = inode_idx;
-        if (read_from_disk) {
-            uint64_t off = inode_get_offset(inode_idx);
-            disk_read(off, sizeof(struct ext4_inode), &icache->entries[icache->count].inode);
+    pthread_mutex_lock(&icache->lock);
+    // an invalidated entry of the same inode is still hashed, reuse it in place
+    struct icache_entry *entry = icache_lookup(inode_idx);
+    if (entry == NULL) {
+        struct icache_ghost *ghost = icache_ghost_lookup(inode_idx);
+        if (icache->count < icache->cap) {
+            entry = &icache->entries[icache->count++];
+        } else {
+            entry = icache_victim();
+            if (ghost == NULL) {
+                // keep |t1| + |b1| <= cap and the whole directory <= 2 * cap
+                uint32_t resident = ICACHE_LEN(ICACHE_T1) + ICACHE_LEN(ICACHE_T2);
+                if (ICACHE_LEN(ICACHE_T1) + ICACHE_LEN(ICACHE_B1) >= icache->cap && ICACHE_LEN(ICACHE_B1)) {
+                    icache_ghost_del(icache->lists[ICACHE_B1].head);
+                } else if (resident + ICACHE_LEN(ICACHE_B1) + ICACHE_LEN(ICACHE_B2) >= 2 * icache->cap &&
+                           ICACHE_LEN(ICACHE_B2)) {
+                    icache_ghost_del(icache->lists[ICACHE_B2].head);
+                }
+            }
+        }
+
+        if (ghost == NULL) {
+            ICACHE_LIST_PUSH(ICACHE_T1, entry);
+        } else {
+            // evicted too early: give more room to the list it was evicted from
+            uint32_t b1 = ICACHE_LEN(ICACHE_B1), b2 = ICACHE_LEN(ICACHE_B2);
+            if (ghost->list == ICACHE_B1) {
+                uint32_t delta = b2 > b1 ? b2 / b1 : 1;
+                icache->p = icache->p + delta < icache->cap ? icache->p + delta : icache->cap;
+                icache->ghost_hit[0]++;
+            } else {
+                uint32_t delta = b1 > b2 ? b1 / b2 : 1;
+                icache->p = icache->p > delta ? icache->p - delta : 0;
+                icache->ghost_hit[1]++;
+            }
+            icache_ghost_del(ghost);
+            ICACHE_LIST_PUSH(ICACHE_T2, entry);
         }
-        icache->entries[icache->count].status = ICACHE_S_VALID;
-        icache->entries[icache->count].lru_count = 0;
-        icache->entries[icache->count].last_de = NULL;
-        icache->count++;
-        INFO("insert inode %d into icache", inode_idx);
-        return &icache->entries[icache->count - 1].inode;
+        entry->inode_idx = inode_idx;
+        entry->hnext = *ICACHE_BUCKET(icache->hash, inode_idx);
+        *ICACHE_BUCKET(icache->hash, inode_idx) = entry;
     }
+    if (read_from_disk) {
+        icache_read(entry);
+    }
+    entry->status = ICACHE_S_VALID;
+    entry->referenced = 0;
+    // a reused entry may still hold the map of the unlinked inode
+    extent_map_drop(&entry->emap);
+    dentry_space_drop(&entry->dspace);
+    entry->grow_chunks = 0;
+    entry->dead = 0;
+    pthread_mutex_unlock(&icache->lock);
+    INFO("insert inode %d into icache", inode_idx);
+    return &entry->inode;
 }
 
 void icache_write_back(struct icache_entry *entry) {
-    disk_write(inode_get_offset(entry->inode_idx), sizeof(struct ext4_inode), &entry->inode);
-}
\ No newline at end of file
+    uint64_t off = inode_get_offset(entry->inode_idx);
+    if (disk_map_block(off / BLOCK_SIZE)) {
+        disk_write_queued(off, sizeof(struct ext4_inode), &entry->inode);
+        return;
+    }
+    // update the cached inode-table block, a later load of a neighbour must see this inode
+    struct bcache_buf *b = bcache_get(off / BLOCK_SIZE, 1);
+    memcpy(b->data + off % BLOCK_SIZE, &entry->inode, sizeof(struct ext4_inode));
+    bcache_mark_dirty(b);
+    bcache_put(b);
+}
+
+void icache_prefetch(const uint32_t *inode_idxs, int n) {
+    uint64_t pblocks[DISK_BATCH_MAX];
+    int cnt = 0;
+    if (n == 0 || disk_map_block(inode_get_offset(inode_idxs[0]) / BLOCK_SIZE)) {
+        // nothing to read ahead from the mapped image
+        return;
+    }
+    for (int i = 0; i < n; i++) {
+        pthread_mutex_lock(&icache->lock);
+        struct icache_entry *entry = icache_lookup(inode_idxs[i]);
+        int cached = entry && entry->status != ICACHE_S_INVAL;
+        pthread_mutex_unlock(&icache->lock);
+        uint64_t pblock = inode_get_offset(inode_idxs[i]) / BLOCK_SIZE;
+        // neighbours mostly share a block, only compare with the last one
+        if (cached || (cnt && pblocks[cnt - 1] == pblock)) {
+            continue;
+        }
+        if (cnt == DISK_BATCH_MAX) {
+            bcache_prefetch(pblocks, cnt);
+            cnt = 0;
+        }
+        pblocks[cnt++] = pblock;
+    }
+    if (cnt) {
+        bcache_prefetch(pblocks, cnt);
+    }
+}
+
+uint64_t icache_mem() {
+    // entries are allocated for the whole capacity but only touched ones take memory
+    return (uint64_t)icache->count * sizeof(struct icache_entry) +
+           (uint64_t)(icache->cap + 1) * sizeof(struct icache_ghost) + extent_map_mem() +
+           dentry_space_mem();
+}
+
+int icache_status(char *buf) {
+    int buf_cnt = 0;
+    pthread_mutex_lock(&icache->lock);
+    buf_cnt += sprintf(buf + buf_cnt,
+                       "  icache[t1:t2:p:cap]\t [%u/%u/%u/%u] inodes\n",
+                       ICACHE_LEN(ICACHE_T1),
+                       ICACHE_LEN(ICACHE_T2),
+                       icache->p,
+                       icache->cap);
+    buf_cnt += sprintf(buf + buf_cnt,
+                       "  icache[hit:miss:evict]\t [%lu/%lu/%lu]\n",
+                       icache->hit,
+                       icache->miss,
+                       icache->evict);
+    buf_cnt += sprintf(buf + buf_cnt,
+                       "  icache[b1:b2 ghost hit]\t [%u/%u %lu/%lu]\n",
+                       ICACHE_LEN(ICACHE_B1),
+                       ICACHE_LEN(ICACHE_B2),
+                       icache->ghost_hit[0],
+                       icache->ghost_hit[1]);
+    pthread_mutex_unlock(&icache->lock);
+    return buf_cnt;
+}
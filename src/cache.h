@@ -2,47 +2,202 @@
 #define DCACHE_H
 
 #include <linux/limits.h>
+#include <pthread.h>
 #include <stdint.h>
 
 #include "common.h"
 #include "ext4/ext4.h"
 #include "ext4/ext4_dentry.h"
 #include "ext4/ext4_inode.h"
+#include "extents.h"
 
-struct decache_entry;
-struct decache_entry *decache_insert(struct decache_entry *parent, const char *name, int namelen, uint32_t n);
-struct decache_entry *decache_walk(struct decache_entry *parent, const char *name, uint64_t namelen);
-int decache_init_root(uint32_t n);
-void decache_free(struct decache_entry *entry);
-struct decache_entry *decache_find(const char **path);
-int decache_delete(const char *path);
+#define DECACHE_DEFAULT_KB  8192  // default memory bound of the dentry cache, -o decache=<KiB>
+#define DECACHE_MIN_KB      64
+#define DECACHE_NEG_TIMEOUT 1.0   // default kernel negative entry timeout in seconds, -o negative_timeout=<s>
 
-#define DCACHE_ENTRY_NAME_LEN NAME_MAX
-
-/* This struct declares a node of a k-tree.  Every node has a pointer to one of
- * the childs and a pointer (in a circular list fashion) to its siblings. */
+#define DECACHE_NEGATIVE UINT32_MAX  // returned by decache_find for a name cached as missing
 
+/*
+ * Dentry cache, one global hash keyed by (parent inode, name) with a global LRU. Entries are sized to
+ * their name and the whole cache is bounded in bytes, the least recently used entries are dropped when
+ * it is full. A negative entry (inode_idx 0) remembers a name that does not exist, it is replaced by
+ * decache_insert when the name is created.
+ */
 struct decache_entry {
-    struct decache_entry *parent;
-    struct decache_entry *childs;
-    struct decache_entry *last_child;
-    struct decache_entry *prev;
-    struct decache_entry *next;
-    uint32_t inode_idx;
-    uint32_t count;
-    char name[DCACHE_ENTRY_NAME_LEN + 1];
+    struct decache_entry *hnext;       // next entry in the same hash bucket
+    struct decache_entry *prev, *next;  // LRU list, most recent first
+    uint32_t parent_idx;
+    uint32_t inode_idx;  // 0 for a negative entry
+    uint32_t hash;
+    uint16_t name_len;
+    char name[];  // not NUL terminated
+};
+
+/**
+ * @brief set the memory bound of the dentry cache, must be called before cache_init
+ *
+ * @param negative_timeout seconds the kernel keeps a failed lookup, 0 to disable
+ */
+void decache_config(uint32_t kb, double negative_timeout);
+double decache_negative_timeout();
+int decache_init();
+void decache_exit();
+
+#define PCACHE_DEFAULT_COUNT 16384  // default capacity of the path cache, -o pcache=<paths>, 0 to disable
+#define PCACHE_MAX_DEPTH     32     // paths through more directories are not cached
+#define PCACHE_PATH_MEM      160    // memory of a typical path, sizes the cache from the memory budget
+
+// directories a path was resolved through, with their generations at that time
+struct pcache_trace {
+    int depth;  // > PCACHE_MAX_DEPTH if the path is too deep to be cached
+    struct {
+        uint32_t dir;
+        uint32_t gen;
+    } dirs[PCACHE_MAX_DEPTH];
 };
 
-#define DCACHE_MAX_CHILDREN 20  // each directory can have at most 20 children
+/**
+ * @brief resolve the leading components of path from the root
+ *
+ * @param path advanced past the components found
+ * @param trace if not NULL, the directories walked are added to it
+ * @return uint32_t inode of the last component found, 0 if not even the first one is cached,
+ * DECACHE_NEGATIVE if a component is cached as missing
+ */
+uint32_t decache_find(const char **path, struct pcache_trace *trace);
+
+/**
+ * @brief cache name in the directory parent_idx, or update its inode if already cached
+ *
+ * @param inode_idx 0 to cache a failed lookup
+ */
+void decache_insert(uint32_t parent_idx, const char *name, int namelen, uint32_t inode_idx);
+
+/**
+ * @brief drop name in the directory parent_idx if it is cached
+ *
+ * Keyed like decache_insert so that the entry goes whether its ancestors are still cached or not, a stale
+ * one would resolve to the removed inode once they are cached again.
+ */
+void decache_delete(uint32_t parent_idx, const char *name, int namelen);
 
-// inode directory cache
+/**
+ * @brief memory used by the dentry cache, and evict the least recently used entries to free bytes
+ */
+uint64_t decache_mem();
+uint64_t decache_shrink(uint64_t bytes);
+int decache_status(char *buf);
+
+/*
+ * Path cache, full path -> inode, consulted before any component is resolved. Every directory has a
+ * generation that is bumped when one of its names is removed or points to another inode (unlink, rmdir,
+ * rename). A cached path is valid as long as the directories it was resolved through keep the generation
+ * recorded in its trace. Adding a name never invalidates a path, only found paths are cached.
+ */
+void pcache_config(uint32_t count);
+void pcache_exit();
+
+/**
+ * @brief find a path of len bytes, trailing slashes are ignored
+ *
+ * @return uint32_t the inode, 0 if not cached or stale
+ */
+uint32_t pcache_find(const char *path, size_t len);
+void pcache_insert(const char *path, size_t len, uint32_t inode_idx, struct pcache_trace *trace);
+
+/**
+ * @brief add dir with its current generation to trace
+ */
+void pcache_trace_add(struct pcache_trace *trace, uint32_t dir);
+
+/**
+ * @brief invalidate the cached paths resolved through dir, called when a name of dir is removed or
+ * replaced
+ */
+void pcache_dir_changed(uint32_t dir);
+uint64_t pcache_mem();
+uint64_t pcache_shrink(uint64_t bytes);
+int pcache_status(char *buf);
+
+/*
+ * Buffer cache of metadata blocks keyed by pblock. A buffer is pinned by bcache_get and unpinned by
+ * bcache_put, pinned buffers are never evicted. Dirty buffers are written back when they are evicted
+ * (CLOCK) or by bcache_flush.
+ */
+struct bcache_buf {
+    uint64_t pblock;
+    uint8_t *data;             // BLOCK_SIZE bytes from the arena
+    uint32_t ref;              // pin count
+    uint8_t dirty;             // modified since it was read or written back
+    uint8_t referenced;        // CLOCK bit, set on every hit
+    uint8_t hashed;            // in the hash index
+    struct bcache_buf *hnext;  // next buffer in the same hash bucket
+};
+
+#define BCACHE_DEFAULT_BLOCKS 1024  // default capacity, -o bcache=<blocks>
+#define BCACHE_MIN_BLOCKS     16
+
+/**
+ * @brief set the capacity of the buffer cache in blocks, must be called before cache_init
+ */
+void bcache_config(uint32_t blocks);
+void bcache_exit();
+
+/**
+ * @brief get the pinned buffer of pblock
+ *
+ * @param pblock
+ * @param read read the block from disk on miss, otherwise the buffer is zeroed and filled by the caller. A
+ * buffer pinned by someone else is returned as is
+ * @return struct bcache_buf*
+ */
+struct bcache_buf *bcache_get(uint64_t pblock, int read);
+void bcache_put(struct bcache_buf *b);
+void bcache_mark_dirty(struct bcache_buf *b);
+
+/**
+ * @brief write back all the dirty buffers, they reach the disk at the next disk_flush
+ *
+ * @return int 0 on success, -EIO if the write-back queue failed to flush on the way
+ */
+int bcache_flush();
+
+/**
+ * @brief read the blocks not cached yet in one vectored request, they are not pinned
+ *
+ * Prefetched buffers start with the CLOCK bit clear, a guess that is never used is the first to go.
+ *
+ * @param pblocks
+ * @param n no more than DISK_BATCH_MAX
+ * @return int number of blocks read
+ */
+int bcache_prefetch(const uint64_t *pblocks, int n);
+
+/**
+ * @brief drop count blocks from pblock without write back, called when they are freed
+ *
+ * A buffer still pinned is detached from its block, bcache_mark_dirty on it is a no-op.
+ */
+void bcache_invalidate(uint64_t pblock, uint32_t count);
+
+/**
+ * @brief memory used by the buffer cache, and give back the data of clean unpinned buffers to free bytes
+ */
+uint64_t bcache_mem();
+uint64_t bcache_shrink(uint64_t bytes);
+int bcache_status(char *buf);
+
+// the directory block being walked by dentry_next, backed by the buffer cache
 struct dcache {
-    uint32_t inode_idx;  // current inode_idx
-    uint32_t lblock;     // current logic block id
-    uint32_t pblock;     // current physical block id, for quick write back
-    uint8_t buf[];       // buffer
+    uint32_t inode_idx;     // current inode_idx
+    uint32_t lblock;        // current logic block id
+    uint32_t pblock;        // current physical block id, for quick write back
+    uint8_t *buf;           // block content, borrowed from the mapped disk image or bh->data
+    struct bcache_buf *bh;  // buffer pinned for the block, NULL if borrowed from the mapped image
 };
 
+extern struct dcache *dcache;
+
 int cache_init();
 
 /**
@@ -53,43 +208,117 @@ int cache_init();
  */
 void dcache_init(struct ext4_inode *inode, uint32_t inode_idx);
 void dcache_load_lblock(struct ext4_inode *inode, uint32_t lblock);
+
+/**
+ * @brief point dcache to a newly allocated block, the content is filled by the caller
+ *
+ * @param inode_idx
+ * @param lblock
+ * @param pblock
+ */
+void dcache_new_lblock(uint32_t inode_idx, uint32_t lblock, uint64_t pblock);
+
+/**
+ * @brief mark the current dcache block dirty, it is written back by bcache_flush or on eviction
+ */
 int dcache_write_back();
 
-#define ICACHE_MAX_COUNT 64
+/**
+ * @brief the blocks of a directory were rewritten behind dcache, its next dcache_init reloads block 0
+ */
+void dcache_forget(uint32_t inode_idx);
 
-// TODO: hashmap
-struct icache {
-    struct icache_entry *entries;
-    uint32_t count;
-};
+/**
+ * @brief unpin the current block and free dcache
+ */
+void dcache_exit();
+
+#define ICACHE_DEFAULT_COUNT 4096  // default capacity, -o icache=<inodes>
+#define ICACHE_MIN_COUNT     16
+// memory of a cached inode with its ghost and hash slots, sizes the cache from the memory budget
+#define ICACHE_INODE_MEM (sizeof(struct icache_entry) + sizeof(struct icache_ghost) + 4 * sizeof(void *))
+
+// lists of the replacement policy, see struct icache
+enum icache_list_id { ICACHE_T1, ICACHE_T2, ICACHE_B1, ICACHE_B2, ICACHE_NONE };
 
 struct icache_entry {
     struct ext4_inode inode;           // inode cached
     uint32_t inode_idx;                // inode index
-    uint32_t lru_count;                // lru count
+    uint8_t referenced;                // CLOCK bit, set on every hit
+    uint8_t list;                      // ICACHE_T1 or ICACHE_T2
     int status;                        // empty, valid, dirty
-    struct ext4_dir_entry_2 *last_de;  // last dentry offset(only for dir)
-                                       // used for quick dentry_last()
+    struct extent_map *emap;           // extents of a tree deeper than i_block, built on first lookup
+    struct dentry_space *dspace;       // free space of every block (only for dir), built on first insert
+    uint32_t grow_chunks;              // chunks the directory grew by last time, see dentry_block_append
+    uint32_t grow_time;                // seconds of the last growth of the directory
+    uint32_t dead;                     // bytes of the dentries deleted since the directory was last scanned
+    uint32_t pins;                     // holders of icache_pin, a pinned entry is never evicted
+    struct icache_entry *hnext;        // next entry in the same hash bucket
+    struct icache_entry *prev, *next;  // neighbours in t1 or t2
+};
+
+// an inode evicted recently, only its number is remembered
+struct icache_ghost {
+    uint32_t inode_idx;
+    uint8_t list;  // ICACHE_B1, ICACHE_B2, or ICACHE_NONE if free
+    struct icache_ghost *hnext;
+    struct icache_ghost *prev, *next;  // neighbours in b1 or b2, next links the free ones
+};
+
+struct icache_list {
+    void *head;  // CLOCK hand for t1/t2, LRU end for b1/b2
+    void *tail;
+    uint32_t len;
+};
+
+/*
+ * The replacement policy is CAR (CLOCK with Adaptive Replacement), ARC with CLOCK lists so that a hit
+ * only sets a bit. t1 holds inodes seen once recently, t2 inodes seen at least twice; b1 and b2 remember
+ * the inodes evicted from them. A hit in b1 grows the target size p of t1, a hit in b2 shrinks it, so a
+ * one-shot scan only cycles through t1 and leaves the working set in t2 alone.
+ *
+ * An invalidated entry stays hashed until it is reused by the same inode or evicted, it is evicted first
+ * and leaves no ghost.
+ */
+struct icache {
+    pthread_mutex_t lock;  // protects the index and the lists, not the inodes
+    struct icache_entry *entries;
+    uint32_t count;  // entries in use, up to cap
+    uint32_t cap;
+    struct icache_entry **hash;
+    struct icache_ghost *ghosts;  // cap + 1 nodes, one extra for the ghost added before the oldest is dropped
+    struct icache_ghost **ghost_hash;
+    struct icache_ghost *ghost_free;  // unused ghosts, linked by next
+    uint32_t hash_mask;
+    struct icache_list lists[4];  // indexed by enum icache_list_id
+    uint32_t p;                   // target size of t1
+    uint64_t hit;
+    uint64_t miss;
+    uint64_t ghost_hit[2];  // misses found in b1, b2
+    uint64_t evict;
 };
 
 #define ICACHE_S_INVAL 0
 #define ICACHE_S_VALID 1
 #define ICACHE_S_DIRTY 2
 
-#define ICACHE_LRU_INC(inode)                                       \
-    do {                                                            \
-        if (((struct icache_entry *)inode)->lru_count < UINT32_MAX) \
-            (((struct icache_entry *)inode)->lru_count++);          \
-    } while (0)
-
 #define ICACHE_SET_INVAL(inode)       (((struct icache_entry *)(inode))->status = ICACHE_S_INVAL)
 #define ICACHE_SET_DIRTY(inode)       (((struct icache_entry *)(inode))->status = ICACHE_S_DIRTY)
 #define ICACHE_IS_DIRTY(inode)        (((struct icache_entry *)(inode))->status == ICACHE_S_DIRTY)
 #define ICACHE_IS_VALID(inode)        (((struct icache_entry *)(inode))->status != ICACHE_S_INVAL)
-// last dentry offset macro
-#define ICACHE_CHECK_LAST_DE(inode)   (ICACHE_IS_VALID(inode) && ((struct icache_entry *)(inode))->last_de != NULL)
-#define ICACHE_GET_LAST_DE(inode)     (((struct icache_entry *)(inode))->last_de)
-#define ICACHE_SET_LAST_DE(inode, de) (((struct icache_entry *)(inode))->last_de = (de))
+#define ICACHE_EXTENT_MAP(inode)      (((struct icache_entry *)(inode))->emap)
+#define ICACHE_DENTRY_SPACE(inode)    (((struct icache_entry *)(inode))->dspace)
+#define ICACHE_GROW_CHUNKS(inode)     (((struct icache_entry *)(inode))->grow_chunks)
+#define ICACHE_GROW_TIME(inode)       (((struct icache_entry *)(inode))->grow_time)
+#define ICACHE_DEAD_BYTES(inode)      (((struct icache_entry *)(inode))->dead)
+
+/**
+ * @brief prefetch the inode-table blocks of n inodes into bcache, so that loading them costs no read
+ *
+ * @param inode_idxs
+ * @param n
+ */
+void icache_prefetch(const uint32_t *inode_idxs, int n);
 
 /**
  * @brief find inode in icache
@@ -100,7 +329,21 @@ struct icache_entry {
 struct ext4_inode *icache_find(uint32_t inode_idx);
 
 /**
- * @brief insert a new inode into icache (LRU if exchange)
+ * @brief find inode in icache and keep it there until icache_unpin, for work that outlives a request
+ *
+ * @param inode_idx
+ * @return struct ext4_inode* NULL if not found
+ */
+struct ext4_inode *icache_pin(uint32_t inode_idx);
+void icache_unpin(struct ext4_inode *inode);
+
+/**
+ * @brief set the capacity of the inode cache, must be called before cache_init
+ */
+void icache_config(uint32_t count);
+
+/**
+ * @brief insert a new inode into icache (CLOCK if exchange)
  *
  * @param inode_idx
  * @param read_from_disk if false, only register a new inode in i_cache instead of load from disk
@@ -111,4 +354,10 @@ struct ext4_inode *icache_insert(uint32_t inode_idx, int read_from_disk);
 
 void icache_write_back(struct icache_entry *entry);
 
+/**
+ * @brief memory used by the inode cache, entries are never given back but their extent maps count
+ */
+uint64_t icache_mem();
+int icache_status(char *buf);
+
 #endif
@@ -25,6 +25,8 @@
         __x < __y ? __x : __y; \
     })
 
+#define ARRAY_SIZE(__arr) (sizeof(__arr) / sizeof((__arr)[0]))
+
 #define STATIC_ASSERT(e) static char const static_assert[(e) ? 1 : -1] = {'!'}
 
 #include <limits.h>
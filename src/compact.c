@@ -0,0 +1,384 @@
+#include "compact.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include "bitmap.h"
+#include "cache.h"
+#include "dentry.h"
+#include "disk.h"
+#include "ext4/ext4.h"
+#include "ext4/ext4_dentry.h"
+#include "extents.h"
+#include "htree.h"
+#include "inode.h"
+#include "logging.h"
+
+/*
+ * dentry_delete only merges a dentry into the one before it, a directory never gives its blocks back and
+ * every scan still reads all of them. The bytes of the dentries deleted since a directory was last scanned
+ * are counted in its icache entry, once they take (100 - COMPACT_LIVE_PCT) percent of its blocks the
+ * directory is queued to a background thread. The thread waits until no dentry was deleted in it for
+ * COMPACT_DELAY_SEC, so that a directory being emptied is compacted once at the end.
+ *
+ * Compaction reads every block into a private copy, lays out the live dentries again in as few blocks as
+ * possible (in hash order with a new index for a hash-indexed directory) and writes them over the first
+ * blocks, i_size shrinks and the chunks after the last block are unmapped and freed.
+ *
+ * Requests read and change directories without any lock against each other, but a compaction moves every
+ * dentry and frees blocks a request may be walking. Every request holds compact_lock shared from start to
+ * end and a compaction holds it exclusive, so it runs between requests and keeps the directory pinned in
+ * icache. The lock prefers readers (the glibc default): a request never waits for a compaction that is
+ * only queued, a nested shared lock can't deadlock, and the compaction waits for a gap in the requests.
+ */
+
+static pthread_rwlock_t compact_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+struct compact_request {
+    uint32_t inode_idx;
+    uint32_t time;  // seconds of the last dentry deleted in the directory
+};
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct compact_request reqs[COMPACT_QUEUE_LEN];
+    uint32_t head;
+    uint32_t tail;
+    int stop;
+    int running;
+} compact_queue = {.lock = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER};
+
+static struct {
+    uint64_t queued;     // directories queued
+    uint64_t dropped;    // directories not queued because the queue is full
+    uint64_t compacted;  // directories compacted
+    uint64_t skipped;    // directories scanned with enough live dentries or nothing to gain
+    uint64_t blocks;     // blocks taken off the directories
+    uint64_t freed;      // blocks given back to the disk
+} compact_stat;
+
+static pthread_t compact_thread_id;
+
+// a copy of the block, dirty buffers of bcache are newer than the disk
+static void compact_block_read(uint64_t pblock, uint8_t *buf) {
+    uint8_t *mapped = disk_map_block(pblock);
+    if (mapped) {
+        memcpy(buf, mapped, BLOCK_SIZE);
+        return;
+    }
+    struct bcache_buf *b = bcache_get(pblock, 1);
+    memcpy(buf, b->data, BLOCK_SIZE);
+    bcache_put(b);
+}
+
+static void compact_block_write(uint64_t pblock, const uint8_t *buf) {
+    uint8_t *mapped = disk_map_block(pblock);
+    if (mapped) {
+        memcpy(mapped, buf, BLOCK_SIZE);
+        return;
+    }
+    struct bcache_buf *b = bcache_get(pblock, 0);
+    memcpy(b->data, buf, BLOCK_SIZE);
+    bcache_mark_dirty(b);
+    bcache_put(b);
+}
+
+// pack the dentries in order into linear blocks, the blocks used or -ENOSPC if they are more than max_blocks
+static int compact_pack_linear(struct ext4_dir_entry_2 *const *des, uint32_t n, uint8_t *out, uint32_t max_blocks) {
+    uint32_t blocks = 0;
+    uint32_t offset = BLOCK_SIZE;
+    struct ext4_dir_entry_2 *last = NULL;
+    for (uint32_t i = 0; i < n; i++) {
+        uint16_t rec_len = DE_REAL_REC_LEN(des[i]);
+        if (offset + rec_len > BLOCK_SIZE - EXT4_DE_TAIL_SIZE) {
+            if (last) {
+                last->rec_len += BLOCK_SIZE - EXT4_DE_TAIL_SIZE - offset;
+            }
+            if (blocks == max_blocks) {
+                return -ENOSPC;
+            }
+            dentry_block_init(out + (uint64_t)blocks++ * BLOCK_SIZE);
+            offset = 0;
+        }
+        last = (struct ext4_dir_entry_2 *)(out + (uint64_t)(blocks - 1) * BLOCK_SIZE + offset);
+        memcpy(last, des[i], rec_len);
+        last->rec_len = rec_len;
+        offset += rec_len;
+    }
+    if (last) {
+        last->rec_len += BLOCK_SIZE - EXT4_DE_TAIL_SIZE - offset;
+    }
+    return blocks;
+}
+
+// collect the live dentries of the copy of the directory, -EINVAL if a block is not made of dentries
+static int compact_collect(uint8_t *old, uint32_t nblocks, struct ext4_dir_entry_2 **des, uint32_t *n,
+                           uint64_t *live) {
+    *n = 0;
+    *live = 0;
+    for (uint32_t lblock = 0; lblock < nblocks; lblock++) {
+        uint8_t *buf = old + (uint64_t)lblock * BLOCK_SIZE;
+        for (uint32_t offset = 0; offset + EXT4_DE_BASE_SIZE <= BLOCK_SIZE;) {
+            struct ext4_dir_entry_2 *de = (struct ext4_dir_entry_2 *)(buf + offset);
+            if (de->rec_len == 0) {
+                // the rest of the block was never written
+                break;
+            }
+            if (de->rec_len < EXT4_DE_BASE_SIZE || offset + de->rec_len > BLOCK_SIZE ||
+                (de->inode_idx && DE_REAL_REC_LEN(de) > de->rec_len)) {
+                WARNING("bad dentry at %u of block %u", offset, lblock);
+                return -EINVAL;
+            }
+            if (de->inode_idx) {
+                des[(*n)++] = de;
+                *live += DE_REAL_REC_LEN(de);
+            }
+            offset += de->rec_len;
+        }
+    }
+    return 0;
+}
+
+// whether block 0 starts with . and .. where the root of the hash index expects them
+static int compact_root_ok(uint8_t *root, struct ext4_dir_entry_2 *const *des, uint32_t n) {
+    struct ext4_dir_entry_2 *dot = (struct ext4_dir_entry_2 *)root;
+    struct ext4_dir_entry_2 *dotdot = (struct ext4_dir_entry_2 *)(root + EXT4_DE_DOT_SIZE);
+    return n >= 2 && des[0] == dot && des[1] == dotdot && dot->rec_len == EXT4_DE_DOT_SIZE &&
+           dot->name_len == 1 && dotdot->name_len == 2;
+}
+
+void compact_lock_shared() {
+    pthread_rwlock_rdlock(&compact_lock);
+}
+
+void compact_unlock_shared() {
+    pthread_rwlock_unlock(&compact_lock);
+}
+
+// compact the directory, compact_lock must be held exclusive and the inode pinned
+static int compact_dir_locked(struct ext4_inode *inode, uint32_t inode_idx, int force) {
+    if (!S_ISDIR(inode->i_mode) || inode->i_links_count == 0) {
+        return -ENOTDIR;
+    }
+    uint32_t nblocks = EXT4_INODE_GET_SIZE(inode) / BLOCK_SIZE;
+    if (nblocks <= 1) {
+        return 0;
+    }
+
+    uint8_t *old = malloc((uint64_t)nblocks * BLOCK_SIZE);
+    uint8_t *out = malloc((uint64_t)nblocks * BLOCK_SIZE);
+    // a dentry takes EXT4_DE_DOT_SIZE bytes at least
+    struct ext4_dir_entry_2 **des = malloc((uint64_t)nblocks * (BLOCK_SIZE / EXT4_DE_DOT_SIZE) * sizeof(void *));
+    int ret = 0;
+    if (old == NULL || out == NULL || des == NULL) {
+        ret = -ENOMEM;
+        goto out;
+    }
+    for (uint32_t lblock = 0; lblock < nblocks; lblock++) {
+        uint64_t pblock = inode_get_data_pblock(inode, lblock, NULL);
+        if (pblock == 0) {
+            WARNING("block %u of directory %u is not mapped", lblock, inode_idx);
+            ret = -EINVAL;
+            goto out;
+        }
+        compact_block_read(pblock, old + (uint64_t)lblock * BLOCK_SIZE);
+    }
+    uint32_t n;
+    uint64_t live;
+    if ((ret = compact_collect(old, nblocks, des, &n, &live)) < 0) {
+        goto out;
+    }
+    // the deleted bytes are counted again from this scan
+    ICACHE_DEAD_BYTES(inode) = 0;
+    if (!force && live * 100 >= (uint64_t)COMPACT_LIVE_PCT * nblocks * BLOCK_SIZE) {
+        DEBUG("directory %u has %lu live bytes in %u blocks, keep it", inode_idx, live, nblocks);
+        compact_stat.skipped++;
+        goto out;
+    }
+
+    int indexed = (inode->i_flags & EXT4_INDEX_FL) != 0;
+    int blocks;
+    if (indexed && live > BLOCK_SIZE - EXT4_DE_TAIL_SIZE) {
+        if (!compact_root_ok(old, des, n)) {
+            WARNING("directory %u is indexed but doesn't start with . and ..", inode_idx);
+            ret = -EINVAL;
+            goto out;
+        }
+        blocks = htree_pack(old, des + 2, n - 2, out, nblocks);
+    } else {
+        // an indexed directory that fits in one block is linear again, as before its first split
+        blocks = compact_pack_linear(des, n, out, nblocks);
+    }
+    if (blocks < 0 || (uint32_t)blocks >= nblocks) {
+        DEBUG("directory %u can't be packed in less than %u blocks", inode_idx, nblocks);
+        compact_stat.skipped++;
+        ret = blocks == -ENOMEM ? blocks : 0;
+        goto out;
+    }
+    for (int lblock = 0; lblock < blocks; lblock++) {
+        compact_block_write(inode_get_data_pblock(inode, lblock, NULL), out + (uint64_t)lblock * BLOCK_SIZE);
+    }
+    if (indexed && blocks == 1) {
+        inode->i_flags &= ~EXT4_INDEX_FL;
+    }
+    EXT4_INODE_SET_SIZE(inode, (uint64_t)blocks * BLOCK_SIZE);
+    // the chunk holding the last block stays, its other blocks are used first when the directory grows
+    struct pblock_arr freed;
+    int unmapped = extent_truncate(inode->i_block, ALIGN_TO(blocks, EXT4_INODE_PBLOCK_NUM), &freed);
+    if (freed.len) {
+        bitmap_pblock_free(&freed);
+    } else {
+        free(freed.arr);
+    }
+    EXT4_INODE_SET_BLOCKS(inode, EXT4_INODE_GET_BLOCKS(inode) - unmapped);
+    extent_map_drop(&ICACHE_EXTENT_MAP(inode));
+    dentry_space_drop(&ICACHE_DENTRY_SPACE(inode));
+    ICACHE_GROW_CHUNKS(inode) = 0;
+    ICACHE_SET_DIRTY(inode);
+    dcache_forget(inode_idx);
+
+    compact_stat.compacted++;
+    compact_stat.blocks += nblocks - blocks;
+    compact_stat.freed += unmapped;
+    INFO("directory %u compacted from %u to %d blocks, %lu live bytes, %d blocks freed",
+         inode_idx,
+         nblocks,
+         blocks,
+         live,
+         unmapped);
+    ret = nblocks - blocks;
+out:
+    free(old);
+    free(out);
+    free(des);
+    return ret;
+}
+
+int compact_dir(uint32_t inode_idx, int force) {
+    pthread_rwlock_wrlock(&compact_lock);
+    // no request runs until the unlock, so the inode loaded here is the one pinned
+    struct ext4_inode *inode;
+    if (inode_get_by_number(inode_idx, &inode) < 0 || (inode = icache_pin(inode_idx)) == NULL) {
+        pthread_rwlock_unlock(&compact_lock);
+        return -ENOENT;
+    }
+    int ret = compact_dir_locked(inode, inode_idx, force);
+    icache_unpin(inode);
+    pthread_rwlock_unlock(&compact_lock);
+    return ret;
+}
+
+void compact_note(struct ext4_inode *inode, uint32_t inode_idx, uint16_t rec_len) {
+    ICACHE_DEAD_BYTES(inode) += rec_len;
+    uint64_t size = EXT4_INODE_GET_SIZE(inode);
+    if (size < (uint64_t)COMPACT_MIN_BLOCKS * BLOCK_SIZE ||
+        (uint64_t)ICACHE_DEAD_BYTES(inode) * 100 < (100 - COMPACT_LIVE_PCT) * size) {
+        return;
+    }
+
+    uint32_t now = time(NULL);
+    pthread_mutex_lock(&compact_queue.lock);
+    if (!compact_queue.running) {
+        pthread_mutex_unlock(&compact_queue.lock);
+        return;
+    }
+    // a directory already queued waits for the quiet period again
+    for (uint32_t i = compact_queue.head; i != compact_queue.tail; i++) {
+        struct compact_request *req = &compact_queue.reqs[i % COMPACT_QUEUE_LEN];
+        if (req->inode_idx == inode_idx) {
+            req->time = now;
+            pthread_mutex_unlock(&compact_queue.lock);
+            return;
+        }
+    }
+    if (compact_queue.tail - compact_queue.head == COMPACT_QUEUE_LEN) {
+        compact_stat.dropped++;
+    } else {
+        compact_queue.reqs[compact_queue.tail++ % COMPACT_QUEUE_LEN] = (struct compact_request){inode_idx, now};
+        compact_stat.queued++;
+        DEBUG("directory %u queued for compaction", inode_idx);
+        pthread_cond_signal(&compact_queue.cond);
+    }
+    pthread_mutex_unlock(&compact_queue.lock);
+}
+
+static void *compact_thread(void *arg) {
+    UNUSED(arg);
+    pthread_mutex_lock(&compact_queue.lock);
+    while (!compact_queue.stop) {
+        if (compact_queue.head == compact_queue.tail) {
+            pthread_cond_wait(&compact_queue.cond, &compact_queue.lock);
+            continue;
+        }
+        struct compact_request *req = &compact_queue.reqs[compact_queue.head % COMPACT_QUEUE_LEN];
+        uint32_t due = req->time + COMPACT_DELAY_SEC;
+        if ((uint32_t)time(NULL) < due) {
+            struct timespec ts = {.tv_sec = due, .tv_nsec = 0};
+            pthread_cond_timedwait(&compact_queue.cond, &compact_queue.lock, &ts);
+            continue;
+        }
+        uint32_t inode_idx = req->inode_idx;
+        compact_queue.head++;
+        pthread_mutex_unlock(&compact_queue.lock);
+
+        // an evicted directory lost its count of deleted bytes, it is queued again if it keeps shrinking
+        if (icache_find(inode_idx)) {
+            compact_dir(inode_idx, 0);
+        }
+        pthread_mutex_lock(&compact_queue.lock);
+    }
+    pthread_mutex_unlock(&compact_queue.lock);
+    return NULL;
+}
+
+int compact_init() {
+    compact_queue.head = compact_queue.tail = 0;
+    compact_queue.stop = 0;
+    if (pthread_create(&compact_thread_id, NULL, compact_thread, NULL) != 0) {
+        ERR("fail to create compaction thread, directories are only compacted by kfsctl");
+        return -1;
+    }
+    compact_queue.running = 1;
+    INFO("directory compaction init, below %u%% live bytes", COMPACT_LIVE_PCT);
+    return 0;
+}
+
+void compact_exit() {
+    pthread_mutex_lock(&compact_queue.lock);
+    if (!compact_queue.running) {
+        pthread_mutex_unlock(&compact_queue.lock);
+        return;
+    }
+    compact_queue.stop = 1;
+    compact_queue.running = 0;
+    pthread_cond_signal(&compact_queue.cond);
+    pthread_mutex_unlock(&compact_queue.lock);
+    pthread_join(compact_thread_id, NULL);
+    INFO("directory compaction exit");
+}
+
+int compact_status(char *buf) {
+    int buf_cnt = 0;
+    pthread_mutex_lock(&compact_queue.lock);
+    buf_cnt += sprintf(buf + buf_cnt,
+                       "  compact[queued:dropped:pending]\t [%lu/%lu/%u]\n",
+                       compact_stat.queued,
+                       compact_stat.dropped,
+                       compact_queue.tail - compact_queue.head);
+    pthread_mutex_unlock(&compact_queue.lock);
+    buf_cnt += sprintf(buf + buf_cnt,
+                       "  compact[compacted:skipped]\t [%lu/%lu]\n",
+                       compact_stat.compacted,
+                       compact_stat.skipped);
+    buf_cnt += sprintf(buf + buf_cnt,
+                       "  compact[blocks:freed]\t [%lu/%lu]\n",
+                       compact_stat.blocks,
+                       compact_stat.freed);
+    return buf_cnt;
+}
@@ -0,0 +1,45 @@
+#ifndef COMPACT_H
+#define COMPACT_H
+
+#include <stdint.h>
+
+#include "ext4/ext4_inode.h"
+
+#define COMPACT_LIVE_PCT   50  // a directory whose dentries use less than this percent of its blocks is compacted
+#define COMPACT_MIN_BLOCKS 8   // smaller directories are left alone
+#define COMPACT_QUEUE_LEN  64  // directories waiting for compaction, new ones are dropped when full
+#define COMPACT_DELAY_SEC  1   // a directory is compacted once no dentry was deleted in it for this long
+
+int compact_init();
+void compact_exit();
+
+/**
+ * @brief account a deleted dentry of a directory, it is queued for compaction once the dentries deleted
+ * since its last scan take most of its blocks
+ *
+ * @param rec_len bytes of the deleted dentry
+ */
+void compact_note(struct ext4_inode *inode, uint32_t inode_idx, uint16_t rec_len);
+
+/**
+ * @brief hold compaction off the directories, every request that reads or changes them takes it around
+ * its whole work. It may be taken again by the same thread
+ */
+void compact_lock_shared();
+void compact_unlock_shared();
+
+/**
+ * @brief repack the live dentries of a directory into as few blocks as possible and free the blocks left
+ * at its end, a hash-indexed directory gets its index rebuilt
+ *
+ * It waits until no request holds compact_lock_shared and keeps them out until it's done, the caller must
+ * not hold it.
+ *
+ * @param force compact even if the live dentries take more than COMPACT_LIVE_PCT of the blocks
+ * @return int blocks taken off i_size, -ENOENT, -ENOTDIR, -EINVAL if a block can't be read as dentries
+ */
+int compact_dir(uint32_t inode_idx, int force);
+
+int compact_status(char *buf);
+
+#endif
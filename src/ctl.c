@@ -13,12 +13,19 @@
 #include <unistd.h>
 #include <zlib.h>
 
+#include "arena.h"
 #include "bitmap.h"
+#include "cache.h"
+#include "compact.h"
 #include "disk.h"
 #include "ext4/ext4_inode.h"
+#include "htree.h"
 #include "inode.h"
+#include "iostat.h"
 #include "logging.h"
+#include "mem.h"
 #include "ops.h"
+#include "readahead.h"
 
 const char *KFSCTL_FILENAME = "/.kfsctl";
 
@@ -30,6 +37,8 @@ int ctl_status(struct Request *req, struct Response *resp);
 int ctl_log(struct Request *req, struct Response *resp);
 int ctl_add(struct Request *req, struct Response *resp);
 int ctl_restore(struct Request *req, struct Response *resp);
+int ctl_iostat(struct Request *req, struct Response *resp);
+int ctl_compact(struct Request *req, struct Response *resp);
 
 void *ctl_init(void *arg) {
     // create a socket and wait for client to connect
@@ -78,11 +87,22 @@ void *ctl_init(void *arg) {
             case CMD_LOG:
                 ctl_log(&req, &resp);
                 break;
+            // these go through the ops directly, they hold compaction off like the requests
             case CMD_ADD:
+                compact_lock_shared();
                 ctl_add(&req, &resp);
+                compact_unlock_shared();
                 break;
             case CMD_RESTORE:
+                compact_lock_shared();
                 ctl_restore(&req, &resp);
+                compact_unlock_shared();
+                break;
+            case CMD_IOSTAT:
+                ctl_iostat(&req, &resp);
+                break;
+            case CMD_COMPACT:
+                ctl_compact(&req, &resp);
                 break;
             default:
                 break;
@@ -311,9 +331,51 @@ int ctl_status(struct Request *req, struct Response *resp) {
     buf_cnt += sprintf(
         resp->msg + buf_cnt, "  pblock[free:total]\t [%lu/%lu]\n", used_pblock_num, free_pblock_num + used_pblock_num);
 
+    buf_cnt += readahead_status(resp->msg + buf_cnt);
+    buf_cnt += arena_status(resp->msg + buf_cnt);
+    buf_cnt += bcache_status(resp->msg + buf_cnt);
+    buf_cnt += icache_status(resp->msg + buf_cnt);
+    buf_cnt += decache_status(resp->msg + buf_cnt);
+    buf_cnt += pcache_status(resp->msg + buf_cnt);
+    buf_cnt += htree_status(resp->msg + buf_cnt);
+    buf_cnt += compact_status(resp->msg + buf_cnt);
+    buf_cnt += mem_status(resp->msg + buf_cnt);
+
     return 0;
 }
 
+int ctl_iostat(struct Request *req, struct Response *resp) {
+    resp->need_print = 1;
+    iostat_status(resp->msg, sizeof(resp->msg));
+    return 0;
+}
+
+int ctl_compact(struct Request *req, struct Response *resp) {
+    const char *filename = req->filename;
+    DEBUG("ctl compact %s", filename);
+    resp->need_print = 1;
+
+    uint32_t inode_idx;
+    struct ext4_inode *inode;
+    compact_lock_shared();
+    int ret = inode_get_by_path(filename, &inode, &inode_idx);
+    uint32_t nblocks = ret < 0 ? 0 : EXT4_INODE_GET_SIZE(inode) / BLOCK_SIZE;
+    compact_unlock_shared();
+    if (ret < 0) {
+        sprintf(resp->msg, "%s not found\n", filename);
+        return -ENOENT;
+    }
+    ret = compact_dir(inode_idx, 1);
+    if (ret == -ENOTDIR) {
+        sprintf(resp->msg, "%s is not a directory\n", filename);
+    } else if (ret < 0) {
+        sprintf(resp->msg, "fail to compact %s: %s\n", filename, strerror(-ret));
+    } else {
+        sprintf(resp->msg, "%s: %u -> %u blocks\n", filename, nblocks, nblocks - ret);
+    }
+    return ret;
+}
+
 int ctl_restore_cache(const char *filename, uint64_t inode_idx) {
     DEBUG("restore cache %s[%lu]", filename, inode_idx);
     struct ext4_inode *inode;
@@ -324,8 +386,9 @@ int ctl_restore_cache(const char *filename, uint64_t inode_idx) {
 
     uint64_t inode_size = EXT4_INODE_GET_SIZE(inode);
     unsigned char *buffer = malloc(inode_size);
+    struct kfs_file file = {.fh = {inode_idx, KFS_FH_FILE}};
     struct fuse_file_info fi;
-    fi.fh = inode_idx;
+    fi.fh = (uintptr_t)&file;
     if (op_read("", (char *)buffer, inode_size, 0, &fi) < 0) {
         free(buffer);
         return -EIO;
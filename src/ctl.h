@@ -5,7 +5,7 @@
 #include <fcntl.h>
 #include <stdint.h>
 
-enum kfs_cmd { CMD_STATUS = 1, CMD_LOG, CMD_ADD, CMD_RESTORE };
+enum kfs_cmd { CMD_STATUS = 1, CMD_LOG, CMD_ADD, CMD_RESTORE, CMD_IOSTAT, CMD_COMPACT };
 
 struct Request {
     enum kfs_cmd cmd;
@@ -16,7 +16,7 @@ struct Request {
 
 struct Response {
     int need_print;
-    char msg[1024];
+    char msg[4096];
 };
 
 
@@ -1,19 +1,27 @@
-
 #include "dentry.h"
 
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include "cache.h"
+#include "compact.h"
 #include "ext4/ext4.h"
 #include "ext4/ext4_dentry.h"
 #include "ext4/ext4_inode.h"
+#include "htree.h"
 #include "inode.h"
 #include "logging.h"
 
 extern struct dcache *dcache;
 
+#define DENTRY_SPACE_SIZE(__leaves) (sizeof(struct dentry_space) + 2 * (__leaves) * sizeof(uint16_t))
+#define DENTRY_GROW_MAX             16  // chunks of EXT4_INODE_PBLOCK_NUM blocks a directory grows by at most
+#define DENTRY_GROW_FAST_SEC        1   // a directory growing again within this is growing fast
+
+static uint64_t dentry_space_bytes = 0;
+
 // get the dentry from the directory, with a given offset
 struct ext4_dir_entry_2 *dentry_next(struct ext4_inode *inode, uint32_t inode_idx, uint64_t offset) {
     uint64_t lblock = offset / BLOCK_SIZE;
@@ -21,15 +29,9 @@ struct ext4_dir_entry_2 *dentry_next(struct ext4_inode *inode, uint32_t inode_id
 
     uint64_t inode_size = EXT4_INODE_GET_SIZE(inode);
     // DEBUG("offset %lu, lblock %u, blk_offset %u, inode_size %lu", offset, lblock, blk_offset, inode_size);
-    ASSERT(inode_size >= offset);
     // if the offset is at the end of the inode, return NULL
-    if (inode_size == offset) {
-        DEBUG("reach block boundary at offset %lu", offset);
-        if (EXT4_INODE_GET_BLOCKS(inode) * BLOCK_SIZE > inode_size) {
-            EXT4_INODE_SET_SIZE(inode, inode_size + BLOCK_SIZE);
-            DEBUG("increase inode size to %lu", inode_size + BLOCK_SIZE);
-        }
-        DEBUG("inode space not enough")
+    if (offset >= inode_size) {
+        DEBUG("reach the end of directory at offset %lu", offset);
         return NULL;
     }
 
@@ -44,52 +46,269 @@ struct ext4_dir_entry_2 *dentry_next(struct ext4_inode *inode, uint32_t inode_id
     }
 }
 
-// find the last dentry
-struct ext4_dir_entry_2 *dentry_last(struct ext4_inode *inode, uint32_t inode_idx) {
-    dcache_init(inode, inode_idx);
-    if (ICACHE_CHECK_LAST_DE(inode)) {
-        DEBUG("find last dentry offset in icache");
-        return ICACHE_GET_LAST_DE(inode);
+struct ext4_dir_entry_2 *dentry_block_fit(uint8_t *buf, uint16_t rec_len, uint16_t *gap) {
+    uint16_t max = 0;
+    uint32_t offset = 0;
+    while (offset + EXT4_DE_BASE_SIZE <= BLOCK_SIZE) {
+        struct ext4_dir_entry_2 *de = (struct ext4_dir_entry_2 *)(buf + offset);
+        if (DE_IS_TAIL(de) || de->rec_len == 0 || offset + de->rec_len > BLOCK_SIZE) {
+            // a zero or overflowing rec_len is a block never written, nothing is added to it
+            break;
+        }
+        uint16_t room = de->rec_len - (de->inode_idx ? DE_REAL_REC_LEN(de) : 0);
+        if (rec_len && room >= rec_len) {
+            return de;
+        }
+        max = room > max ? room : max;
+        offset += de->rec_len;
     }
-
-    struct ext4_dir_entry_2 *de = dentry_find(inode, inode_idx, NULL, NULL);
-    if (de != NULL) {
-        return de;
+    if (gap) {
+        *gap = max;
     }
-    ERR("fail to find the last dentry");
     return NULL;
 }
 
-// create a dentry by name and inode_idx
-struct ext4_dir_entry_2 *dentry_create(struct ext4_dir_entry_2 *de, char *name, uint32_t inode_idx, int file_type) {
-    uint16_t left_space = de->rec_len;
-    // update de rec_len to be the real rec_len
-    de->rec_len = DE_REAL_REC_LEN(de);
-    DEBUG("set dentry %s rec_len to %u", de->name, de->rec_len);
-    // find the next de starting position
-    struct ext4_dir_entry_2 *new_de = (struct ext4_dir_entry_2 *)((char *)de + de->rec_len);
-    new_de->inode_idx = inode_idx;
-    new_de->name_len = strlen(name);
-    new_de->rec_len = left_space - de->rec_len;  // left space set in the new de
-    new_de->file_type = file_type;
-    strncpy(new_de->name, name, new_de->name_len);
-    new_de->name[new_de->name_len] = 0;
-    INFO("create new dentry %s[%u:%u:%u]", new_de->name, inode_idx, new_de->name_len, new_de->rec_len);
-
-    return new_de;
+static uint16_t dentry_block_gap(uint8_t *buf) {
+    uint16_t gap;
+    dentry_block_fit(buf, 0, &gap);
+    return gap;
 }
 
-int dentry_init(uint32_t parent_idx, uint32_t inode_idx) {
-    dcache->inode_idx = inode_idx;
-    dcache->lblock = 0;
+struct ext4_dir_entry_2 *dentry_fill(struct ext4_dir_entry_2 *de, const char *name, uint32_t inode_idx,
+                                     int file_type) {
+    if (de->inode_idx) {
+        uint16_t left_space = de->rec_len - DE_REAL_REC_LEN(de);
+        de->rec_len = DE_REAL_REC_LEN(de);
+        de = (struct ext4_dir_entry_2 *)((char *)de + de->rec_len);
+        de->rec_len = left_space;
+    }
+    de->inode_idx = inode_idx;
+    de->name_len = strlen(name);
+    de->file_type = file_type;
+    // no terminating zero, it would spill into the next dentry when the name fills rec_len
+    memcpy(de->name, name, de->name_len);
+    INFO("create new dentry %.*s[%u:%u:%u]", de->name_len, de->name, inode_idx, de->name_len, de->rec_len);
+    return de;
+}
 
-    // create dentry tail
-    struct ext4_dir_entry_tail *de_tail = (struct ext4_dir_entry_tail *)(dcache->buf + BLOCK_SIZE - EXT4_DE_TAIL_SIZE);
+static void dentry_tail_init(uint8_t *buf) {
+    struct ext4_dir_entry_tail *de_tail = (struct ext4_dir_entry_tail *)(buf + BLOCK_SIZE - EXT4_DE_TAIL_SIZE);
     de_tail->det_reserved_zero1 = 0;
     de_tail->det_rec_len = EXT4_DE_TAIL_SIZE;
     de_tail->det_reserved_zero2 = 0;
     de_tail->det_reserved_ft = EXT4_FT_DIR_CSUM;
     de_tail->det_checksum = 0;  // TODO: checksum
+}
+
+void dentry_block_init(uint8_t *buf) {
+    memset(buf, 0, BLOCK_SIZE);
+    dentry_tail_init(buf);
+    ((struct ext4_dir_entry_2 *)buf)->rec_len = BLOCK_SIZE - EXT4_DE_TAIL_SIZE;
+}
+
+// chunks for the next growth of a directory: one, doubled every time it grows again soon after the last one
+static uint32_t dentry_grow_chunks(struct ext4_inode *inode) {
+    uint32_t now = time(NULL);
+    uint32_t chunks = 1;
+    if (ICACHE_GROW_CHUNKS(inode) && now - ICACHE_GROW_TIME(inode) <= DENTRY_GROW_FAST_SEC) {
+        chunks = ICACHE_GROW_CHUNKS(inode) * 2 < DENTRY_GROW_MAX ? ICACHE_GROW_CHUNKS(inode) * 2 : DENTRY_GROW_MAX;
+    }
+    ICACHE_GROW_CHUNKS(inode) = chunks;
+    ICACHE_GROW_TIME(inode) = now;
+    return chunks;
+}
+
+int dentry_block_append(struct ext4_inode *inode, uint32_t inode_idx, uint32_t *lblock, uint64_t *pblock) {
+    uint32_t next = EXT4_INODE_GET_SIZE(inode) / BLOCK_SIZE;
+    uint64_t p = inode_get_data_pblock(inode, next, NULL);
+    if (p == 0) {
+        // every allocated block is in use, the blocks are mapped from next on
+        int err = inode_grow(inode, inode_idx, next, dentry_grow_chunks(inode));
+        if (err < 0) {
+            WARNING("no block left for directory %u", inode_idx);
+            return err;
+        }
+        p = inode_get_data_pblock(inode, next, NULL);
+        ASSERT(p != 0);
+    }
+    EXT4_INODE_SET_SIZE(inode, (uint64_t)(next + 1) * BLOCK_SIZE);
+    ICACHE_SET_DIRTY(inode);
+    INFO("directory %u grows to block %u", inode_idx, next);
+    *lblock = next;
+    *pblock = p;
+    return 0;
+}
+
+struct ext4_dir_entry_2 *dentry_block_find(uint8_t *buf, const char *name, uint32_t name_len,
+                                           struct ext4_dir_entry_2 **de_before) {
+    struct ext4_dir_entry_2 *prev = NULL;
+    uint32_t offset = 0;
+    while (offset + EXT4_DE_BASE_SIZE <= BLOCK_SIZE) {
+        struct ext4_dir_entry_2 *de = (struct ext4_dir_entry_2 *)(buf + offset);
+        if (de->rec_len == 0 || offset + de->rec_len > BLOCK_SIZE) {
+            break;
+        }
+        if (de->inode_idx && de->name_len == name_len && strncmp(de->name, name, name_len) == 0) {
+            if (de_before) {
+                *de_before = prev;
+            }
+            return de;
+        }
+        prev = de;
+        offset += de->rec_len;
+    }
+    return NULL;
+}
+
+static struct dentry_space *dentry_space_resize(struct dentry_space *space, uint32_t nblocks) {
+    uint32_t leaves = 1;
+    while (leaves < nblocks) {
+        leaves <<= 1;
+    }
+    if (space && space->leaves == leaves) {
+        space->nblocks = nblocks;
+        return space;
+    }
+    struct dentry_space *s = calloc(1, DENTRY_SPACE_SIZE(leaves));
+    if (s == NULL) {
+        return NULL;
+    }
+    s->nblocks = nblocks;
+    s->leaves = leaves;
+    if (space) {
+        // the leaves move, the inner nodes are rebuilt from them
+        memcpy(&s->gap[leaves], &space->gap[space->leaves], space->nblocks * sizeof(uint16_t));
+        for (uint32_t i = leaves - 1; i > 0; i--) {
+            s->gap[i] = s->gap[2 * i] > s->gap[2 * i + 1] ? s->gap[2 * i] : s->gap[2 * i + 1];
+        }
+        __atomic_sub_fetch(&dentry_space_bytes, DENTRY_SPACE_SIZE(space->leaves), __ATOMIC_RELAXED);
+        free(space);
+    }
+    __atomic_add_fetch(&dentry_space_bytes, DENTRY_SPACE_SIZE(leaves), __ATOMIC_RELAXED);
+    return s;
+}
+
+static void dentry_space_set(struct dentry_space *space, uint32_t lblock, uint16_t gap) {
+    uint32_t i = space->leaves + lblock;
+    space->gap[i] = gap;
+    for (i >>= 1; i > 0; i >>= 1) {
+        space->gap[i] = space->gap[2 * i] > space->gap[2 * i + 1] ? space->gap[2 * i] : space->gap[2 * i + 1];
+    }
+}
+
+// first block with a gap of at least rec_len, -1 if none
+static int64_t dentry_space_find(struct dentry_space *space, uint16_t rec_len) {
+    if (space->gap[1] < rec_len) {
+        return -1;
+    }
+    uint32_t i = 1;
+    while (i < space->leaves) {
+        i = space->gap[2 * i] >= rec_len ? 2 * i : 2 * i + 1;
+    }
+    return i - space->leaves;
+}
+
+// get the gaps of a directory, scan it on first use
+static struct dentry_space *dentry_space_get(struct ext4_inode *inode, uint32_t inode_idx) {
+    struct dentry_space **space = &ICACHE_DENTRY_SPACE(inode);
+    if (*space) {
+        return *space;
+    }
+    uint32_t nblocks = EXT4_INODE_GET_SIZE(inode) / BLOCK_SIZE;
+    struct dentry_space *s = dentry_space_resize(NULL, nblocks);
+    if (s == NULL) {
+        return NULL;
+    }
+    dcache_init(inode, inode_idx);
+    for (uint32_t lblock = 0; lblock < nblocks; lblock++) {
+        if (lblock != dcache->lblock) {
+            dcache_load_lblock(inode, lblock);
+        }
+        dentry_space_set(s, lblock, dentry_block_gap(dcache->buf));
+    }
+    DEBUG("scan %u blocks of directory %u for free space", nblocks, inode_idx);
+    *space = s;
+    return s;
+}
+
+void dentry_space_update(struct ext4_inode *inode) {
+    if (ICACHE_DENTRY_SPACE(inode)) {
+        dentry_space_set(ICACHE_DENTRY_SPACE(inode), dcache->lblock, dentry_block_gap(dcache->buf));
+    }
+}
+
+void dentry_space_drop(struct dentry_space **space) {
+    if (*space) {
+        __atomic_sub_fetch(&dentry_space_bytes, DENTRY_SPACE_SIZE((*space)->leaves), __ATOMIC_RELAXED);
+        free(*space);
+        *space = NULL;
+    }
+}
+
+uint64_t dentry_space_mem() {
+    return __atomic_load_n(&dentry_space_bytes, __ATOMIC_RELAXED);
+}
+
+int dentry_add(struct ext4_inode *inode, uint32_t dir_inode_idx, uint32_t inode_idx, char *name, int file_type) {
+    if (inode->i_flags & EXT4_INDEX_FL) {
+        int err = htree_add(inode, dir_inode_idx, inode_idx, name, file_type);
+        if (err != -EINVAL) {
+            return err;
+        }
+        // the index can't be trusted, the directory goes on as a linear one, which the kernel also reads
+        WARNING("drop the broken hash index of directory %u", dir_inode_idx);
+        inode->i_flags &= ~EXT4_INDEX_FL;
+        ICACHE_SET_DIRTY(inode);
+    }
+    uint16_t rec_len = DE_CALC_REC_LEN(strlen(name));
+    struct dentry_space *space = dentry_space_get(inode, dir_inode_idx);
+    if (space == NULL) {
+        ERR("fail to index the free space of directory %u", dir_inode_idx);
+        return -ENOMEM;
+    }
+
+    struct ext4_dir_entry_2 *de;
+    int64_t lblock = dentry_space_find(space, rec_len);
+    if (lblock >= 0) {
+        DEBUG("dentry %s fits in block %ld of directory %u", name, lblock, dir_inode_idx);
+        dcache_init(inode, dir_inode_idx);
+        if (lblock != dcache->lblock) {
+            dcache_load_lblock(inode, lblock);
+        }
+        de = dentry_block_fit(dcache->buf, rec_len, NULL);
+        ASSERT(de != NULL);
+    } else if (space->nblocks == 1 && htree_enabled() && htree_create(inode, dir_inode_idx) == 0) {
+        // the directory grows past one block, index it by hash from now on
+        return htree_add(inode, dir_inode_idx, inode_idx, name, file_type);
+    } else {
+        // every block is full, start the next block allocated to the directory
+        uint32_t new_lblock;
+        uint64_t pblock;
+        int err;
+        if ((err = dentry_block_append(inode, dir_inode_idx, &new_lblock, &pblock)) < 0) {
+            return err;
+        }
+        lblock = new_lblock;
+        if ((space = dentry_space_resize(space, lblock + 1)) == NULL) {
+            ERR("fail to index the free space of directory %u", dir_inode_idx);
+            return -ENOMEM;
+        }
+        ICACHE_DENTRY_SPACE(inode) = space;
+        dcache_new_lblock(dir_inode_idx, lblock, pblock);
+        dentry_block_init(dcache->buf);
+        de = (struct ext4_dir_entry_2 *)dcache->buf;
+    }
+    dentry_fill(de, name, inode_idx, file_type);
+    dentry_space_set(space, lblock, dentry_block_gap(dcache->buf));
+    dcache_write_back();
+    return 0;
+}
+
+int dentry_init(uint32_t parent_idx, uint32_t inode_idx, uint64_t pblock) {
+    dcache_new_lblock(inode_idx, 0, pblock);
+
+    // create dentry tail
+    dentry_tail_init(dcache->buf);
 
     // .
     struct ext4_dir_entry_2 *de_dot = (struct ext4_dir_entry_2 *)(dcache->buf);
@@ -117,81 +336,62 @@ int dentry_delete(struct ext4_inode *inode, uint32_t inode_idx, char *name) {
     struct ext4_dir_entry_2 *de, *de_before;
     de = dentry_find(inode, inode_idx, name, &de_before);
     ASSERT(de != NULL);
+    uint16_t rec_len = DE_REAL_REC_LEN(de);
 
-    // delete dentry just means add de_next->rec_len to de->rec_len
-    INFO("merge de[%s] and de[%s]", de_before->name, de->name);
-    INFO("de[%s] rec_len %u -> %u", de_before->name, de_before->rec_len, de_before->rec_len + de->rec_len);
-    de_before->rec_len += de->rec_len;
-    if (ICACHE_GET_LAST_DE(inode) == de) {
-        // if de_next is the last dentry, set last de to de
-        ICACHE_SET_LAST_DE(inode, de_before);
-        DEBUG("set last dentry to %s", de_before->name);
+    if (de_before) {
+        // delete dentry just means add de->rec_len to de_before->rec_len
+        INFO("merge de[%.*s] and de[%s]", de_before->name_len, de_before->name, name);
+        INFO("rec_len %u -> %u", de_before->rec_len, de_before->rec_len + de->rec_len);
+        de_before->rec_len += de->rec_len;
+    } else {
+        // the first dentry of a block has nothing to merge into, it stays as an unused dentry
+        INFO("de[%s] is the first of block %u, mark it unused", name, dcache->lblock);
+        de->inode_idx = 0;
     }
+    dentry_space_update(inode);
+    compact_note(inode, inode_idx, rec_len);
     return 0;
 }
 
-/**
- * @brief
- *
- * @param de
- * @param name_len
- * @return int
- * -ENOSPC: no space
- */
-int dentry_has_enough_space(struct ext4_dir_entry_2 *de, uint64_t name_len) {
-    __le16 rec_len = DE_CALC_REC_LEN(name_len);
-    __le16 left_space = de->rec_len - DE_REAL_REC_LEN(de);
-    INFO("require space %u | left space %u", rec_len, left_space);
-    if (left_space < rec_len) {
-        // TODO: +sizeof(tail) check if len is enough
-        WARNING("No space for new dentry in de[%s]", de->name);
-        return -ENOSPC;
-    }
-    INFO("space for new dentry is enough");
-    return 0;
-}
-
-/**
- * @brief find dentry by name
- *
- * @param inode
- * @param inode_idx
- * @param name dentry name; find the last dentry if name is NULL
- * @param de_before if not NULL, set the dentry before the found one
- * @return struct ext4_dir_entry_2*
- */
 struct ext4_dir_entry_2 *dentry_find(struct ext4_inode *inode, uint32_t inode_idx, char *name,
                                      struct ext4_dir_entry_2 **de_before) {
+    return dentry_lookup(inode, inode_idx, name, strlen(name), de_before);
+}
+
+struct ext4_dir_entry_2 *dentry_lookup(struct ext4_inode *inode, uint32_t inode_idx, const char *name,
+                                       uint32_t name_len, struct ext4_dir_entry_2 **de_before) {
     struct ext4_dir_entry_2 *de = NULL;
     struct ext4_dir_entry_2 *de_next = NULL;
+    if (inode->i_flags & EXT4_INDEX_FL) {
+        // only the leaf the hash points to is read, a broken index falls back to the linear scan
+        int err = htree_find(inode, inode_idx, name, name_len, de_before, &de);
+        if (err != -EINVAL) {
+            return err == 0 ? de : NULL;
+        }
+    }
     dcache_init(inode, inode_idx);
     uint64_t offset = 0;
-    uint64_t name_len = name ? strlen(name) : 0;
     while ((de_next = dentry_next(inode, inode_idx, offset))) {
-        if (de_next->inode_idx == 0 && de_next->name_len == 0) {
-            // reach the ext4_dir_entry_tail
-            ASSERT(((struct ext4_dir_entry_tail *)de_next)->det_reserved_ft == EXT4_FT_DIR_CSUM);
-            if (name == NULL) {
-                // name is NULL means find the last dentry
-                ICACHE_SET_LAST_DE(inode, de);
-                DEBUG("add last dentry %s to icache", de->name);
-                return de;
-            } else {
-                DEBUG("fail to find dentry %s", name);
-                return NULL;
-            }
+        if (offset % BLOCK_SIZE == 0) {
+            // dentries never cross a block
+            de = NULL;
         }
-        DEBUG("pass dentry %s[%u:%u]", de_next->name, de_next->inode_idx, de_next->rec_len);
-        offset += de_next->rec_len;
+        offset = DE_NEXT_OFFSET(de_next, offset);
+        if (de_next->inode_idx == 0) {
+            // unused dentry or the ext4_dir_entry_tail
+            de = de_next;
+            continue;
+        }
+        DEBUG("pass dentry %.*s[%u:%u]", de_next->name_len, de_next->name, de_next->inode_idx, de_next->rec_len);
         if (name_len == de_next->name_len && strncmp(de_next->name, name, name_len) == 0) {
             if (de_before != NULL) {
                 *de_before = de;
             }
-            INFO("find dentry %s", name);
+            INFO("find dentry %.*s", name_len, name);
             return de_next;
         }
         de = de_next;
     }
-    ERR("fail to find the last dentry");
+    DEBUG("fail to find dentry %.*s", name_len, name);
     return NULL;
-}
\ No newline at end of file
+}
@@ -10,37 +10,107 @@
 #define ALIGN_TO_DENTRY(__n)  ALIGN_TO(__n, 4)
 #define DE_REAL_REC_LEN(de)   ((__le16)ALIGN_TO_DENTRY((de)->name_len + EXT4_DE_BASE_SIZE))
 #define DE_CALC_REC_LEN(size) (ALIGN_TO_DENTRY(EXT4_DE_BASE_SIZE + (size)))
+#define DE_IS_TAIL(de)                                                                  \
+    ((de)->inode_idx == 0 && (de)->rec_len == EXT4_DE_TAIL_SIZE && (de)->name_len == 0 && \
+     (de)->file_type == EXT4_FT_DIR_CSUM)
+// offset of the dentry after de, a zero rec_len (a block never written) skips to the next block
+#define DE_NEXT_OFFSET(de, offset) \
+    ((de)->rec_len ? (offset) + (de)->rec_len : ((offset) / BLOCK_SIZE + 1) * BLOCK_SIZE)
 
-// get the dentry from the directory, with a given offset
-struct ext4_dir_entry_2 *dentry_next(struct ext4_inode *inode, uint32_t inode_idx, uint64_t offset);
+/*
+ * Largest free gap of every block of a directory, kept with the cached inode and built by one scan on the
+ * first insert. Gaps are the leaves of a max tree, so a block with room for a name is found without reading
+ * the directory, and the space of deleted dentries is reused before the directory grows.
+ */
+struct dentry_space {
+    uint32_t nblocks;  // blocks in use, i_size / BLOCK_SIZE
+    uint32_t leaves;   // power of two >= nblocks
+    uint16_t gap[];    // gap[leaves + lblock] is the gap of a block, gap[i] the max of gap[2i] and gap[2i + 1]
+};
 
-// find the last dentry
-struct ext4_dir_entry_2 *dentry_last(struct ext4_inode *inode, uint32_t inode_idx);
+// get the dentry from the directory, with a given offset, NULL at the end of the directory
+struct ext4_dir_entry_2 *dentry_next(struct ext4_inode *inode, uint32_t inode_idx, uint64_t offset);
 
 /**
- * @brief create a dentry by name and inode_idx
+ * @brief add a dentry in the first block with room for it, dcache is left on that block
  *
- * @param de
+ * @param inode directory
+ * @param dir_inode_idx
+ * @param inode_idx inode of the new dentry
  * @param name
- * @param inode_idx
- * @return int
+ * @param file_type
+ * @return int -ENOSPC if every block of the directory is full
  */
-struct ext4_dir_entry_2 *dentry_create(struct ext4_dir_entry_2 *de, char *name, uint32_t inode_idx, int file_type);
+int dentry_add(struct ext4_inode *inode, uint32_t dir_inode_idx, uint32_t inode_idx, char *name, int file_type);
 
-int dentry_add(struct ext4_inode *inode, uint32_t dir_inode_idx, uint32_t inode_idx, char *name);
+/**
+ * @brief first dentry of a block that has room for rec_len bytes after its name, a dentry with inode 0 is
+ * unused and has all of its rec_len
+ *
+ * @param buf directory block
+ * @param rec_len 0 to get the largest room in the block instead
+ * @param gap if not NULL, set the largest room in the block
+ * @return struct ext4_dir_entry_2* NULL if no dentry has room
+ */
+struct ext4_dir_entry_2 *dentry_block_fit(uint8_t *buf, uint16_t rec_len, uint16_t *gap);
 
-int dentry_init(uint32_t parent_idx, uint32_t inode_idx);
+/**
+ * @brief fill a dentry in de, split from the end of de if it is in use
+ *
+ * @return struct ext4_dir_entry_2* the new dentry
+ */
+struct ext4_dir_entry_2 *dentry_fill(struct ext4_dir_entry_2 *de, const char *name, uint32_t inode_idx,
+                                     int file_type);
 
-int dentry_delete(struct ext4_inode *inode, uint32_t inode_idx, char *name);
+/**
+ * @brief find a dentry by name in one block
+ *
+ * @param de_before if not NULL, set the dentry before the found one, NULL if it is the first
+ */
+struct ext4_dir_entry_2 *dentry_block_find(uint8_t *buf, const char *name, uint32_t name_len,
+                                           struct ext4_dir_entry_2 **de_before);
 
 /**
- * @brief whether the dentry has enough space for a new dentry
+ * @brief empty directory block: one unused dentry and the tail
+ */
+void dentry_block_init(uint8_t *buf);
+
+/**
+ * @brief grow a directory by the next block allocated to it, i_size is updated. Blocks are allocated when
+ * there is none left, more at once while the directory keeps growing fast
  *
- * @param de
- * @param name_len
+ * @param lblock set the logic block
+ * @param pblock set the physical block, its content is left to the caller
+ * @return int -ENOSPC if the disk or the extent tree of the directory is full
+ */
+int dentry_block_append(struct ext4_inode *inode, uint32_t inode_idx, uint32_t *lblock, uint64_t *pblock);
+
+/**
+ * @brief update the gap of the current dcache block after a dentry in it is changed in place
+ */
+void dentry_space_update(struct ext4_inode *inode);
+
+/**
+ * @brief free the gaps of a directory, the next dentry_add scans it again
+ */
+void dentry_space_drop(struct dentry_space **space);
+
+/**
+ * @brief memory used by the gaps of all the cached directories
+ */
+uint64_t dentry_space_mem();
+
+/**
+ * @brief fill . and .. into the first block of a new directory, dcache is switched to that block
+ *
+ * @param parent_idx
+ * @param inode_idx
+ * @param pblock first data block of the new directory
  * @return int
  */
-int dentry_has_enough_space(struct ext4_dir_entry_2 *de, uint64_t name_len);
+int dentry_init(uint32_t parent_idx, uint32_t inode_idx, uint64_t pblock);
+
+int dentry_delete(struct ext4_inode *inode, uint32_t inode_idx, char *name);
 
 /**
  * @brief find dentry by name
@@ -48,8 +118,14 @@ int dentry_has_enough_space(struct ext4_dir_entry_2 *de, uint64_t name_len);
  * @param inode
  * @param inode_idx
  * @param name
- * @param de_before if not NULL, set the dentry before the found one
+ * @param de_before if not NULL, set the dentry before the found one in its block, NULL if it is the first
  * @return struct ext4_dir_entry_2*
  */
 struct ext4_dir_entry_2 *dentry_find(struct ext4_inode *inode, uint32_t inode_idx, char *name,
-                                     struct ext4_dir_entry_2 **de_before);
\ No newline at end of file
+                                     struct ext4_dir_entry_2 **de_before);
+
+/**
+ * @brief same as dentry_find, the name is not terminated; a hash-indexed directory only reads its leaf
+ */
+struct ext4_dir_entry_2 *dentry_lookup(struct ext4_inode *inode, uint32_t inode_idx, const char *name,
+                                       uint32_t name_len, struct ext4_dir_entry_2 **de_before);
\ No newline at end of file
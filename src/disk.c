@@ -7,138 +7,485 @@
  * more details.
  */
 
-#include <stdint.h>
-#include <stdio.h>
-#include <sys/stat.h>
-#define _XOPEN_SOURCE 500
 #include <errno.h>
-#include <fcntl.h>
 #include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
 #include "disk.h"
+#include "disk_backend.h"
+#include "iostat.h"
 #include "logging.h"
 
-#ifdef __FreeBSD__
-#include <string.h>
-#endif
-
-static int disk_fd = -1;
-
-static int pread_wrapper(int fd, void *p, size_t size, off_t where) {
-#if defined(__FreeBSD__) && !defined(__APPLE__)
-#define PREAD_BLOCK_SIZE 1024
-    /* FreeBSD needs to read aligned whole blocks.
-     * TODO: Check what is a safe block size.
-     */
-    static __thread uint8_t block[PREAD_BLOCK_SIZE];
-    off_t first_offset = where % PREAD_BLOCK_SIZE;
-    int ret = 0;
+// the backend selected by disk_open, see disk_backend.h
+static const struct disk_backend *backend = NULL;
+
+// the whole disk image if the backend keeps it addressable (DISK_F_MMAP, ram disk)
+static uint8_t *disk_map_base = NULL;
+static size_t disk_map_size = 0;
+
+// alignment the backend needs, see disk_backend.align
+static uint32_t disk_align = 1;
+
+/*
+ * pread/pwrite on disjoint offsets need no serialization, the only ordering we keep is between
+ * requests touching the same disk range: readers share a range and writers own it. The disk is cut
+ * into DISK_RANGE_SIZE grains hashed onto DISK_RANGE_LOCKS rwlocks, a request locks all the stripes
+ * it covers in ascending index order so two requests never wait on each other in a cycle.
+ */
+#define DISK_RANGE_SHIFT 16  // 64KiB
+#define DISK_RANGE_SIZE  (1 << DISK_RANGE_SHIFT)
+#define DISK_RANGE_LOCKS 256
 
-    if (first_offset) {
-        /* This is the case if the read doesn't start on a block boundary.
-         * We still need to read the whole block and we do, but we only copy to
-         * the out pointer the bytes that where actually asked for.  In this
-         * case first_offset is the offset into the block. */
-        int pread_ret = pread(fd, block, PREAD_BLOCK_SIZE, where - first_offset);
-        ASSERT(pread_ret == PREAD_BLOCK_SIZE);
+static pthread_rwlock_t range_locks[DISK_RANGE_LOCKS];
 
-        size_t first_size = MIN(size, (size_t)(PREAD_BLOCK_SIZE - first_offset));
-        memcpy(p, block + first_offset, first_size);
-        p += first_size;
-        size -= first_size;
-        where += first_size;
-        ret += first_size;
+// the set of stripes covered by one request
+struct disk_range_set {
+    uint64_t bits[DISK_RANGE_LOCKS / 64];
+};
 
-        if (!size)
-            return ret;
+static void range_set_add(struct disk_range_set *rs, off_t where, size_t size) {
+    if (size == 0)
+        return;
+    if (disk_align > 1) {
+        // unaligned writes touch the whole blocks around them
+        off_t start = where & ~((off_t)disk_align - 1);
+        size = ((where + size + disk_align - 1) & ~((off_t)disk_align - 1)) - start;
+        where = start;
+    }
+    uint64_t first = (uint64_t)where >> DISK_RANGE_SHIFT;
+    uint64_t last = ((uint64_t)where + size - 1) >> DISK_RANGE_SHIFT;
+    if (last - first + 1 >= DISK_RANGE_LOCKS) {
+        memset(rs->bits, 0xff, sizeof(rs->bits));
+        return;
+    }
+    for (uint64_t g = first; g <= last; g++) {
+        unsigned idx = g % DISK_RANGE_LOCKS;
+        rs->bits[idx / 64] |= 1ULL << (idx % 64);
     }
+}
 
-    ASSERT(where % PREAD_BLOCK_SIZE == 0);
+static void range_lock(struct disk_range_set *rs, int write) {
+    for (int i = 0; i < DISK_RANGE_LOCKS; i++) {
+        if (rs->bits[i / 64] & (1ULL << (i % 64))) {
+            if (write)
+                pthread_rwlock_wrlock(&range_locks[i]);
+            else
+                pthread_rwlock_rdlock(&range_locks[i]);
+        }
+    }
+}
 
-    size_t mid_read_size = (size / PREAD_BLOCK_SIZE) * PREAD_BLOCK_SIZE;
-    if (mid_read_size) {
-        int pread_ret_mid = pread(fd, p, mid_read_size, where);
-        ASSERT((size_t)pread_ret_mid == mid_read_size);
+static void range_unlock(struct disk_range_set *rs) {
+    for (int i = DISK_RANGE_LOCKS - 1; i >= 0; i--) {
+        if (rs->bits[i / 64] & (1ULL << (i % 64))) {
+            pthread_rwlock_unlock(&range_locks[i]);
+        }
+    }
+}
 
-        p += mid_read_size;
-        size -= mid_read_size;
-        where += mid_read_size;
-        ret += mid_read_size;
+int disk_open(const char *path, int flags) {
+    const struct disk_backend *b = (flags & DISK_F_RAM) ? &disk_ram_backend : &disk_file_backend;
+    int ret = b->open(path, flags);
+    if (ret < 0) {
+        return ret;
+    }
+    backend = b;
 
-        if (!size)
-            return ret;
+    for (int i = 0; i < DISK_RANGE_LOCKS; i++) {
+        pthread_rwlock_init(&range_locks[i], NULL);
     }
+    disk_map_base = backend->map(&disk_map_size);
+    disk_align = backend->align();
+    INFO("disk %s opened with %s backend", path, backend->name);
+    return 0;
+}
 
-    ASSERT(size < PREAD_BLOCK_SIZE);
+/*
+ * Write-back queue. Small metadata writes (inodes, directory blocks, bitmaps, group descriptors) are
+ * copied into wbq by disk_write_queued instead of hitting the disk one by one. Entries are kept sorted by
+ * offset, and overlapping or adjacent ranges are merged on insert, so neighbouring inodes of one
+ * inode-table block end up in one entry. disk_flush writes everything in offset order with disk_rwv.
+ *
+ * Reads overlay the queued data on what they get from the disk, direct writes patch the queued data they
+ * overlap so a later flush never writes back stale bytes. Lock order is wbq.lock -> range locks.
+ */
+#define DISK_WBQ_MAX_BYTES (4 << 20)  // flush when the queue holds more than this
+
+struct wbq_entry {
+    off_t where;
+    size_t size;
+    uint8_t *data;
+};
+
+static struct {
+    pthread_rwlock_t lock;
+    struct wbq_entry *entries;  // sorted by where, never overlapping nor adjacent
+    int count;
+    int cap;
+    size_t bytes;
+} wbq = {.lock = PTHREAD_RWLOCK_INITIALIZER};
+
+static int disk_rwv(const struct disk_iovec *iov, int n, int write, int wbq_held, const char *func, int line);
+
+static int wbq_empty() {
+    return __atomic_load_n(&wbq.count, __ATOMIC_ACQUIRE) == 0;
+}
 
-    int pread_ret_last = pread(fd, block, PREAD_BLOCK_SIZE, where);
-    ASSERT(pread_ret_last == PREAD_BLOCK_SIZE);
+// index of the first entry that ends at or after where
+static int wbq_search(off_t where) {
+    int lo = 0, hi = wbq.count;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (wbq.entries[mid].where + (off_t)wbq.entries[mid].size < where)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
 
-    memcpy(p, block, size);
+// copy the queued data overlapping [where, where + size) into p (to_queue = 0) or from p (to_queue = 1)
+static void wbq_overlap_copy(off_t where, size_t size, void *p, int to_queue) {
+    off_t end = where + size;
+    for (int i = wbq_search(where); i < wbq.count && wbq.entries[i].where < end; i++) {
+        struct wbq_entry *e = &wbq.entries[i];
+        off_t start = e->where > where ? e->where : where;
+        off_t stop = e->where + (off_t)e->size < end ? e->where + (off_t)e->size : end;
+        if (start >= stop)
+            continue;
+        if (to_queue)
+            memcpy(e->data + (start - e->where), (uint8_t *)p + (start - where), stop - start);
+        else
+            memcpy((uint8_t *)p + (start - where), e->data + (start - e->where), stop - start);
+    }
+}
 
-    return ret + size;
-#else
-    return pread(fd, p, size, where);
-#endif
+// patch the queued data a direct write overlaps, so that a later flush can't write it back over the write.
+// Returns with wbq.lock held, the caller drops it once it holds the range locks of the write: a queued copy
+// of the range can't slip in between and turn out older than what the write puts on disk
+static void wbq_write_lock(const struct disk_iovec *iov, int n) {
+    pthread_rwlock_rdlock(&wbq.lock);
+    int overlap = 0;
+    for (int i = 0; i < n && !overlap; i++) {
+        int first = wbq_search(iov[i].where);
+        overlap = first < wbq.count && wbq.entries[first].where < iov[i].where + (off_t)iov[i].size;
+    }
+    if (!overlap) {
+        return;
+    }
+    pthread_rwlock_unlock(&wbq.lock);
+    pthread_rwlock_wrlock(&wbq.lock);
+    for (int i = 0; i < n; i++) {
+        wbq_overlap_copy(iov[i].where, iov[i].size, iov[i].p, 1);
+    }
 }
 
-int disk_open(const char *path) {
-    disk_fd = open(path, O_RDWR);
-    if (disk_fd < 0) {
-        return -errno;
+static void wbq_insert(off_t where, size_t size, const void *p) {
+    off_t end = where + size;
+    int first = wbq_search(where);
+    int last = first;
+    // entries [first, last) overlap or touch the new range
+    while (last < wbq.count && wbq.entries[last].where <= end) {
+        last++;
     }
 
-    return 0;
+    if (first == last) {
+        if (wbq.count == wbq.cap) {
+            wbq.cap = wbq.cap ? wbq.cap * 2 : 64;
+            wbq.entries = realloc(wbq.entries, wbq.cap * sizeof(struct wbq_entry));
+        }
+        memmove(&wbq.entries[first + 1], &wbq.entries[first], (wbq.count - first) * sizeof(struct wbq_entry));
+        wbq.entries[first] = (struct wbq_entry){where, size, malloc(size)};
+        memcpy(wbq.entries[first].data, p, size);
+        __atomic_store_n(&wbq.count, wbq.count + 1, __ATOMIC_RELEASE);
+        wbq.bytes += size;
+        return;
+    }
+
+    // merge the new range with all the entries it touches into one entry
+    off_t start = wbq.entries[first].where < where ? wbq.entries[first].where : where;
+    off_t stop = wbq.entries[last - 1].where + (off_t)wbq.entries[last - 1].size;
+    if (stop < end)
+        stop = end;
+    uint8_t *data = malloc(stop - start);
+    for (int i = first; i < last; i++) {
+        memcpy(data + (wbq.entries[i].where - start), wbq.entries[i].data, wbq.entries[i].size);
+        wbq.bytes -= wbq.entries[i].size;
+        free(wbq.entries[i].data);
+    }
+    memcpy(data + (where - start), p, size);
+    wbq.entries[first] = (struct wbq_entry){start, stop - start, data};
+    wbq.bytes += stop - start;
+    memmove(&wbq.entries[first + 1], &wbq.entries[last], (wbq.count - last) * sizeof(struct wbq_entry));
+    __atomic_store_n(&wbq.count, wbq.count - (last - first - 1), __ATOMIC_RELEASE);
 }
 
-int disk_close() {
-    return close(disk_fd);
+// write all the queued entries in offset order, wbq.lock must be held for writing
+static int wbq_flush_locked() {
+    struct disk_iovec iov[DISK_BATCH_MAX];
+    int ret = 0;
+    if (wbq.count) {
+        DEBUG("flush %d queued ranges, %zu bytes", wbq.count, wbq.bytes);
+    }
+    for (int i = 0; i < wbq.count; i += DISK_BATCH_MAX) {
+        int n = wbq.count - i < DISK_BATCH_MAX ? wbq.count - i : DISK_BATCH_MAX;
+        int total = 0;
+        for (int j = 0; j < n; j++) {
+            iov[j] = (struct disk_iovec){wbq.entries[i + j].where, wbq.entries[i + j].size, wbq.entries[i + j].data};
+            total += iov[j].size;
+        }
+        if (disk_rwv(iov, n, 1, 0, __func__, __LINE__) != total) {
+            ret = -EIO;
+        }
+    }
+    for (int i = 0; i < wbq.count; i++) {
+        free(wbq.entries[i].data);
+    }
+    __atomic_store_n(&wbq.count, 0, __ATOMIC_RELEASE);
+    wbq.bytes = 0;
+    return ret;
 }
 
-uint64_t disk_size() {
-    struct stat st;
-    if (fstat(disk_fd, &st) < 0) {
+int __disk_write_queued(off_t where, size_t size, void *p, const char *func, int line) {
+    ASSERT(backend);
+    if (disk_map_base) {
+        // writes to the mapped image are memory copies already, nothing to batch
+        return __disk_write(where, size, p, func, line);
+    }
+
+    DEBUG("Disk Write Queued: 0x%jx +0x%zx [%s:%d]", where, size, func, line);
+    uint64_t start = iostat_now();
+    pthread_rwlock_wrlock(&wbq.lock);
+    wbq_insert(where, size, p);
+    int ret = size;
+    if (wbq.bytes > DISK_WBQ_MAX_BYTES && wbq_flush_locked() < 0) {
+        ret = -EIO;
+    }
+    pthread_rwlock_unlock(&wbq.lock);
+    iostat_account(func, line, IOSTAT_WRITE, size, start);
+    return ret;
+}
+
+int disk_flush() {
+    if (wbq_empty()) {
         return 0;
     }
-    return st.st_size;
+    pthread_rwlock_wrlock(&wbq.lock);
+    int ret = wbq_flush_locked();
+    pthread_rwlock_unlock(&wbq.lock);
+    return ret;
+}
+
+int disk_sync() {
+    ASSERT(backend);
+    int ret = disk_flush();
+    // the writes above only reached the backend, the ram disk for one keeps them in memory until flush
+    int flush_ret = backend->flush();
+    return ret < 0 ? ret : flush_ret;
+}
+
+int disk_close() {
+    int ret = disk_sync();
+    free(wbq.entries);
+    wbq.entries = NULL;
+    wbq.cap = 0;
+
+    backend->close();
+    disk_map_base = NULL;
+    disk_map_size = 0;
+    disk_align = 1;
+    for (int i = 0; i < DISK_RANGE_LOCKS; i++) {
+        pthread_rwlock_destroy(&range_locks[i]);
+    }
+    backend = NULL;
+    return ret;
+}
+
+uint64_t disk_size() {
+    return backend->size();
+}
+
+int disk_discard(off_t where, size_t size) {
+    struct disk_range_set rs = {0};
+    ASSERT(backend);
+
+    DEBUG("Disk Discard: 0x%jx +0x%zx", where, size);
+    range_set_add(&rs, where, size);
+    range_lock(&rs, 1);
+    int ret = backend->discard(where, size);
+    range_unlock(&rs);
+    return ret;
 }
 
 int __disk_read(off_t where, size_t size, void *p, const char *func, int line) {
-    static pthread_mutex_t read_lock = PTHREAD_MUTEX_INITIALIZER;
+    struct disk_range_set rs = {0};
     ssize_t pread_ret;
 
-    ASSERT(disk_fd >= 0);
+    ASSERT(backend);
 
-    pthread_mutex_lock(&read_lock);
     DEBUG("Disk Read: 0x%jx +0x%zx [%s:%d]", where, size, func, line);
-    pread_ret = pread_wrapper(disk_fd, p, size, where);
-    pthread_mutex_unlock(&read_lock);
+    uint64_t start = iostat_now();
+    int queued = !wbq_empty();
+    if (queued) {
+        pthread_rwlock_rdlock(&wbq.lock);
+    }
+    range_set_add(&rs, where, size);
+    range_lock(&rs, 0);
+    if (disk_map(where, size)) {
+        memcpy(p, disk_map_base + where, size);
+        pread_ret = size;
+    } else {
+        pread_ret = backend->read(p, size, where);
+    }
+    range_unlock(&rs);
+    if (queued) {
+        wbq_overlap_copy(where, size, p, 0);
+        pthread_rwlock_unlock(&wbq.lock);
+    }
     if (size == 0)
         WARNING("Read operation with 0 size");
 
     ASSERT((size_t)pread_ret == size);
+    iostat_account(func, line, IOSTAT_READ, size, start);
 
     return pread_ret;
 }
 
 int __disk_write(off_t where, size_t size, void *p, const char *func, int line) {
-    static pthread_mutex_t write_lock = PTHREAD_MUTEX_INITIALIZER;
+    struct disk_range_set rs = {0};
     ssize_t pwrite_ret;
 
-    ASSERT(disk_fd >= 0);
+    ASSERT(backend);
 
-    pthread_mutex_lock(&write_lock);
     DEBUG("Disk Write: 0x%jx +0x%zx [%s:%d]", where, size, func, line);
-    pwrite_ret = pwrite(disk_fd, p, size, where);
-    pthread_mutex_unlock(&write_lock);
+    if (disk_map_base && p == disk_map_base + where) {
+        // written in place through a borrowed pointer, already in the image
+        return size;
+    }
+    uint64_t start = iostat_now();
+    struct disk_iovec iov = {where, size, p};
+    wbq_write_lock(&iov, 1);
+    range_set_add(&rs, where, size);
+    range_lock(&rs, 1);
+    pthread_rwlock_unlock(&wbq.lock);
+    pwrite_ret = backend->write(p, size, where);
+    range_unlock(&rs);
 
     ASSERT((size_t)pwrite_ret == size);
+    iostat_account(func, line, IOSTAT_WRITE, size, start);
 
     return pwrite_ret;
 }
 
+// wbq_held: wbq.lock taken by wbq_write_lock, dropped once the range locks are held
+static int disk_rwv(const struct disk_iovec *iov, int n, int write, int wbq_held, const char *func, int line) {
+    struct disk_range_set rs = {0};
+    struct iovec vecs[DISK_BATCH_MAX];
+    struct disk_run runs[DISK_BATCH_MAX];
+    int nvec = 0, nrun = 0;
+    int ret = 0, total = 0;
+
+    ASSERT(backend);
+    ASSERT(n <= DISK_BATCH_MAX);
+    uint64_t start = iostat_now();
+    for (int i = 0; i < n; i++) {
+        DEBUG("Disk %s [%d/%d]: 0x%jx +0x%zx [%s:%d]",
+              write ? "Write" : "Read",
+              i + 1,
+              n,
+              iov[i].where,
+              iov[i].size,
+              func,
+              line);
+        range_set_add(&rs, iov[i].where, iov[i].size);
+        total += iov[i].size;
+    }
+
+    // the whole request is locked once, segments must not go through __disk_read/__disk_write again
+    range_lock(&rs, write);
+    if (wbq_held) {
+        pthread_rwlock_unlock(&wbq.lock);
+    }
+    for (int i = 0; i < n; i++) {
+        const struct disk_iovec *v = &iov[i];
+        if (v->size == 0) {
+            continue;
+        }
+        if (disk_map(v->where, v->size)) {
+            // the image is mapped, no syscall is needed
+            if (write && v->p != disk_map_base + v->where)
+                memcpy(disk_map_base + v->where, v->p, v->size);
+            else if (!write)
+                memcpy(v->p, disk_map_base + v->where, v->size);
+            ret += v->size;
+            continue;
+        }
+        struct disk_run *last = nrun ? &runs[nrun - 1] : NULL;
+        if (last && last->where + (off_t)last->size == v->where) {
+            // adjacent on disk, append to the last run, or even to its last vec if adjacent in memory too
+            struct iovec *last_vec = &vecs[nvec - 1];
+            if ((uint8_t *)last_vec->iov_base + last_vec->iov_len == v->p) {
+                last_vec->iov_len += v->size;
+            } else {
+                vecs[nvec++] = (struct iovec){v->p, v->size};
+                last->cnt++;
+            }
+            last->size += v->size;
+        } else {
+            vecs[nvec] = (struct iovec){v->p, v->size};
+            runs[nrun++] = (struct disk_run){v->where, v->size, &vecs[nvec], 1, 0};
+            nvec++;
+        }
+    }
+    if (nrun > 1 || (nrun == 1 && runs[0].cnt > 1)) {
+        DEBUG("Disk %s %d segments in %d runs", write ? "Write" : "Read", n, nrun);
+    }
+
+    ret += backend->rwv(runs, nrun, write);
+    range_unlock(&rs);
+
+    if (ret != total) {
+        ERR("Disk %s %d/%d bytes [%s:%d]", write ? "Write" : "Read", ret, total, func, line);
+    }
+    iostat_account(func, line, write ? IOSTAT_WRITE : IOSTAT_READ, ret, start);
+    return ret;
+}
+
+int __disk_readv(const struct disk_iovec *iov, int n, const char *func, int line) {
+    if (wbq_empty()) {
+        return disk_rwv(iov, n, 0, 0, func, line);
+    }
+    pthread_rwlock_rdlock(&wbq.lock);
+    int ret = disk_rwv(iov, n, 0, 0, func, line);
+    for (int i = 0; i < n; i++) {
+        wbq_overlap_copy(iov[i].where, iov[i].size, iov[i].p, 0);
+    }
+    pthread_rwlock_unlock(&wbq.lock);
+    return ret;
+}
+
+int __disk_writev(const struct disk_iovec *iov, int n, const char *func, int line) {
+    wbq_write_lock(iov, n);
+    return disk_rwv(iov, n, 1, 1, func, line);
+}
+
+void *disk_map(off_t where, size_t size) {
+    if (disk_map_base == NULL || where < 0 || (size_t)where + size > disk_map_size) {
+        return NULL;
+    }
+    return disk_map_base + where;
+}
+
+int disk_is_mapped(const void *p) {
+    return disk_map_base && (const uint8_t *)p >= disk_map_base && (const uint8_t *)p < disk_map_base + disk_map_size;
+}
+
 int disk_ctx_create(struct disk_ctx *dctx, off_t where, size_t size, uint32_t len) {
     ASSERT(dctx); /* Should be user allocated */
     ASSERT(size);
@@ -8,7 +8,13 @@
 #define disk_read_block(__blocks, __p)  __disk_read(BLOCKS2BYTES(__blocks), BLOCK_SIZE, __p, __func__, __LINE__)
 #define disk_write(__where, __s, __p)   __disk_write(__where, __s, __p, __func__, __LINE__)
 #define disk_write_block(__blocks, __p) __disk_write(BLOCKS2BYTES(__blocks), BLOCK_SIZE, __p, __func__, __LINE__)
+#define disk_write_queued(__where, __s, __p) __disk_write_queued(__where, __s, __p, __func__, __LINE__)
+#define disk_write_block_queued(__blocks, __p) \
+    __disk_write_queued(BLOCKS2BYTES(__blocks), BLOCK_SIZE, __p, __func__, __LINE__)
 #define disk_ctx_read(__ctx, __s, __p)  __disk_ctx_read(__ctx, __s, __p, __func__, __LINE__)
+#define disk_readv(__iov, __n)          __disk_readv(__iov, __n, __func__, __LINE__)
+#define disk_writev(__iov, __n)         __disk_writev(__iov, __n, __func__, __LINE__)
+#define disk_map_block(__blocks)        disk_map(BLOCKS2BYTES(__blocks), BLOCK_SIZE)
 #define disk_read_type(__where, __t)                                                        \
     ({                                                                                      \
         __t ret;                                                                            \
@@ -23,11 +29,96 @@ struct disk_ctx {
     size_t size; /* How much to read */
 };
 
-int disk_open(const char *path);
+// one (disk range <-> memory buffer) segment of a vectored request
+struct disk_iovec {
+    off_t where;  // disk offset
+    size_t size;  // bytes to transfer
+    void *p;      // memory buffer
+};
+
+#define DISK_BATCH_MAX 64  // max segments of one vectored request
+
+// disk_open flags
+#define DISK_F_URING    (1 << 0)  // use io_uring for vectored requests, fallback to pread if not supported
+#define DISK_F_MMAP     (1 << 1)  // map the whole disk image, see disk_map
+#define DISK_F_DIRECT   (1 << 2)  // open with O_DIRECT to bypass the host page cache, ignores DISK_F_MMAP
+#define DISK_F_RAM      (1 << 3)  // load the image into memory and save it back on disk_close, see disk_ram.c
+#define DISK_F_HUGEPAGE (1 << 4)  // back the ram disk with hugepages
+
+/**
+ * @brief open the disk image with the file backend, or the ram disk backend if DISK_F_RAM is set
+ *
+ * @return int 0 on success, -errno on failure
+ */
+int disk_open(const char *path, int flags);
+
+/**
+ * @brief flush the write-back queue and the backend, then close it
+ */
 int disk_close();
 int __disk_read(off_t where, size_t size, void *p, const char *func, int line);
 int __disk_write(off_t where, size_t size, void *p, const char *func, int line);
 
+/**
+ * @brief copy [p, p + size) into the write-back queue, it reaches the disk at the next disk_flush
+ *
+ * Adjacent and overlapping queued ranges are merged and written in offset order, reads always see the
+ * queued data. Use it for small metadata writes.
+ *
+ * @return int size, -EIO if the queue grew too large and flushing it failed
+ */
+int __disk_write_queued(off_t where, size_t size, void *p, const char *func, int line);
+
+/**
+ * @brief write all the queued ranges to disk
+ *
+ * @return int 0 on success, -EIO if some range fails
+ */
+int disk_flush();
+
+/**
+ * @brief disk_flush, then make everything written so far durable in the backend. Costly (fsync, or the
+ * whole image for the ram disk), only for fsync and unmount
+ *
+ * @return int 0 on success, -EIO if some range fails, -errno if the backend fails to flush
+ */
+int disk_sync();
+
+/**
+ * @brief read/write all the segments of iov in as few syscalls as possible
+ *
+ * Segments adjacent on disk are merged into one preadv/pwritev, the merged runs are submitted together
+ * in one io_uring_enter if io_uring is enabled.
+ *
+ * @param iov
+ * @param n number of segments, no more than DISK_BATCH_MAX
+ * @return int total bytes transferred
+ */
+int __disk_readv(const struct disk_iovec *iov, int n, const char *func, int line);
+int __disk_writev(const struct disk_iovec *iov, int n, const char *func, int line);
+
+/**
+ * @brief borrow a pointer to [where, where + size) of the disk image, only in DISK_F_MMAP mode
+ *
+ * The pointer stays valid until disk_close. Writes through it go to the image directly (MAP_SHARED),
+ * a later disk_write of the same pointer to the same offset is a no-op.
+ *
+ * @return void* NULL if the image is not mapped, caller should fallback to disk_read
+ */
+void *disk_map(off_t where, size_t size);
+
+/**
+ * @brief check if p is a pointer borrowed by disk_map, such memory must not be freed
+ */
+int disk_is_mapped(const void *p);
+
+/**
+ * @brief tell the backend [where, where + size) is not used any more, its content becomes undefined
+ *
+ * @return int 0 on success, -EOPNOTSUPP if the backend can't discard
+ */
+int disk_discard(off_t where, size_t size);
+
 int disk_ctx_create(struct disk_ctx *dctx, off_t where, size_t size, uint32_t len);
 int __disk_ctx_read(struct disk_ctx *dctx, size_t size, void *p, const char *func, int line);
 uint64_t disk_size();
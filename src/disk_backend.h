@@ -0,0 +1,38 @@
+#ifndef DISK_BACKEND_H
+#define DISK_BACKEND_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+// disk segments that are adjacent on disk, transferred by one preadv/pwritev
+struct disk_run {
+    off_t where;
+    size_t size;
+    struct iovec *vec;
+    int cnt;
+    int done;  // set by the backend once the run is transferred completely
+};
+
+/*
+ * A block device backend. disk.c does the range locking, the write-back queue and the accounting, a
+ * backend only moves bytes, so none of these functions need to be thread safe for overlapping ranges.
+ */
+struct disk_backend {
+    const char *name;
+    int (*open)(const char *path, int flags);  // DISK_F_* flags, return -errno on failure
+    int (*close)();
+    ssize_t (*read)(void *p, size_t size, off_t where);
+    ssize_t (*write)(const void *p, size_t size, off_t where);
+    ssize_t (*rwv)(struct disk_run *runs, int n, int write);  // transfer all the runs, return total bytes
+    int (*flush)();                                             // make all the written data durable
+    int (*discard)(off_t where, size_t size);                   // the range is unused, its data may be dropped
+    uint64_t (*size)();
+    void *(*map)(size_t *size);  // the whole image if it's addressable in memory, NULL otherwise
+    uint32_t (*align)();         // offset, size and memory of a request must be aligned to it, 1 if any is fine
+};
+
+extern const struct disk_backend disk_file_backend;
+extern const struct disk_backend disk_ram_backend;
+
+#endif
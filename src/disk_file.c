@@ -0,0 +1,641 @@
+/*
+ * Copyright (c) 2010, Gerard Lledó Vives, gerard.lledo@gmail.com
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation. See README and COPYING for
+ * more details.
+ */
+
+#define _GNU_SOURCE  // O_DIRECT, fallocate
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/falloc.h>
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#endif
+
+#include "disk.h"
+#include "disk_backend.h"
+#include "logging.h"
+
+// file backend, the image (or a block device) accessed with pread/pwrite, io_uring or mmap
+
+static int disk_fd = -1;
+
+// the whole disk image mapped in DISK_F_MMAP mode
+static uint8_t *file_map_base = NULL;
+static size_t file_map_size = 0;
+
+/*
+ * In DISK_F_DIRECT mode the image is opened with O_DIRECT, offset, size and memory of every request must
+ * be DISK_DIRECT_ALIGN aligned. Requests that are not are bounced through buffers of the pool, partial
+ * blocks of an unaligned write are read, modified and written back as a whole.
+ */
+#define DISK_DIRECT_ALIGN  4096
+#define DISK_POOL_BUF_SIZE (64 * 1024)  // bytes bounced per syscall
+#define DISK_POOL_MAX      32           // max idle buffers kept in the pool
+
+#define DISK_ALIGN_DOWN(x) ((x) & ~((uint64_t)DISK_DIRECT_ALIGN - 1))
+#define DISK_ALIGN_UP(x)   DISK_ALIGN_DOWN((x) + DISK_DIRECT_ALIGN - 1)
+#define DISK_IS_ALIGNED(__p, __s, __w)                                                                 \
+    ((((uintptr_t)(__p) | (uint64_t)(__s) | (uint64_t)(__w)) & (DISK_DIRECT_ALIGN - 1)) == 0)
+
+static int disk_direct = 0;
+
+static struct {
+    pthread_mutex_t lock;
+    void *bufs[DISK_POOL_MAX];
+    int count;
+} disk_pool = {PTHREAD_MUTEX_INITIALIZER, {NULL}, 0};
+
+static void *disk_pool_get() {
+    void *buf = NULL;
+    pthread_mutex_lock(&disk_pool.lock);
+    if (disk_pool.count) {
+        buf = disk_pool.bufs[--disk_pool.count];
+    }
+    pthread_mutex_unlock(&disk_pool.lock);
+    if (buf == NULL && posix_memalign(&buf, DISK_DIRECT_ALIGN, DISK_POOL_BUF_SIZE) != 0) {
+        ERR("fail to allocate aligned buffer");
+        return NULL;
+    }
+    return buf;
+}
+
+static void disk_pool_put(void *buf) {
+    pthread_mutex_lock(&disk_pool.lock);
+    if (disk_pool.count < DISK_POOL_MAX) {
+        disk_pool.bufs[disk_pool.count++] = buf;
+        buf = NULL;
+    }
+    pthread_mutex_unlock(&disk_pool.lock);
+    free(buf);
+}
+
+static void disk_pool_exit() {
+    pthread_mutex_lock(&disk_pool.lock);
+    while (disk_pool.count) {
+        free(disk_pool.bufs[--disk_pool.count]);
+    }
+    pthread_mutex_unlock(&disk_pool.lock);
+}
+
+static int pread_wrapper(int fd, void *p, size_t size, off_t where) {
+#if defined(__FreeBSD__) && !defined(__APPLE__)
+#define PREAD_BLOCK_SIZE 1024
+    /* FreeBSD needs to read aligned whole blocks.
+     * TODO: Check what is a safe block size.
+     */
+    static __thread uint8_t block[PREAD_BLOCK_SIZE];
+    off_t first_offset = where % PREAD_BLOCK_SIZE;
+    int ret = 0;
+
+    if (first_offset) {
+        /* This is the case if the read doesn't start on a block boundary.
+         * We still need to read the whole block and we do, but we only copy to
+         * the out pointer the bytes that where actually asked for.  In this
+         * case first_offset is the offset into the block. */
+        int pread_ret = pread(fd, block, PREAD_BLOCK_SIZE, where - first_offset);
+        ASSERT(pread_ret == PREAD_BLOCK_SIZE);
+
+        size_t first_size = MIN(size, (size_t)(PREAD_BLOCK_SIZE - first_offset));
+        memcpy(p, block + first_offset, first_size);
+        p += first_size;
+        size -= first_size;
+        where += first_size;
+        ret += first_size;
+
+        if (!size)
+            return ret;
+    }
+
+    ASSERT(where % PREAD_BLOCK_SIZE == 0);
+
+    size_t mid_read_size = (size / PREAD_BLOCK_SIZE) * PREAD_BLOCK_SIZE;
+    if (mid_read_size) {
+        int pread_ret_mid = pread(fd, p, mid_read_size, where);
+        ASSERT((size_t)pread_ret_mid == mid_read_size);
+
+        p += mid_read_size;
+        size -= mid_read_size;
+        where += mid_read_size;
+        ret += mid_read_size;
+
+        if (!size)
+            return ret;
+    }
+
+    ASSERT(size < PREAD_BLOCK_SIZE);
+
+    int pread_ret_last = pread(fd, block, PREAD_BLOCK_SIZE, where);
+    ASSERT(pread_ret_last == PREAD_BLOCK_SIZE);
+
+    memcpy(p, block, size);
+
+    return ret + size;
+#else
+    return pread(fd, p, size, where);
+#endif
+}
+
+// pread of the disk, requests not aligned for O_DIRECT are bounced through the buffer pool
+static ssize_t disk_pread(void *p, size_t size, off_t where) {
+    if (!disk_direct || DISK_IS_ALIGNED(p, size, where)) {
+        return pread_wrapper(disk_fd, p, size, where);
+    }
+
+    uint8_t *bounce = disk_pool_get();
+    if (bounce == NULL) {
+        return -1;
+    }
+    size_t done = 0;
+    while (done < size) {
+        off_t pos = where + done;
+        off_t start = DISK_ALIGN_DOWN(pos);
+        size_t head = pos - start;
+        size_t len = size - done < DISK_POOL_BUF_SIZE - head ? size - done : DISK_POOL_BUF_SIZE - head;
+        ssize_t ret = pread(disk_fd, bounce, DISK_ALIGN_UP(head + len), start);
+        if (ret < (ssize_t)(head + len)) {
+            ERR("direct read 0x%jx +0x%zx failed: %s", start, DISK_ALIGN_UP(head + len), strerror(errno));
+            break;
+        }
+        memcpy((uint8_t *)p + done, bounce + head, len);
+        done += len;
+    }
+    disk_pool_put(bounce);
+    return done;
+}
+
+// pwrite of the disk, partial blocks of an unaligned O_DIRECT request are read-modify-written
+static ssize_t disk_pwrite(const void *p, size_t size, off_t where) {
+    if (!disk_direct || DISK_IS_ALIGNED(p, size, where)) {
+        return pwrite(disk_fd, p, size, where);
+    }
+
+    uint8_t *bounce = disk_pool_get();
+    if (bounce == NULL) {
+        return -1;
+    }
+    size_t done = 0;
+    while (done < size) {
+        off_t pos = where + done;
+        off_t start = DISK_ALIGN_DOWN(pos);
+        size_t head = pos - start;
+        size_t len = size - done < DISK_POOL_BUF_SIZE - head ? size - done : DISK_POOL_BUF_SIZE - head;
+        size_t io_len = DISK_ALIGN_UP(head + len);
+
+        // the first and the last block are partially written, fill the rest of them from disk
+        if (head) {
+            memset(bounce, 0, DISK_DIRECT_ALIGN);
+            pread(disk_fd, bounce, DISK_DIRECT_ALIGN, start);
+        }
+        if ((head + len) % DISK_DIRECT_ALIGN && (io_len > DISK_DIRECT_ALIGN || head == 0)) {
+            memset(bounce + io_len - DISK_DIRECT_ALIGN, 0, DISK_DIRECT_ALIGN);
+            pread(disk_fd, bounce + io_len - DISK_DIRECT_ALIGN, DISK_DIRECT_ALIGN, start + io_len - DISK_DIRECT_ALIGN);
+        }
+        memcpy(bounce + head, (const uint8_t *)p + done, len);
+        if (pwrite(disk_fd, bounce, io_len, start) != (ssize_t)io_len) {
+            ERR("direct write 0x%jx +0x%zx failed: %s", start, io_len, strerror(errno));
+            break;
+        }
+        done += len;
+    }
+    disk_pool_put(bounce);
+    return done;
+}
+
+// preadv/pwritev until the whole run is transferred, vec is consumed
+static ssize_t disk_prwv(struct iovec *vec, int cnt, off_t where, int write) {
+    ssize_t done = 0;
+    while (cnt) {
+#if defined(__FreeBSD__) && !defined(__APPLE__)
+        // pread_wrapper takes care of the block alignment
+        ssize_t ret = write ? pwrite(disk_fd, vec->iov_base, vec->iov_len, where)
+                            : pread_wrapper(disk_fd, vec->iov_base, vec->iov_len, where);
+#else
+        ssize_t ret = write ? pwritev(disk_fd, vec, cnt, where) : preadv(disk_fd, vec, cnt, where);
+#endif
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0) {
+            ERR("disk %s 0x%jx failed: %s", write ? "write" : "read", where, ret ? strerror(errno) : "EOF");
+            break;
+        }
+        done += ret;
+        where += ret;
+        // skip the finished vecs, the last one may be partially done
+        while (cnt && (size_t)ret >= vec->iov_len) {
+            ret -= vec->iov_len;
+            vec++;
+            cnt--;
+        }
+        if (cnt) {
+            vec->iov_base = (uint8_t *)vec->iov_base + ret;
+            vec->iov_len -= ret;
+        }
+    }
+    return done;
+}
+
+#ifdef __linux__
+#define DISK_URING_DEPTH DISK_BATCH_MAX
+
+// a minimal io_uring without liburing, only used to submit and reap a batch of reads
+struct disk_uring {
+    int fd;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;
+    size_t cq_ring_size;
+    size_t sqes_size;
+};
+
+// every thread submits to its own ring, so batches from different threads never contend on a lock
+static int uring_enabled = 0;
+static pthread_key_t ring_key;
+static __thread struct disk_uring *ring = NULL;
+static __thread int ring_off = 0;  // the ring of this thread failed, it is not created again
+
+static void disk_uring_exit(struct disk_uring *r) {
+    if (r->sqes && r->sqes != MAP_FAILED)
+        munmap(r->sqes, r->sqes_size);
+    if (r->cq_ring && r->cq_ring != MAP_FAILED && r->cq_ring != r->sq_ring)
+        munmap(r->cq_ring, r->cq_ring_size);
+    if (r->sq_ring && r->sq_ring != MAP_FAILED)
+        munmap(r->sq_ring, r->sq_ring_size);
+    if (r->fd >= 0)
+        close(r->fd);
+    free(r);
+}
+
+static struct disk_uring *disk_uring_init(unsigned entries) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+
+    struct disk_uring *r = calloc(1, sizeof(struct disk_uring));
+    r->fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (r->fd < 0) {
+        WARNING("io_uring_setup failed: %s", strerror(errno));
+        free(r);
+        return NULL;
+    }
+
+    r->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    r->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        // sq and cq rings share one mapping
+        if (r->cq_ring_size > r->sq_ring_size)
+            r->sq_ring_size = r->cq_ring_size;
+        r->cq_ring_size = r->sq_ring_size;
+    }
+    r->sq_ring =
+        mmap(NULL, r->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    if (r->sq_ring == MAP_FAILED)
+        goto fail;
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        r->cq_ring = r->sq_ring;
+    } else {
+        r->cq_ring =
+            mmap(NULL, r->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+        if (r->cq_ring == MAP_FAILED)
+            goto fail;
+    }
+    r->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED)
+        goto fail;
+
+    r->sq_head = r->sq_ring + params.sq_off.head;
+    r->sq_tail = r->sq_ring + params.sq_off.tail;
+    r->sq_mask = r->sq_ring + params.sq_off.ring_mask;
+    r->sq_array = r->sq_ring + params.sq_off.array;
+    r->cq_head = r->cq_ring + params.cq_off.head;
+    r->cq_tail = r->cq_ring + params.cq_off.tail;
+    r->cq_mask = r->cq_ring + params.cq_off.ring_mask;
+    r->cqes = r->cq_ring + params.cq_off.cqes;
+    DEBUG("io_uring init with %u sq entries, %u cq entries", params.sq_entries, params.cq_entries);
+    return r;
+
+fail:
+    WARNING("io_uring mmap failed: %s", strerror(errno));
+    disk_uring_exit(r);
+    return NULL;
+}
+
+// ring_key destructor, called when a thread that owns a ring exits
+static void disk_uring_thread_exit(void *r) {
+    disk_uring_exit(r);
+}
+
+// get the ring of current thread, create it on first use
+static struct disk_uring *disk_uring_get() {
+    if (ring == NULL && uring_enabled && !ring_off) {
+        ring = disk_uring_init(DISK_URING_DEPTH);
+        if (ring == NULL) {
+            WARNING("io_uring is not available in this thread, fallback to pread");
+            return NULL;
+        }
+        pthread_setspecific(ring_key, ring);
+    }
+    return ring;
+}
+
+// wait for nr completions, retrying the interrupted waits; -1 if the ring can't be waited on any more
+static int disk_uring_wait(struct disk_uring *r, unsigned nr) {
+    while (syscall(__NR_io_uring_enter, r->fd, 0, nr, IORING_ENTER_GETEVENTS, NULL, 0) < 0) {
+        if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+            ERR("io_uring_enter failed: %s", strerror(errno));
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// a ring that can't be drained may still transfer into the buffers of the caller, it is closed (the kernel
+// cancels what is in flight) and this thread goes on with preadv/pwritev
+static void disk_uring_drop() {
+    WARNING("io_uring of this thread is broken, disable it");
+    pthread_setspecific(ring_key, NULL);
+    disk_uring_exit(ring);
+    ring = NULL;
+    ring_off = 1;
+}
+
+/**
+ * @brief submit all the runs in one io_uring_enter and wait for all of them. Every sqe the kernel took is
+ * reaped before returning, even on failure, so no transfer is left in flight when the runs are retried
+ *
+ * @return int 0 if all the runs are transferred completely, -1 if some runs are left (done == 0)
+ */
+static int disk_uring_rw(struct disk_uring *r, struct disk_run *runs, int n, int write) {
+    unsigned tail = *r->sq_tail;
+    for (int i = 0; i < n; i++) {
+        unsigned idx = tail & *r->sq_mask;
+        struct io_uring_sqe *sqe = &r->sqes[idx];
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = write ? IORING_OP_WRITEV : IORING_OP_READV;
+        sqe->fd = disk_fd;
+        sqe->off = runs[i].where;
+        sqe->addr = (uint64_t)(uintptr_t)runs[i].vec;
+        sqe->len = runs[i].cnt;
+        sqe->user_data = i;
+        r->sq_array[idx] = idx;
+        tail++;
+    }
+    // make sqes visible to the kernel before the tail update
+    __atomic_store_n(r->sq_tail, tail, __ATOMIC_RELEASE);
+
+    int left = 0;
+    unsigned submitted = 0;
+    while (submitted < (unsigned)n) {
+        int ret = syscall(__NR_io_uring_enter, r->fd, n - submitted, 0, 0, NULL, 0);
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            ERR("io_uring_enter failed: %s", strerror(errno));
+            // the kernel only reads the sqes in io_uring_enter, take back the ones it didn't consume
+            unsigned head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+            submitted = n - (tail - head);
+            __atomic_store_n(r->sq_tail, head, __ATOMIC_RELEASE);
+            left = 1;
+            break;
+        }
+        submitted += ret;
+    }
+
+    unsigned reaped = 0;
+    while (reaped < submitted) {
+        unsigned head = *r->cq_head;
+        if (head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+            // wait for the rest completions
+            if (disk_uring_wait(r, submitted - reaped) < 0) {
+                disk_uring_drop();
+                return -1;
+            }
+            continue;
+        }
+        struct io_uring_cqe *cqe = &r->cqes[head & *r->cq_mask];
+        struct disk_run *run = &runs[cqe->user_data];
+        if (cqe->res < 0 || (size_t)cqe->res != run->size) {
+            // the whole run is transferred again by preadv/pwritev
+            DEBUG("io_uring short %s 0x%jx +0x%zx: %d", write ? "write" : "read", run->where, run->size, cqe->res);
+            left = 1;
+        } else {
+            run->done = 1;
+        }
+        __atomic_store_n(r->cq_head, head + 1, __ATOMIC_RELEASE);
+        reaped++;
+    }
+    return left ? -1 : 0;
+}
+#endif
+
+// in O_DIRECT mode a run can only be transferred as is if it is aligned all along
+static int file_run_aligned(const struct disk_run *run) {
+    if (!DISK_IS_ALIGNED(0, run->size, run->where)) {
+        return 0;
+    }
+    for (int i = 0; i < run->cnt; i++) {
+        if (!DISK_IS_ALIGNED(run->vec[i].iov_base, run->vec[i].iov_len, 0)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static ssize_t file_rwv(struct disk_run *runs, int n, int write) {
+    ssize_t ret = 0;
+    int aligned = 1;
+    if (disk_direct) {
+        for (int i = 0; i < n && aligned; i++) {
+            aligned = file_run_aligned(&runs[i]);
+        }
+    }
+
+#ifdef __linux__
+    // a single run is one syscall anyway, only submit to the ring when there are more
+    struct disk_uring *r = n > 1 && aligned ? disk_uring_get() : NULL;
+    if (r && disk_uring_rw(r, runs, n, write) < 0) {
+        WARNING("io_uring %s failed, fallback to %s", write ? "write" : "read", write ? "pwritev" : "preadv");
+    }
+#endif
+
+    for (int i = 0; i < n; i++) {
+        struct disk_run *run = &runs[i];
+        if (run->done) {
+            ret += run->size;
+        } else if (disk_direct && !file_run_aligned(run)) {
+            // O_DIRECT needs a bounce buffer, transfer the vecs one by one
+            off_t where = run->where;
+            for (int j = 0; j < run->cnt; j++) {
+                ret += write ? disk_pwrite(run->vec[j].iov_base, run->vec[j].iov_len, where)
+                             : disk_pread(run->vec[j].iov_base, run->vec[j].iov_len, where);
+                where += run->vec[j].iov_len;
+            }
+        } else {
+            ret += disk_prwv(run->vec, run->cnt, run->where, write);
+        }
+    }
+    return ret;
+}
+
+static int file_open(const char *path, int flags) {
+    if (flags & DISK_F_DIRECT) {
+#ifdef O_DIRECT
+        disk_fd = open(path, O_RDWR | O_DIRECT);
+        if (disk_fd >= 0) {
+            disk_direct = 1;
+            INFO("disk opened with O_DIRECT");
+        } else if (errno == EINVAL) {
+            // the filesystem holding the image doesn't support O_DIRECT
+            WARNING("O_DIRECT is not supported by %s, fallback to buffered io", path);
+        } else {
+            return -errno;
+        }
+#else
+        WARNING("O_DIRECT is not supported on this platform, fallback to buffered io");
+#endif
+        if (disk_direct && (flags & DISK_F_MMAP)) {
+            // a mapping goes through the page cache that O_DIRECT is asked to bypass
+            WARNING("mmap is ignored in direct mode");
+            flags &= ~DISK_F_MMAP;
+        }
+    }
+    if (!disk_direct) {
+        disk_fd = open(path, O_RDWR);
+    }
+    if (disk_fd < 0) {
+        return -errno;
+    }
+
+    if (flags & DISK_F_MMAP) {
+        // st_size is 0 for block devices, so ask lseek for the size
+        off_t size = lseek(disk_fd, 0, SEEK_END);
+        void *p = size > 0 ? mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, disk_fd, 0) : MAP_FAILED;
+        if (p == MAP_FAILED) {
+            WARNING("fail to mmap disk image: %s, fallback to pread", strerror(errno));
+        } else {
+            file_map_base = p;
+            file_map_size = size;
+            INFO("disk image mapped at %p, %zu bytes", file_map_base, file_map_size);
+        }
+    }
+
+#ifdef __linux__
+    if (flags & DISK_F_URING) {
+        // probe once here, the rings of worker threads are created lazily
+        pthread_key_create(&ring_key, disk_uring_thread_exit);
+        uring_enabled = 1;
+        if (disk_uring_get() == NULL) {
+            uring_enabled = 0;
+        } else {
+            INFO("io_uring enabled with %d entries per thread", DISK_URING_DEPTH);
+        }
+    }
+#else
+    if (flags & DISK_F_URING) {
+        WARNING("io_uring is only supported on linux, fallback to pread");
+    }
+#endif
+
+    return 0;
+}
+
+static int file_close() {
+#ifdef __linux__
+    if (uring_enabled) {
+        // rings of the other threads are released by the key destructor when they exit
+        if (ring) {
+            pthread_setspecific(ring_key, NULL);
+            disk_uring_exit(ring);
+            ring = NULL;
+        }
+        uring_enabled = 0;
+    }
+#endif
+    if (file_map_base) {
+        munmap(file_map_base, file_map_size);
+        file_map_base = NULL;
+        file_map_size = 0;
+    }
+    disk_pool_exit();
+    disk_direct = 0;
+    int ret = close(disk_fd);
+    disk_fd = -1;
+    return ret;
+}
+
+static int file_flush() {
+    // a shared mapping lives in the page cache of the file, fsync covers it too
+    if (fsync(disk_fd) < 0) {
+        ERR("fsync failed: %s", strerror(errno));
+        return -errno;
+    }
+    return 0;
+}
+
+static int file_discard(off_t where, size_t size) {
+#if defined(__linux__) && defined(FALLOC_FL_PUNCH_HOLE)
+    if (fallocate(disk_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, where, size) < 0) {
+        return -errno;
+    }
+    return 0;
+#else
+    (void)where;
+    (void)size;
+    return -EOPNOTSUPP;
+#endif
+}
+
+static uint64_t file_size() {
+    struct stat st;
+    if (fstat(disk_fd, &st) < 0) {
+        return 0;
+    }
+    return st.st_size;
+}
+
+static void *file_map(size_t *size) {
+    *size = file_map_size;
+    return file_map_base;
+}
+
+static uint32_t file_align() {
+    return disk_direct ? DISK_DIRECT_ALIGN : 1;
+}
+
+const struct disk_backend disk_file_backend = {
+    .name = "file",
+    .open = file_open,
+    .close = file_close,
+    .read = disk_pread,
+    .write = disk_pwrite,
+    .rwv = file_rwv,
+    .flush = file_flush,
+    .discard = file_discard,
+    .size = file_size,
+    .map = file_map,
+    .align = file_align,
+};
@@ -0,0 +1,208 @@
+#define _GNU_SOURCE  // MAP_HUGETLB, MADV_HUGEPAGE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "disk.h"
+#include "disk_backend.h"
+#include "logging.h"
+
+/*
+ * RAM disk backend. The whole image is loaded into anonymous memory on open and snapshotted back to the
+ * image file by flush (fsync and disk_close), nothing touches the file in between. The
+ * memory is handed to disk.c as a mapped image, so every request is a memcpy there.
+ */
+#define RAM_HUGEPAGE_SIZE (2 << 20)
+#define RAM_IO_CHUNK      (8 << 20)  // bytes per pread/pwrite when loading and saving the image
+
+static int ram_fd = -1;  // the image file, kept open for the snapshot
+static uint8_t *ram_base = NULL;
+static size_t ram_size = 0;      // bytes of the image
+static size_t ram_map_size = 0;  // bytes mapped, rounded up to the hugepage size with DISK_F_HUGEPAGE
+
+// shared, not private: the image is loaded before fuse daemonizes, a private mapping would be copied on
+// write in the child while the parent still holds it
+static void *ram_alloc(size_t size, int flags) {
+    void *p = MAP_FAILED;
+    ram_map_size = size;
+    if (flags & DISK_F_HUGEPAGE) {
+        ram_map_size = (size + RAM_HUGEPAGE_SIZE - 1) & ~((size_t)RAM_HUGEPAGE_SIZE - 1);
+#ifdef MAP_HUGETLB
+        p = mmap(NULL, ram_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (p != MAP_FAILED) {
+            INFO("ram disk on explicit hugepages");
+            return p;
+        }
+        WARNING("no explicit hugepages for the ram disk: %s, try transparent hugepages", strerror(errno));
+#endif
+    }
+    p = mmap(NULL, ram_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+#ifdef MADV_HUGEPAGE
+    if (p != MAP_FAILED && (flags & DISK_F_HUGEPAGE) && madvise(p, ram_map_size, MADV_HUGEPAGE) < 0) {
+        WARNING("no transparent hugepages for the ram disk: %s", strerror(errno));
+    }
+#endif
+    return p;
+}
+
+static int ram_open(const char *path, int flags) {
+    if (flags & (DISK_F_URING | DISK_F_MMAP | DISK_F_DIRECT)) {
+        WARNING("io engine, mmap and direct options are ignored by the ram disk");
+    }
+    ram_fd = open(path, O_RDWR);
+    if (ram_fd < 0) {
+        return -errno;
+    }
+    // st_size is 0 for block devices, so ask lseek for the size
+    off_t size = lseek(ram_fd, 0, SEEK_END);
+    if (size <= 0) {
+        ERR("fail to get the size of %s", path);
+        close(ram_fd);
+        ram_fd = -1;
+        return -EINVAL;
+    }
+    ram_size = size;
+    void *p = ram_alloc(ram_size, flags);
+    if (p == MAP_FAILED) {
+        int err = errno;
+        ERR("fail to allocate %zu bytes for the ram disk: %s", ram_size, strerror(err));
+        close(ram_fd);
+        ram_fd = -1;
+        return -err;
+    }
+    ram_base = p;
+
+    for (size_t done = 0; done < ram_size;) {
+        size_t len = ram_size - done < RAM_IO_CHUNK ? ram_size - done : RAM_IO_CHUNK;
+        ssize_t ret = pread(ram_fd, ram_base + done, len, done);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0) {
+            int err = ret ? errno : EIO;
+            ERR("fail to load the image into the ram disk at 0x%zx: %s", done, strerror(err));
+            munmap(ram_base, ram_map_size);
+            ram_base = NULL;
+            close(ram_fd);
+            ram_fd = -1;
+            return -err;
+        }
+        done += ret;
+    }
+    INFO("ram disk loaded, %zu bytes", ram_size);
+    return 0;
+}
+
+static int ram_close() {
+    if (ram_base) {
+        munmap(ram_base, ram_map_size);
+        ram_base = NULL;
+        ram_size = 0;
+        ram_map_size = 0;
+    }
+    int ret = close(ram_fd);
+    ram_fd = -1;
+    return ret;
+}
+
+static ssize_t ram_read(void *p, size_t size, off_t where) {
+    if ((size_t)where >= ram_size) {
+        return 0;
+    }
+    if (size > ram_size - where) {
+        size = ram_size - where;
+    }
+    memcpy(p, ram_base + where, size);
+    return size;
+}
+
+static ssize_t ram_write(const void *p, size_t size, off_t where) {
+    if ((size_t)where >= ram_size) {
+        return 0;
+    }
+    if (size > ram_size - where) {
+        size = ram_size - where;
+    }
+    memcpy(ram_base + where, p, size);
+    return size;
+}
+
+static ssize_t ram_rwv(struct disk_run *runs, int n, int write) {
+    ssize_t ret = 0;
+    for (int i = 0; i < n; i++) {
+        off_t where = runs[i].where;
+        for (int j = 0; j < runs[i].cnt; j++) {
+            struct iovec *vec = &runs[i].vec[j];
+            ret += write ? ram_write(vec->iov_base, vec->iov_len, where)
+                         : ram_read(vec->iov_base, vec->iov_len, where);
+            where += vec->iov_len;
+        }
+        runs[i].done = 1;
+    }
+    return ret;
+}
+
+// write the whole image back to the file
+static int ram_flush() {
+    INFO("snapshot ram disk to file, %zu bytes", ram_size);
+    for (size_t done = 0; done < ram_size;) {
+        size_t len = ram_size - done < RAM_IO_CHUNK ? ram_size - done : RAM_IO_CHUNK;
+        ssize_t ret = pwrite(ram_fd, ram_base + done, len, done);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0) {
+            int err = ret ? errno : EIO;
+            ERR("fail to snapshot the ram disk at 0x%zx: %s", done, strerror(err));
+            return -err;
+        }
+        done += ret;
+    }
+    if (fsync(ram_fd) < 0) {
+        ERR("fsync failed: %s", strerror(errno));
+        return -errno;
+    }
+    return 0;
+}
+
+static int ram_discard(off_t where, size_t size) {
+    if ((size_t)where >= ram_size) {
+        return 0;
+    }
+    if (size > ram_size - where) {
+        size = ram_size - where;
+    }
+    memset(ram_base + where, 0, size);
+    return 0;
+}
+
+static uint64_t ram_disk_size() {
+    return ram_size;
+}
+
+static void *ram_map(size_t *size) {
+    *size = ram_size;
+    return ram_base;
+}
+
+static uint32_t ram_align() {
+    return 1;
+}
+
+const struct disk_backend disk_ram_backend = {
+    .name = "ram",
+    .open = ram_open,
+    .close = ram_close,
+    .read = ram_read,
+    .write = ram_write,
+    .rwv = ram_rwv,
+    .flush = ram_flush,
+    .discard = ram_discard,
+    .size = ram_disk_size,
+    .map = ram_map,
+    .align = ram_align,
+};
@@ -86,4 +86,41 @@ struct ext4_dir_entry_tail {
 #define EXT4_DE_TAIL_SIZE 12
 #define EXT4_DE_DOT_SIZE  12  // . ..
 
+// https://ext4.wiki.kernel.org/index.php/Ext4_Disk_Layout#Hash_Tree_Directories
+// block 0 of a hash-indexed directory, after the dentries of . and .. (.. spans the rest of the block)
+struct dx_root_info {
+    __le32 reserved_zero;
+    __u8 hash_version;     // EXT4_HASH_*
+    __u8 info_length;      // 8
+    __u8 indirect_levels;  // levels of dx_node below the root
+    __u8 unused_flags;
+};
+
+// replaces the hash of the first dx_entry of the root or a node
+struct dx_countlimit {
+    __le16 limit;  // max dx_entry in the block
+    __le16 count;  // dx_entry in use, this one included
+};
+
+// hashes from this one up to the next entry are in block (logic block of the directory)
+struct dx_entry {
+    __le32 hash;
+    __le32 block;
+};
+
+// after the last possible dx_entry of a block with metadata_csum
+struct dx_tail {
+    __le32 dt_reserved;
+    __le32 dt_checksum;
+};
+
+#define EXT4_HASH_LEGACY            0
+#define EXT4_HASH_HALF_MD4          1
+#define EXT4_HASH_TEA               2
+#define EXT4_HASH_LEGACY_UNSIGNED   3
+#define EXT4_HASH_HALF_MD4_UNSIGNED 4
+#define EXT4_HASH_TEA_UNSIGNED      5
+#define EXT4_HTREE_EOF_32BIT        0x7fffffff
+#define EXT4_HTREE_LEVEL            2  // levels of index, root included, without the largedir feature
+
 #endif
@@ -72,6 +72,7 @@ struct ext4_extent_header {
 #define EXT4_EXT_MAGIC         0xF30A  // extent header magic number
 #define EXT4_EXT_LEAF_EH_MAX   4
 #define EXT4_EXT_EH_GENERATION 0
+#define EXT4_EXT_INIT_MAX_LEN  32768  // longest initialized extent
 #define EXT4_MAX_EXTENT_DEPTH  5
 #define EXT4_EXT_EH_MAX                                                                   \
     ((BLOCK_SIZE - sizeof(struct ext4_extent_header) - sizeof(struct ext4_extent_tail)) / \
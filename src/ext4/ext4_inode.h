@@ -136,9 +136,9 @@ struct ext4_inode {
 
 #define EXT4_INODE_GET_BLOCKS(inode) \
     (((uint64_t)(inode)->osd2.linux2.l_i_blocks_high << 32) | (uint64_t)(inode)->i_blocks_lo)
-#define EXT4_INODE_SET_BLOCKS(inode, blocks)  \
-    ((inode)->i_blocks_lo = blocks & MASK_32, \
-     (inode)->osd2.linux2.l_i_blocks_high = (uint32_t)(((uint64_t)blocks) >> 32))
+#define EXT4_INODE_SET_BLOCKS(inode, blocks)    \
+    ((inode)->i_blocks_lo = (blocks) & MASK_32, \
+     (inode)->osd2.linux2.l_i_blocks_high = (uint32_t)(((uint64_t)(blocks)) >> 32))
 
 #define EXT4_INODE_PBLOCK_NUM 4  // default number of pblocks per inode
 
@@ -217,3 +217,10 @@ struct ext4_super_block {
 #define EXT4_FEATURE_INCOMPAT_INLINE_DATA     0x8000 /* data in inode */
 #define EXT4_FEATURE_INCOMPAT_ENCRYPT         0x10000
 #define EXT4_FEATURE_INCOMPAT_CASEFOLD        0x20000
+
+/*
+ * Misc. filesystem flags (s_flags)
+ */
+#define EXT4_FLAGS_SIGNED_HASH   0x0001 /* Signed dirhash in use */
+#define EXT4_FLAGS_UNSIGNED_HASH 0x0002 /* Unsigned dirhash in use */
+#define EXT4_FLAGS_TEST_FILESYS  0x0004 /* to test development code */
@@ -9,8 +9,11 @@
 
 #include "extents.h"
 
+#include <errno.h>
 #include <stdlib.h>
+#include <string.h>
 
+#include "arena.h"
 #include "disk.h"
 #include "ext4/ext4.h"
 #include "ext4/ext4_extents.h"
@@ -18,6 +21,10 @@
 
 extern struct ext4_super_block sb;
 
+static uint64_t extent_map_bytes = 0;  // memory of all the extent maps
+
+#define EXTENT_MAP_SIZE(__cap) (sizeof(struct extent_map) + (__cap) * sizeof(struct extent_status))
+
 /* Calculates the physical block from a given logical block and extent */
 static uint64_t extent_get_block_from_ees(struct ext4_extent *ee, uint32_t n_ee, uint32_t lblock,
                                           uint32_t *extent_len) {
@@ -37,7 +44,8 @@ static uint64_t extent_get_block_from_ees(struct ext4_extent *ee, uint32_t n_ee,
             block_ext_index = i;
             block_ext_offset = lblock - ee[i].ee_block;
             if (extent_len) {
-                *extent_len = ee[i].ee_len;
+                // blocks left in this extent, starting from lblock
+                *extent_len = ee[i].ee_len - block_ext_offset;
             }
             break;
         }
@@ -55,23 +63,26 @@ static uint64_t extent_get_block_from_ees(struct ext4_extent *ee, uint32_t n_ee,
 
 /* Fetches a block that stores extent info and returns an array of extents
  * _with_ its header. */
-static void *extent_get_extents_in_block(uint32_t pblock) {
-    // first read the extent header
-    void *exts = malloc(sizeof(struct ext4_extent_header));
-    disk_read(BLOCKS2BYTES(pblock), sizeof(struct ext4_extent_header), exts);
+static void *extent_get_extents_in_block(uint64_t pblock) {
+    // the header and the extents fill at most one block, read it at once into an arena buffer
+    void *exts = arena_alloc(BLOCK_SIZE);
+    disk_read_block(pblock, exts);
     ASSERT(((struct ext4_extent_header *)exts)->eh_magic == EXT4_EXT_MAGIC);
     ASSERT(((struct ext4_extent_header *)exts)->eh_max <= EXT4_EXT_EH_MAX);
 
-    // resize exts to hold all the extents
-    uint32_t extents_len = ((struct ext4_extent_header *)exts)->eh_entries * sizeof(struct ext4_extent);
-    exts = realloc(exts, sizeof(struct ext4_extent_header) + extents_len);
+    return exts;
+}
 
-    // read the extents
-    disk_read(BLOCKS2BYTES(pblock) + sizeof(struct ext4_extent_header),
-              extents_len,
-              exts + sizeof(struct ext4_extent_header));
+// use the index block in the mapped image directly if possible
+static void *extent_node_get(uint64_t pblock) {
+    void *node = disk_map_block(pblock);
+    return node ? node : extent_get_extents_in_block(pblock);
+}
 
-    return exts;
+static void extent_node_put(void *node) {
+    if (!disk_is_mapped(node)) {
+        arena_free(node);
+    }
 }
 
 /* Returns the physical block number */
@@ -81,7 +92,8 @@ uint64_t extent_get_pblock(void *extents, uint32_t lblock, uint32_t *extent_len)
     uint64_t ret;
 
     ASSERT(eh->eh_magic == EXT4_EXT_MAGIC);
-    ASSERT(eh->eh_max <= EXT4_EXT_LEAF_EH_MAX);
+    // the root in i_block has EXT4_EXT_LEAF_EH_MAX entries at most, nodes in blocks up to EXT4_EXT_EH_MAX
+    ASSERT(eh->eh_max <= EXT4_EXT_EH_MAX);
     DEBUG("reading inode extent, depth = %d", eh->eh_depth);
 
     if (eh->eh_depth == 0) {
@@ -103,10 +115,357 @@ uint64_t extent_get_pblock(void *extents, uint32_t lblock, uint32_t *extent_len)
 
         ASSERT(recurse_ei != NULL);
 
-        void *leaf_extents = extent_get_extents_in_block(EXT4_EXT_LEAF_ADDR(recurse_ei));
+        void *leaf_extents = extent_node_get(EXT4_EXT_LEAF_ADDR(recurse_ei));
         ret = extent_get_pblock(leaf_extents, lblock, extent_len);
-        free(leaf_extents);
+        extent_node_put(leaf_extents);
+    }
+
+    return ret;
+}
+
+/*
+ * Visit the tree rooted at node in lblock order: leaf for every extent, index for every block of the tree
+ * below the root. A callback returning < 0 stops the walk and is returned.
+ */
+static int extent_walk(void *node, int (*leaf)(struct ext4_extent *, void *), int (*index)(uint64_t, void *),
+                       void *arg) {
+    struct ext4_extent_header *eh = node;
+    ASSERT(eh->eh_magic == EXT4_EXT_MAGIC);
+    ASSERT(eh->eh_max <= EXT4_EXT_EH_MAX);
+
+    int ret = 0;
+    if (eh->eh_depth == 0) {
+        struct ext4_extent *ee = (struct ext4_extent *)(eh + 1);
+        for (int i = 0; i < eh->eh_entries && ret >= 0; i++) {
+            ret = leaf(&ee[i], arg);
+        }
+        return ret;
     }
 
+    struct ext4_extent_idx *ei = (struct ext4_extent_idx *)(eh + 1);
+    for (int i = 0; i < eh->eh_entries && ret >= 0; i++) {
+        uint64_t pblock = EXT4_EXT_LEAF_ADDR(&ei[i]);
+        if (index && (ret = index(pblock, arg)) < 0) {
+            break;
+        }
+        void *child = extent_node_get(pblock);
+        ASSERT(((struct ext4_extent_header *)child)->eh_depth == eh->eh_depth - 1);
+        ret = extent_walk(child, leaf, index, arg);
+        extent_node_put(child);
+    }
     return ret;
 }
+
+static int extent_map_add(struct ext4_extent *ee, void *arg) {
+    struct extent_map **map = arg;
+    if ((*map)->count == (*map)->cap) {
+        uint32_t cap = (*map)->cap * 2;
+        struct extent_map *bigger = realloc(*map, EXTENT_MAP_SIZE(cap));
+        if (bigger == NULL) {
+            return -ENOMEM;
+        }
+        bigger->cap = cap;
+        *map = bigger;
+    }
+    struct extent_status *es = &(*map)->es[(*map)->count++];
+    es->lblock = ee->ee_block;
+    es->len = ee->ee_len;
+    es->pblock = EXT4_EXT_GET_PADDR(*ee);
+    return 0;
+}
+
+struct extent_map *extent_map_get(struct extent_map **map, void *inode_extents) {
+    struct extent_map *m = __atomic_load_n(map, __ATOMIC_ACQUIRE);
+    if (m) {
+        return m;
+    }
+
+    uint32_t cap = EXT4_EXT_EH_MAX;
+    m = malloc(EXTENT_MAP_SIZE(cap));
+    if (m == NULL) {
+        return NULL;
+    }
+    m->count = 0;
+    m->cap = cap;
+    if (extent_walk(inode_extents, extent_map_add, NULL, &m) < 0) {
+        WARNING("fail to build the extent map, walk the extent tree instead");
+        free(m);
+        return NULL;
+    }
+    DEBUG("extent map built, %u extents", m->count);
+
+    // another thread may have built it meanwhile, keep the first one
+    struct extent_map *expected = NULL;
+    if (!__atomic_compare_exchange_n(map, &expected, m, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        free(m);
+        return expected;
+    }
+    __atomic_add_fetch(&extent_map_bytes, EXTENT_MAP_SIZE(m->cap), __ATOMIC_RELAXED);
+    return m;
+}
+
+uint64_t extent_map_get_pblock(struct extent_map *map, uint32_t lblock, uint32_t *extent_len) {
+    // find the last extent starting at or before lblock
+    uint32_t lo = 0, hi = map->count;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (map->es[mid].lblock <= lblock) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if (lo == 0 || lblock - map->es[lo - 1].lblock >= map->es[lo - 1].len) {
+        DEBUG("extent map doesn't contain lblock %u", lblock);
+        return 0;
+    }
+    struct extent_status *es = &map->es[lo - 1];
+    if (extent_len) {
+        // blocks left in this extent, starting from lblock
+        *extent_len = es->len - (lblock - es->lblock);
+    }
+    return es->pblock + (lblock - es->lblock);
+}
+
+void extent_map_drop(struct extent_map **map) {
+    struct extent_map *m = __atomic_exchange_n(map, NULL, __ATOMIC_ACQ_REL);
+    if (m) {
+        __atomic_sub_fetch(&extent_map_bytes, EXTENT_MAP_SIZE(m->cap), __ATOMIC_RELAXED);
+        free(m);
+    }
+}
+
+uint64_t extent_map_mem() {
+    return __atomic_load_n(&extent_map_bytes, __ATOMIC_RELAXED);
+}
+
+static int extent_collect_leaf(struct ext4_extent *ee, void *arg) {
+    struct pblock_arr *arr = arg;
+    arr->arr[arr->len].pblock = EXT4_EXT_GET_PADDR(*ee);
+    arr->arr[arr->len].len = ee->ee_len;
+    arr->len++;
+    return 0;
+}
+
+static int extent_collect_index(uint64_t pblock, void *arg) {
+    struct pblock_arr *arr = arg;
+    arr->arr[arr->len].pblock = pblock;
+    arr->arr[arr->len].len = 1;
+    arr->len++;
+    return 0;
+}
+
+static int extent_count_leaf(struct ext4_extent *ee, void *arg) {
+    (void)ee;
+    (*(uint32_t *)arg)++;
+    return 0;
+}
+
+static int extent_count_index(uint64_t pblock, void *arg) {
+    (void)pblock;
+    (*(uint32_t *)arg)++;
+    return 0;
+}
+
+int extent_get_all_pblocks(void *inode_extents, struct pblock_arr *pblock_arr) {
+    // count first, then fill an array of the right size
+    uint32_t count = 0;
+    extent_walk(inode_extents, extent_count_leaf, extent_count_index, &count);
+    if (count > UINT16_MAX) {
+        ERR("too many extents to free: %u", count);
+        return -EFBIG;
+    }
+    pblock_arr->len = 0;
+    pblock_arr->arr = malloc(count * sizeof(struct pblock_range));
+    if (pblock_arr->arr == NULL) {
+        return -ENOMEM;
+    }
+    extent_walk(inode_extents, extent_collect_leaf, extent_collect_index, pblock_arr);
+    return 0;
+}
+
+static int extent_end_leaf(struct ext4_extent *ee, void *arg) {
+    uint32_t *end = arg;
+    if (ee->ee_block + ee->ee_len > *end) {
+        *end = ee->ee_block + ee->ee_len;
+    }
+    return 0;
+}
+
+uint32_t extent_end(void *inode_extents) {
+    uint32_t end = 0;
+    extent_walk(inode_extents, extent_end_leaf, NULL, &end);
+    return end;
+}
+
+// append to the extents of a leaf, 0 if it is full
+static int extent_leaf_append(struct ext4_extent_header *eh, uint32_t lblock, uint64_t pblock, uint32_t len) {
+    struct ext4_extent *ee = (struct ext4_extent *)(eh + 1);
+    if (eh->eh_entries) {
+        struct ext4_extent *last = &ee[eh->eh_entries - 1];
+        ASSERT(last->ee_block + last->ee_len <= lblock);
+        if (last->ee_block + last->ee_len == lblock && EXT4_EXT_GET_PADDR(*last) + last->ee_len == pblock &&
+            last->ee_len + len <= EXT4_EXT_INIT_MAX_LEN) {
+            last->ee_len += len;
+            return 1;
+        }
+    }
+    if (eh->eh_entries == eh->eh_max) {
+        return 0;
+    }
+    struct ext4_extent *new_ee = &ee[eh->eh_entries++];
+    new_ee->ee_block = lblock;
+    new_ee->ee_len = len;
+    EXT4_EXT_SET_PADDR(new_ee, pblock);
+    return 1;
+}
+
+// a new empty leaf in block pblock, in an arena buffer or the mapped image
+static void *extent_leaf_new(uint64_t pblock) {
+    void *node = disk_map_block(pblock);
+    if (node == NULL) {
+        node = arena_alloc(BLOCK_SIZE);
+    }
+    memset(node, 0, BLOCK_SIZE);
+    struct ext4_extent_header *eh = node;
+    eh->eh_magic = EXT4_EXT_MAGIC;
+    eh->eh_max = EXT4_EXT_EH_MAX;
+    eh->eh_depth = 0;
+    eh->eh_generation = EXT4_EXT_EH_GENERATION;
+    return node;
+}
+
+static void extent_node_write(uint64_t pblock, void *node) {
+    disk_write_block(pblock, node);
+    extent_node_put(node);
+}
+
+int extent_append(void *inode_extents, uint32_t lblock, uint64_t pblock, uint32_t len,
+                  uint64_t (*leaf_alloc)(void *), void *arg) {
+    struct ext4_extent_header *eh = inode_extents;
+    ASSERT(eh->eh_magic == EXT4_EXT_MAGIC);
+    if (eh->eh_depth == 0) {
+        if (extent_leaf_append(eh, lblock, pblock, len)) {
+            return 0;
+        }
+        // the inode is full, its extents move down to a leaf and the inode becomes the index
+        uint64_t leaf_pblock = leaf_alloc(arg);
+        if (leaf_pblock == 0) {
+            return -ENOSPC;
+        }
+        void *leaf = extent_leaf_new(leaf_pblock);
+        struct ext4_extent_header *leaf_eh = leaf;
+        memcpy(leaf_eh + 1, eh + 1, eh->eh_entries * sizeof(struct ext4_extent));
+        leaf_eh->eh_entries = eh->eh_entries;
+        extent_leaf_append(leaf_eh, lblock, pblock, len);
+        extent_node_write(leaf_pblock, leaf);
+
+        struct ext4_extent_idx *ei = (struct ext4_extent_idx *)(eh + 1);
+        memset(ei, 0, EXT4_EXT_LEAF_EH_MAX * sizeof(struct ext4_extent));
+        ei->ei_block = 0;
+        EXT4_EXT_LEAF_SET_ADDR(ei, leaf_pblock);
+        eh->eh_entries = 1;
+        eh->eh_depth = 1;
+        INFO("extent tree grows to depth 1, leaf at %lu", leaf_pblock);
+        return 0;
+    }
+    if (eh->eh_depth > 1) {
+        WARNING("can not append to an extent tree of depth %u", eh->eh_depth);
+        return -ENOSPC;
+    }
+
+    struct ext4_extent_idx *ei = (struct ext4_extent_idx *)(eh + 1);
+    uint64_t last_pblock = EXT4_EXT_LEAF_ADDR(&ei[eh->eh_entries - 1]);
+    void *last = extent_node_get(last_pblock);
+    if (extent_leaf_append(last, lblock, pblock, len)) {
+        extent_node_write(last_pblock, last);
+        return 0;
+    }
+    extent_node_put(last);
+    if (eh->eh_entries == eh->eh_max) {
+        WARNING("extent tree is full, %u leaves", eh->eh_entries);
+        return -ENOSPC;
+    }
+    uint64_t leaf_pblock = leaf_alloc(arg);
+    if (leaf_pblock == 0) {
+        return -ENOSPC;
+    }
+    void *leaf = extent_leaf_new(leaf_pblock);
+    extent_leaf_append(leaf, lblock, pblock, len);
+    extent_node_write(leaf_pblock, leaf);
+    struct ext4_extent_idx *new_ei = &ei[eh->eh_entries++];
+    memset(new_ei, 0, sizeof(struct ext4_extent_idx));
+    new_ei->ei_block = lblock;
+    EXT4_EXT_LEAF_SET_ADDR(new_ei, leaf_pblock);
+    INFO("extent tree gets leaf %u at %lu", eh->eh_entries - 1, leaf_pblock);
+    return 0;
+}
+
+static void extent_freed_add(struct pblock_arr *freed, uint64_t pblock, uint32_t len) {
+    freed->arr[freed->len].pblock = pblock;
+    freed->arr[freed->len].len = len;
+    freed->len++;
+}
+
+// unmap the extents of a leaf from lblock on, 0 if the leaf still maps a block before lblock
+static int extent_leaf_truncate(struct ext4_extent_header *eh, uint32_t lblock, struct pblock_arr *freed,
+                                uint32_t *blocks) {
+    struct ext4_extent *ee = (struct ext4_extent *)(eh + 1);
+    while (eh->eh_entries) {
+        struct ext4_extent *last = &ee[eh->eh_entries - 1];
+        if (last->ee_block >= lblock) {
+            extent_freed_add(freed, EXT4_EXT_GET_PADDR(*last), last->ee_len);
+            *blocks += last->ee_len;
+            eh->eh_entries--;
+            continue;
+        }
+        uint32_t keep = lblock - last->ee_block;
+        uint64_t cut = EXT4_EXT_GET_PADDR(*last) + keep;
+        if (keep < last->ee_len && cut % EXT4_INODE_PBLOCK_NUM == 0) {
+            extent_freed_add(freed, cut, last->ee_len - keep);
+            *blocks += last->ee_len - keep;
+            last->ee_len = keep;
+        }
+        return 0;
+    }
+    return 1;
+}
+
+int extent_truncate(void *inode_extents, uint32_t lblock, struct pblock_arr *freed) {
+    struct ext4_extent_header *eh = inode_extents;
+    ASSERT(eh->eh_magic == EXT4_EXT_MAGIC);
+    ASSERT(lblock > 0);
+    freed->len = 0;
+    freed->arr = NULL;
+    if (eh->eh_depth > 1) {
+        WARNING("can not truncate an extent tree of depth %u", eh->eh_depth);
+        return 0;
+    }
+    uint32_t count = 0;
+    extent_walk(inode_extents, extent_count_leaf, extent_count_index, &count);
+    if (count == 0 || (freed->arr = malloc(count * sizeof(struct pblock_range))) == NULL) {
+        return 0;
+    }
+
+    uint32_t blocks = 0;
+    if (eh->eh_depth == 0) {
+        extent_leaf_truncate(eh, lblock, freed, &blocks);
+        return blocks;
+    }
+    struct ext4_extent_idx *ei = (struct ext4_extent_idx *)(eh + 1);
+    while (eh->eh_entries) {
+        uint64_t leaf_pblock = EXT4_EXT_LEAF_ADDR(&ei[eh->eh_entries - 1]);
+        void *leaf = extent_node_get(leaf_pblock);
+        int empty = extent_leaf_truncate(leaf, lblock, freed, &blocks);
+        if (!empty || eh->eh_entries == 1) {
+            // the first leaf stays even if it is empty, lblock 0 is never unmapped
+            extent_node_write(leaf_pblock, leaf);
+            break;
+        }
+        extent_node_put(leaf);
+        extent_freed_add(freed, leaf_pblock, 1);
+        blocks += EXT4_INODE_PBLOCK_NUM;  // the chunk allocated with the leaf
+        eh->eh_entries--;
+    }
+    return blocks;
+}
@@ -1,8 +1,83 @@
 #ifndef EXTENTS_H
 #define EXTENTS_H
 
+#include "bitmap.h"
 #include "ext4/ext4_extents.h"
 
+// one extent of a leaf, lblock..lblock+len-1 are stored at pblock..pblock+len-1
+struct extent_status {
+    uint32_t lblock;
+    uint32_t len;
+    uint64_t pblock;
+};
+
+/*
+ * Every extent of a tree deeper than the inode, sorted by lblock. It is built by walking the tree once and
+ * kept with the cached inode, so a lookup is a binary search instead of reading the index blocks again.
+ */
+struct extent_map {
+    uint32_t count;
+    uint32_t cap;
+    struct extent_status es[];
+};
+
 uint64_t extent_get_pblock(void *inode_extents, uint32_t lblock, uint32_t *len);
 
+/**
+ * @brief get the extent map of a tree, build it on first use
+ *
+ * @param map where the map is kept, updated atomically so that concurrent readers build it at most once
+ * @param inode_extents i_block of the inode
+ * @return struct extent_map* NULL if it could not be built, walk the tree with extent_get_pblock then
+ */
+struct extent_map *extent_map_get(struct extent_map **map, void *inode_extents);
+
+/**
+ * @brief same as extent_get_pblock, with a map of extent_map_get
+ */
+uint64_t extent_map_get_pblock(struct extent_map *map, uint32_t lblock, uint32_t *len);
+
+/**
+ * @brief free the map when the extents change, the next lookup builds it again
+ */
+void extent_map_drop(struct extent_map **map);
+
+/**
+ * @brief memory used by all the extent maps
+ */
+uint64_t extent_map_mem();
+
+/**
+ * @brief collect the extents and the index blocks of a tree of any depth
+ *
+ * @param pblock_arr arr is malloc'd, to be freed by the caller
+ */
+int extent_get_all_pblocks(void *inode_extents, struct pblock_arr *pblock_arr);
+
+/**
+ * @brief the lblock after the last one mapped by a tree of any depth, 0 if it maps none
+ */
+uint32_t extent_end(void *inode_extents);
+
+/**
+ * @brief map lblock..lblock+len-1 to pblock..pblock+len-1 after the last extent of a tree, the last extent
+ * is extended if both are contiguous. The tree grows one level below the inode at most: when the 4 extents
+ * of the inode are full they move to a leaf block, and a full leaf gets a new leaf next to it.
+ *
+ * @param leaf_alloc called for the block of a new leaf, returns 0 if there is none
+ * @return int 0 on success, -ENOSPC if no leaf can be added
+ */
+int extent_append(void *inode_extents, uint32_t lblock, uint64_t pblock, uint32_t len,
+                  uint64_t (*leaf_alloc)(void *), void *arg);
+
+/**
+ * @brief unmap the blocks from lblock on, in a tree of depth 0 or 1. Blocks are freed by chunks of
+ * EXT4_INODE_PBLOCK_NUM, the truncation stops at an extent whose cut is not aligned on them
+ *
+ * @param lblock a multiple of EXT4_INODE_PBLOCK_NUM, above 0
+ * @param freed the unmapped extents and leaves, arr is malloc'd, to be freed by bitmap_pblock_free
+ * @return int blocks unmapped, leaves included
+ */
+int extent_truncate(void *inode_extents, uint32_t lblock, struct pblock_arr *freed);
+
 #endif
@@ -0,0 +1,783 @@
+#include "htree.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cache.h"
+#include "dentry.h"
+#include "disk.h"
+#include "ext4/ext4.h"
+#include "ext4/ext4_super.h"
+#include "inode.h"
+#include "logging.h"
+
+extern struct ext4_super_block sb;
+extern struct dcache *dcache;
+
+/*
+ * Hash tree directories as ext4 lays them out. Block 0 holds . and .., the dentry of .. spans the rest of
+ * the block and hides the root of the index in it: a dx_root_info then dx_entry sorted by hash, the first
+ * entry has a dx_countlimit in place of its hash. With two levels every root entry points to a node, a
+ * block with one empty dentry over the whole block followed by dx_entry too. The last level points to
+ * leaves, ordinary dentry blocks holding the names whose hash is between the entry and the next one. An
+ * entry hash with the lowest bit set continues the hash of the previous leaf, when a split had to put
+ * equal hashes on both sides.
+ *
+ * The index is hidden in dentries that a linear walk skips, so readdir and any ext2 reader still see every
+ * name. Leaves are never merged, as in ext4.
+ */
+
+#define HTREE_ROOT_ENTRIES   (2 * EXT4_DE_DOT_SIZE + sizeof(struct dx_root_info))
+#define HTREE_NODE_ENTRIES   EXT4_DE_BASE_SIZE
+#define HTREE_COUNTLIMIT(entries) ((struct dx_countlimit *)(entries))
+
+// a block of the index held while the tree is walked
+struct htree_block {
+    uint8_t *buf;
+    struct bcache_buf *bh;  // NULL if borrowed from the mapped image
+    int dirty;
+};
+
+struct htree_frame {
+    struct htree_block b;
+    struct dx_entry *entries;
+    struct dx_entry *at;  // entry whose range holds the hash
+};
+
+struct htree_path {
+    struct htree_frame frames[EXT4_HTREE_LEVEL];
+    int levels;      // frames in use, the last one points to leaves
+    int version;     // hash version, unsigned variants included
+    uint32_t hash;
+};
+
+// a live dentry of a leaf being split
+struct htree_map {
+    uint32_t hash;
+    uint16_t offset;
+    uint16_t rec_len;
+};
+
+static struct {
+    uint64_t lookup;
+    uint64_t continued;  // lookups that went on to the next leaf
+    uint64_t split;      // leaves split
+    uint64_t grow;       // index blocks added
+    uint64_t created;    // directories indexed
+    uint64_t fallback;   // lookups that scanned a directory with a broken index
+} htree_stat;
+
+/* hash functions, from lib/ext2fs/dirhash.c of e2fsprogs */
+
+#define HTREE_TEA_DELTA 0x9E3779B9
+
+static void htree_tea_transform(uint32_t buf[4], const uint32_t in[4]) {
+    uint32_t sum = 0;
+    uint32_t b0 = buf[0], b1 = buf[1];
+    uint32_t a = in[0], b = in[1], c = in[2], d = in[3];
+    for (int n = 16; n > 0; n--) {
+        sum += HTREE_TEA_DELTA;
+        b0 += ((b1 << 4) + a) ^ (b1 + sum) ^ ((b1 >> 5) + b);
+        b1 += ((b0 << 4) + c) ^ (b0 + sum) ^ ((b0 >> 5) + d);
+    }
+    buf[0] += b0;
+    buf[1] += b1;
+}
+
+// F, G and H are basic MD4 functions: selection, majority, parity
+#define HTREE_MD4_F(x, y, z) ((z) ^ ((x) & ((y) ^ (z))))
+#define HTREE_MD4_G(x, y, z) (((x) & (y)) + (((x) ^ (y)) & (z)))
+#define HTREE_MD4_H(x, y, z) ((x) ^ (y) ^ (z))
+#define HTREE_ROUND(f, a, b, c, d, x, s) ((a) += f(b, c, d) + (x), (a) = ((a) << (s)) | ((a) >> (32 - (s))))
+#define HTREE_MD4_K1         0
+#define HTREE_MD4_K2         013240474631U
+#define HTREE_MD4_K3         015666365641U
+
+static void htree_half_md4_transform(uint32_t buf[4], const uint32_t in[8]) {
+    uint32_t a = buf[0], b = buf[1], c = buf[2], d = buf[3];
+
+    HTREE_ROUND(HTREE_MD4_F, a, b, c, d, in[0] + HTREE_MD4_K1, 3);
+    HTREE_ROUND(HTREE_MD4_F, d, a, b, c, in[1] + HTREE_MD4_K1, 7);
+    HTREE_ROUND(HTREE_MD4_F, c, d, a, b, in[2] + HTREE_MD4_K1, 11);
+    HTREE_ROUND(HTREE_MD4_F, b, c, d, a, in[3] + HTREE_MD4_K1, 19);
+    HTREE_ROUND(HTREE_MD4_F, a, b, c, d, in[4] + HTREE_MD4_K1, 3);
+    HTREE_ROUND(HTREE_MD4_F, d, a, b, c, in[5] + HTREE_MD4_K1, 7);
+    HTREE_ROUND(HTREE_MD4_F, c, d, a, b, in[6] + HTREE_MD4_K1, 11);
+    HTREE_ROUND(HTREE_MD4_F, b, c, d, a, in[7] + HTREE_MD4_K1, 19);
+
+    HTREE_ROUND(HTREE_MD4_G, a, b, c, d, in[1] + HTREE_MD4_K2, 3);
+    HTREE_ROUND(HTREE_MD4_G, d, a, b, c, in[3] + HTREE_MD4_K2, 5);
+    HTREE_ROUND(HTREE_MD4_G, c, d, a, b, in[5] + HTREE_MD4_K2, 9);
+    HTREE_ROUND(HTREE_MD4_G, b, c, d, a, in[7] + HTREE_MD4_K2, 13);
+    HTREE_ROUND(HTREE_MD4_G, a, b, c, d, in[0] + HTREE_MD4_K2, 3);
+    HTREE_ROUND(HTREE_MD4_G, d, a, b, c, in[2] + HTREE_MD4_K2, 5);
+    HTREE_ROUND(HTREE_MD4_G, c, d, a, b, in[4] + HTREE_MD4_K2, 9);
+    HTREE_ROUND(HTREE_MD4_G, b, c, d, a, in[6] + HTREE_MD4_K2, 13);
+
+    HTREE_ROUND(HTREE_MD4_H, a, b, c, d, in[3] + HTREE_MD4_K3, 3);
+    HTREE_ROUND(HTREE_MD4_H, d, a, b, c, in[7] + HTREE_MD4_K3, 9);
+    HTREE_ROUND(HTREE_MD4_H, c, d, a, b, in[2] + HTREE_MD4_K3, 11);
+    HTREE_ROUND(HTREE_MD4_H, b, c, d, a, in[6] + HTREE_MD4_K3, 15);
+    HTREE_ROUND(HTREE_MD4_H, a, b, c, d, in[1] + HTREE_MD4_K3, 3);
+    HTREE_ROUND(HTREE_MD4_H, d, a, b, c, in[5] + HTREE_MD4_K3, 9);
+    HTREE_ROUND(HTREE_MD4_H, c, d, a, b, in[0] + HTREE_MD4_K3, 11);
+    HTREE_ROUND(HTREE_MD4_H, b, c, d, a, in[4] + HTREE_MD4_K3, 15);
+
+    buf[0] += a;
+    buf[1] += b;
+    buf[2] += c;
+    buf[3] += d;
+}
+
+static uint32_t htree_legacy_hash(const char *name, uint32_t len, int unsigned_char) {
+    uint32_t hash, hash0 = 0x12a3fe2d, hash1 = 0x37abe8f9;
+    for (uint32_t i = 0; i < len; i++) {
+        int c = unsigned_char ? (int)(unsigned char)name[i] : (int)(signed char)name[i];
+        hash = hash1 + (hash0 ^ (uint32_t)(c * 7152373));
+        if (hash & 0x80000000) {
+            hash -= 0x7fffffff;
+        }
+        hash1 = hash0;
+        hash0 = hash;
+    }
+    return hash0 << 1;
+}
+
+// pack up to num words of the name, padded with its length
+static void htree_str2hashbuf(const char *msg, uint32_t len, uint32_t *buf, int num, int unsigned_char) {
+    uint32_t pad = len | (len << 8);
+    pad |= pad << 16;
+    uint32_t val = pad;
+    if (len > (uint32_t)num * 4) {
+        len = num * 4;
+    }
+    for (uint32_t i = 0; i < len; i++) {
+        int c = unsigned_char ? (int)(unsigned char)msg[i] : (int)(signed char)msg[i];
+        val = c + (val << 8);
+        if (i % 4 == 3) {
+            *buf++ = val;
+            val = pad;
+            num--;
+        }
+    }
+    if (--num >= 0) {
+        *buf++ = val;
+    }
+    while (--num >= 0) {
+        *buf++ = pad;
+    }
+}
+
+uint32_t htree_hash(const char *name, uint32_t name_len, int version, const uint32_t *seed) {
+    uint32_t buf[4] = {0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476};
+    uint32_t in[8];
+    uint32_t hash = 0;
+    int unsigned_char = 0;
+    if (seed && (seed[0] | seed[1] | seed[2] | seed[3])) {
+        memcpy(buf, seed, sizeof(buf));
+    }
+
+    switch (version) {
+        case EXT4_HASH_LEGACY_UNSIGNED:
+            unsigned_char = 1;
+            // fall through
+        case EXT4_HASH_LEGACY:
+            hash = htree_legacy_hash(name, name_len, unsigned_char);
+            break;
+        case EXT4_HASH_HALF_MD4_UNSIGNED:
+            unsigned_char = 1;
+            // fall through
+        case EXT4_HASH_HALF_MD4:
+            for (int32_t len = name_len; len > 0; len -= 32, name += 32) {
+                htree_str2hashbuf(name, len, in, 8, unsigned_char);
+                htree_half_md4_transform(buf, in);
+            }
+            hash = buf[1];
+            break;
+        case EXT4_HASH_TEA_UNSIGNED:
+            unsigned_char = 1;
+            // fall through
+        case EXT4_HASH_TEA:
+            for (int32_t len = name_len; len > 0; len -= 16, name += 16) {
+                htree_str2hashbuf(name, len, in, 4, unsigned_char);
+                htree_tea_transform(buf, in);
+            }
+            hash = buf[0];
+            break;
+        default:
+            ASSERT(0);
+    }
+    hash &= ~1;
+    if (hash == (EXT4_HTREE_EOF_32BIT << 1)) {
+        hash = (EXT4_HTREE_EOF_32BIT - 1) << 1;
+    }
+    return hash;
+}
+
+int htree_enabled() {
+    return (sb.s_feature_compat & EXT4_FEATURE_COMPAT_DIR_INDEX) != 0;
+}
+
+// hash version of the root with the signedness of chars of the filesystem
+static int htree_version(uint8_t root_version) {
+    if (root_version > EXT4_HASH_TEA) {
+        return root_version;
+    }
+    if (sb.s_flags & EXT4_FLAGS_UNSIGNED_HASH) {
+        return root_version + 3;
+    }
+    if (!(sb.s_flags & EXT4_FLAGS_SIGNED_HASH) && (char)-1 > 0) {
+        // neither flag is set, the chars of this platform decide as in the kernel
+        return root_version + 3;
+    }
+    return root_version;
+}
+
+// dx_entry that fit in the root or a node
+static uint16_t htree_limit(int root) {
+    uint32_t space = BLOCK_SIZE - (root ? HTREE_ROOT_ENTRIES : HTREE_NODE_ENTRIES);
+    if (sb.s_feature_ro_compat & EXT4_FEATURE_RO_COMPAT_METADATA_CSUM) {
+        space -= sizeof(struct dx_tail);
+    }
+    return space / sizeof(struct dx_entry);
+}
+
+static int htree_block_get(uint64_t pblock, int read, struct htree_block *b) {
+    b->dirty = 0;
+    b->bh = NULL;
+    // borrow the block from the mapped image if possible, no copy needed
+    b->buf = disk_map_block(pblock);
+    if (b->buf == NULL) {
+        b->bh = bcache_get(pblock, read);
+        b->buf = b->bh->data;
+    }
+    return 0;
+}
+
+static int htree_lblock_get(struct ext4_inode *inode, uint32_t lblock, struct htree_block *b) {
+    uint64_t pblock;
+    if ((uint64_t)lblock * BLOCK_SIZE >= EXT4_INODE_GET_SIZE(inode) ||
+        (pblock = inode_get_data_pblock(inode, lblock, NULL)) == 0) {
+        WARNING("hash index points to block %u out of the directory", lblock);
+        b->buf = NULL;
+        b->bh = NULL;
+        return -EINVAL;
+    }
+    return htree_block_get(pblock, 1, b);
+}
+
+static void htree_block_put(struct htree_block *b) {
+    if (b->bh) {
+        if (b->dirty) {
+            bcache_mark_dirty(b->bh);
+        }
+        bcache_put(b->bh);
+    }
+    b->bh = NULL;
+    b->buf = NULL;
+}
+
+static void htree_path_put(struct htree_path *path) {
+    for (int i = 0; i < path->levels; i++) {
+        htree_block_put(&path->frames[i].b);
+    }
+    path->levels = 0;
+}
+
+// point the frame at the last entry whose hash is not above the hash of the path
+static int htree_frame_search(struct htree_frame *frame, int root, uint32_t hash) {
+    struct dx_countlimit *cl = HTREE_COUNTLIMIT(frame->entries);
+    if (cl->count == 0 || cl->count > cl->limit || cl->limit != htree_limit(root)) {
+        WARNING("bad hash index block, count %u limit %u", cl->count, cl->limit);
+        return -EINVAL;
+    }
+    // the first entry has no hash and takes the lowest ones
+    uint32_t lo = 1, hi = cl->count;
+    while (lo < hi) {
+        uint32_t mid = (lo + hi) / 2;
+        if (frame->entries[mid].hash <= hash) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    frame->at = &frame->entries[lo - 1];
+    return 0;
+}
+
+// walk the index down to the leaf of the name, the blocks stay pinned until htree_path_put
+static int htree_probe(struct ext4_inode *inode, const char *name, uint32_t name_len, struct htree_path *path) {
+    path->levels = 1;
+    struct htree_frame *frame = &path->frames[0];
+    if (htree_lblock_get(inode, 0, &frame->b) < 0) {
+        path->levels = 0;
+        return -EINVAL;
+    }
+    struct dx_root_info *info = (struct dx_root_info *)(frame->b.buf + 2 * EXT4_DE_DOT_SIZE);
+    if (info->reserved_zero || info->info_length != sizeof(struct dx_root_info) ||
+        info->indirect_levels >= EXT4_HTREE_LEVEL || info->hash_version > EXT4_HASH_TEA) {
+        WARNING("unsupported hash index, version %u levels %u", info->hash_version, info->indirect_levels);
+        htree_path_put(path);
+        return -EINVAL;
+    }
+    path->version = htree_version(info->hash_version);
+    path->hash = htree_hash(name, name_len, path->version, sb.s_hash_seed);
+    frame->entries = (struct dx_entry *)(frame->b.buf + HTREE_ROOT_ENTRIES);
+
+    for (int level = 0;; level++) {
+        frame = &path->frames[level];
+        if (htree_frame_search(frame, level == 0, path->hash) < 0) {
+            htree_path_put(path);
+            return -EINVAL;
+        }
+        if (level == info->indirect_levels) {
+            return 0;
+        }
+        struct htree_frame *child = &path->frames[level + 1];
+        path->levels++;
+        if (htree_lblock_get(inode, frame->at->block, &child->b) < 0) {
+            htree_path_put(path);
+            return -EINVAL;
+        }
+        child->entries = (struct dx_entry *)(child->b.buf + HTREE_NODE_ENTRIES);
+    }
+}
+
+// move the path to the next leaf if it continues the hash of the path, return 0 if there is none
+static int htree_next_leaf(struct ext4_inode *inode, struct htree_path *path) {
+    int level = path->levels - 1;
+    struct htree_frame *frame = &path->frames[level];
+    while (frame->at + 1 >= frame->entries + HTREE_COUNTLIMIT(frame->entries)->count) {
+        if (level == 0) {
+            return 0;
+        }
+        frame = &path->frames[--level];
+    }
+    frame->at++;
+    if ((frame->at->hash & ~1) != path->hash) {
+        return 0;
+    }
+    for (level++; level < path->levels; level++) {
+        frame = &path->frames[level];
+        htree_block_put(&frame->b);
+        if (htree_lblock_get(inode, path->frames[level - 1].at->block, &frame->b) < 0) {
+            return 0;
+        }
+        frame->entries = (struct dx_entry *)(frame->b.buf + HTREE_NODE_ENTRIES);
+        frame->at = frame->entries;
+    }
+    return 1;
+}
+
+int htree_find(struct ext4_inode *inode, uint32_t inode_idx, const char *name, uint32_t name_len,
+               struct ext4_dir_entry_2 **de_before, struct ext4_dir_entry_2 **de) {
+    struct htree_path path;
+    if (htree_probe(inode, name, name_len, &path) < 0) {
+        htree_stat.fallback++;
+        return -EINVAL;
+    }
+    htree_stat.lookup++;
+    int err = -ENOENT;
+    dcache_init(inode, inode_idx);
+    for (;;) {
+        uint32_t leaf = path.frames[path.levels - 1].at->block;
+        if (leaf != dcache->lblock) {
+            dcache_load_lblock(inode, leaf);
+        }
+        if ((*de = dentry_block_find(dcache->buf, name, name_len, de_before))) {
+            DEBUG("find dentry %.*s in leaf %u, hash %#x", name_len, name, leaf, path.hash);
+            err = 0;
+            break;
+        }
+        if (!htree_next_leaf(inode, &path)) {
+            break;
+        }
+        htree_stat.continued++;
+    }
+    htree_path_put(&path);
+    return err;
+}
+
+// insert an entry after the one the frame is at, there must be room for it
+static void htree_insert_entry(struct htree_frame *frame, uint32_t hash, uint32_t block) {
+    struct dx_countlimit *cl = HTREE_COUNTLIMIT(frame->entries);
+    struct dx_entry *new = frame->at + 1;
+    memmove(new + 1, new, (frame->entries + cl->count - new) * sizeof(struct dx_entry));
+    new->hash = hash;
+    new->block = block;
+    cl->count++;
+    frame->b.dirty = 1;
+}
+
+// start an empty node in buf, it holds count entries
+static struct dx_entry *htree_node_init(uint8_t *buf, uint16_t count) {
+    memset(buf, 0, BLOCK_SIZE);
+    struct ext4_dir_entry_2 *fake = (struct ext4_dir_entry_2 *)buf;
+    fake->rec_len = BLOCK_SIZE;
+    struct dx_entry *entries = (struct dx_entry *)(buf + HTREE_NODE_ENTRIES);
+    HTREE_COUNTLIMIT(entries)->limit = htree_limit(0);
+    HTREE_COUNTLIMIT(entries)->count = count;
+    return entries;
+}
+
+// give the last level of the index room for one more entry
+static int htree_grow_index(struct ext4_inode *inode, uint32_t inode_idx, struct htree_path *path) {
+    struct htree_frame *frame = &path->frames[path->levels - 1];
+    struct dx_countlimit *cl = HTREE_COUNTLIMIT(frame->entries);
+    struct dx_countlimit *root_cl = HTREE_COUNTLIMIT(path->frames[0].entries);
+    if (path->levels == 2 && root_cl->count == root_cl->limit) {
+        WARNING("hash index of directory %u is full", inode_idx);
+        return -ENOSPC;
+    }
+
+    uint32_t lblock;
+    uint64_t pblock;
+    int err;
+    if ((err = dentry_block_append(inode, inode_idx, &lblock, &pblock)) < 0) {
+        return err;
+    }
+    struct htree_block nb;
+    htree_block_get(pblock, 0, &nb);
+    if (path->levels == 1) {
+        // the root is full, its entries move down to a new node
+        struct dx_entry *entries = htree_node_init(nb.buf, cl->count);
+        memcpy(&entries[1], &frame->entries[1], (cl->count - 1) * sizeof(struct dx_entry));
+        entries[0].block = frame->entries[0].block;
+        cl->count = 1;
+        frame->entries[0].block = lblock;
+        ((struct dx_root_info *)(frame->b.buf + 2 * EXT4_DE_DOT_SIZE))->indirect_levels = 1;
+        frame->b.dirty = 1;
+        INFO("hash index of directory %u has 2 levels", inode_idx);
+    } else {
+        // the node is full, its upper half moves to a new node next to it
+        uint16_t half = cl->count / 2;
+        uint32_t hash = frame->entries[half].hash;
+        struct dx_entry *entries = htree_node_init(nb.buf, cl->count - half);
+        memcpy(&entries[1], &frame->entries[half + 1], (cl->count - half - 1) * sizeof(struct dx_entry));
+        entries[0].block = frame->entries[half].block;
+        cl->count = half;
+        frame->b.dirty = 1;
+        htree_insert_entry(&path->frames[0], hash, lblock);
+        DEBUG("split hash index node of directory %u at %#x", inode_idx, hash);
+    }
+    nb.dirty = 1;
+    htree_block_put(&nb);
+    htree_stat.grow++;
+    return 0;
+}
+
+static int htree_map_cmp(const void *a, const void *b) {
+    uint32_t ha = ((const struct htree_map *)a)->hash, hb = ((const struct htree_map *)b)->hash;
+    return ha < hb ? -1 : ha > hb;
+}
+
+// refill a leaf with the dentries map[from, to) of src, packed
+static void htree_leaf_fill(uint8_t *buf, const uint8_t *src, const struct htree_map *map, int from, int to) {
+    dentry_block_init(buf);
+    uint32_t offset = 0;
+    struct ext4_dir_entry_2 *de = NULL;
+    for (int i = from; i < to; i++) {
+        de = (struct ext4_dir_entry_2 *)(buf + offset);
+        memcpy(de, src + map[i].offset, map[i].rec_len);
+        de->rec_len = map[i].rec_len;
+        offset += map[i].rec_len;
+    }
+    if (de) {
+        de->rec_len += BLOCK_SIZE - EXT4_DE_TAIL_SIZE - offset;
+    }
+}
+
+// split the full leaf in dcache by hash, half of its bytes move to a new leaf, then add the dentry
+static int htree_split_leaf(struct ext4_inode *inode, uint32_t inode_idx, struct htree_path *path,
+                            uint32_t new_inode_idx, const char *name, int file_type) {
+    uint32_t lblock;
+    uint64_t pblock;
+    int err;
+    if ((err = dentry_block_append(inode, inode_idx, &lblock, &pblock)) < 0) {
+        return err;
+    }
+    uint8_t *copy = malloc(BLOCK_SIZE);
+    struct htree_map *map = malloc(BLOCK_SIZE / EXT4_DE_DOT_SIZE * sizeof(struct htree_map));
+    if (copy == NULL || map == NULL) {
+        free(copy);
+        free(map);
+        return -ENOMEM;
+    }
+    memcpy(copy, dcache->buf, BLOCK_SIZE);
+
+    int n = 0;
+    uint32_t size = 0;
+    for (uint32_t offset = 0; offset + EXT4_DE_BASE_SIZE <= BLOCK_SIZE;) {
+        struct ext4_dir_entry_2 *de = (struct ext4_dir_entry_2 *)(copy + offset);
+        if (de->rec_len == 0 || offset + de->rec_len > BLOCK_SIZE) {
+            break;
+        }
+        if (de->inode_idx) {
+            map[n].hash = htree_hash(de->name, de->name_len, path->version, sb.s_hash_seed);
+            map[n].offset = offset;
+            map[n].rec_len = DE_REAL_REC_LEN(de);
+            size += map[n++].rec_len;
+        }
+        offset += de->rec_len;
+    }
+    qsort(map, n, sizeof(struct htree_map), htree_map_cmp);
+    // the upper half of the bytes moves, at least one dentry stays
+    int split = n;
+    for (uint32_t moved = 0; split > 1 && moved < size / 2;) {
+        moved += map[--split].rec_len;
+    }
+    uint32_t hash = map[split].hash;
+    int continued = split > 0 && map[split - 1].hash == hash;
+
+    struct htree_block nb;
+    htree_block_get(pblock, 0, &nb);
+    htree_leaf_fill(dcache->buf, copy, map, 0, split);
+    htree_leaf_fill(nb.buf, copy, map, split, n);
+    htree_insert_entry(&path->frames[path->levels - 1], hash + continued, lblock);
+    DEBUG("split leaf %u of directory %u at %#x, %d of %d dentries move to leaf %u",
+          dcache->lblock,
+          inode_idx,
+          hash,
+          n - split,
+          n,
+          lblock);
+    htree_stat.split++;
+
+    uint8_t *leaf = path->hash >= hash ? nb.buf : dcache->buf;
+    struct ext4_dir_entry_2 *de = dentry_block_fit(leaf, DE_CALC_REC_LEN(strlen(name)), NULL);
+    if (de) {
+        dentry_fill(de, name, new_inode_idx, file_type);
+    } else {
+        ERR("no room for dentry %s after the split of a leaf", name);
+        err = -ENOSPC;
+    }
+    dcache_write_back();
+    nb.dirty = 1;
+    htree_block_put(&nb);
+    free(copy);
+    free(map);
+    return err;
+}
+
+int htree_add(struct ext4_inode *inode, uint32_t inode_idx, uint32_t new_inode_idx, const char *name, int file_type) {
+    uint32_t name_len = strlen(name);
+    struct htree_path path;
+    int err;
+    for (;;) {
+        if ((err = htree_probe(inode, name, name_len, &path)) < 0) {
+            return err;
+        }
+        struct htree_frame *frame = &path.frames[path.levels - 1];
+        dcache_init(inode, inode_idx);
+        if (frame->at->block != dcache->lblock) {
+            dcache_load_lblock(inode, frame->at->block);
+        }
+        struct ext4_dir_entry_2 *de = dentry_block_fit(dcache->buf, DE_CALC_REC_LEN(name_len), NULL);
+        if (de) {
+            dentry_fill(de, name, new_inode_idx, file_type);
+            dcache_write_back();
+            htree_path_put(&path);
+            return 0;
+        }
+        // the leaf is full, it is split once its index has room for the new leaf
+        struct dx_countlimit *cl = HTREE_COUNTLIMIT(frame->entries);
+        if (cl->count < cl->limit) {
+            err = htree_split_leaf(inode, inode_idx, &path, new_inode_idx, name, file_type);
+            htree_path_put(&path);
+            return err;
+        }
+        err = htree_grow_index(inode, inode_idx, &path);
+        htree_path_put(&path);
+        if (err < 0) {
+            return err;
+        }
+    }
+}
+
+int htree_create(struct ext4_inode *inode, uint32_t inode_idx) {
+    dcache_init(inode, inode_idx);
+    uint8_t *root = dcache->buf;
+    struct ext4_dir_entry_2 *dot = (struct ext4_dir_entry_2 *)root;
+    struct ext4_dir_entry_2 *dotdot = (struct ext4_dir_entry_2 *)(root + EXT4_DE_DOT_SIZE);
+    if (dot->rec_len != EXT4_DE_DOT_SIZE || dot->name_len != 1 || dot->name[0] != '.' || dotdot->name_len != 2 ||
+        strncmp(dotdot->name, "..", 2) != 0) {
+        DEBUG("directory %u doesn't start with . and .., keep it linear", inode_idx);
+        return -EINVAL;
+    }
+
+    uint32_t lblock;
+    uint64_t pblock;
+    int err;
+    if ((err = dentry_block_append(inode, inode_idx, &lblock, &pblock)) < 0) {
+        return err;
+    }
+    struct htree_block nb;
+    htree_block_get(pblock, 0, &nb);
+
+    // the dentries after .. move to the first leaf, packed
+    dentry_block_init(nb.buf);
+    struct ext4_dir_entry_2 *last = NULL;
+    uint32_t to = 0;
+    for (uint32_t offset = EXT4_DE_DOT_SIZE + dotdot->rec_len; offset + EXT4_DE_BASE_SIZE <= BLOCK_SIZE;) {
+        struct ext4_dir_entry_2 *de = (struct ext4_dir_entry_2 *)(root + offset);
+        if (de->rec_len == 0 || offset + de->rec_len > BLOCK_SIZE) {
+            break;
+        }
+        if (de->inode_idx) {
+            last = (struct ext4_dir_entry_2 *)(nb.buf + to);
+            memcpy(last, de, DE_REAL_REC_LEN(de));
+            last->rec_len = DE_REAL_REC_LEN(de);
+            to += last->rec_len;
+        }
+        offset += de->rec_len;
+    }
+    if (last) {
+        last->rec_len += BLOCK_SIZE - EXT4_DE_TAIL_SIZE - to;
+    }
+
+    // block 0 keeps . and .., the root of the index takes the rest
+    dotdot->rec_len = BLOCK_SIZE - EXT4_DE_DOT_SIZE;
+    memset(root + 2 * EXT4_DE_DOT_SIZE, 0, BLOCK_SIZE - 2 * EXT4_DE_DOT_SIZE);
+    struct dx_root_info *info = (struct dx_root_info *)(root + 2 * EXT4_DE_DOT_SIZE);
+    info->hash_version = sb.s_def_hash_version <= EXT4_HASH_TEA ? sb.s_def_hash_version : EXT4_HASH_HALF_MD4;
+    info->info_length = sizeof(struct dx_root_info);
+    struct dx_entry *entries = (struct dx_entry *)(root + HTREE_ROOT_ENTRIES);
+    HTREE_COUNTLIMIT(entries)->limit = htree_limit(1);
+    HTREE_COUNTLIMIT(entries)->count = 1;
+    entries[0].block = lblock;
+    dcache_write_back();
+    nb.dirty = 1;
+    htree_block_put(&nb);
+
+    inode->i_flags |= EXT4_INDEX_FL;
+    ICACHE_SET_DIRTY(inode);
+    // the gaps of a linear directory are not used any more
+    dentry_space_drop(&ICACHE_DENTRY_SPACE(inode));
+    htree_stat.created++;
+    INFO("directory %u is indexed by hash, version %u", inode_idx, info->hash_version);
+    return 0;
+}
+
+// a live dentry of a directory being packed
+struct htree_sorted {
+    uint32_t hash;
+    const struct ext4_dir_entry_2 *de;
+};
+
+static int htree_sorted_cmp(const void *a, const void *b) {
+    uint32_t ha = ((const struct htree_sorted *)a)->hash, hb = ((const struct htree_sorted *)b)->hash;
+    return ha < hb ? -1 : ha > hb;
+}
+
+int htree_pack(const uint8_t *root, struct ext4_dir_entry_2 *const *des, uint32_t n, uint8_t *out,
+               uint32_t max_blocks) {
+    const struct dx_root_info *old_info = (const struct dx_root_info *)(root + 2 * EXT4_DE_DOT_SIZE);
+    int version = htree_version(old_info->hash_version);
+    struct htree_sorted *sorted = malloc((n + 1) * sizeof(struct htree_sorted));
+    uint32_t *starts = malloc((n + 2) * sizeof(uint32_t));  // first dentry of every leaf, then n
+    if (sorted == NULL || starts == NULL) {
+        free(sorted);
+        free(starts);
+        return -ENOMEM;
+    }
+    for (uint32_t i = 0; i < n; i++) {
+        sorted[i].hash = htree_hash(des[i]->name, des[i]->name_len, version, sb.s_hash_seed);
+        sorted[i].de = des[i];
+    }
+    qsort(sorted, n, sizeof(struct htree_sorted), htree_sorted_cmp);
+
+    // leaves are filled up in hash order, there is at least one
+    uint32_t leaves = 0;
+    uint32_t used = BLOCK_SIZE;
+    for (uint32_t i = 0; i < n; i++) {
+        uint16_t rec_len = DE_REAL_REC_LEN(sorted[i].de);
+        if (used + rec_len > BLOCK_SIZE - EXT4_DE_TAIL_SIZE) {
+            starts[leaves++] = i;
+            used = 0;
+        }
+        used += rec_len;
+    }
+    if (leaves == 0) {
+        starts[leaves++] = 0;
+    }
+    starts[leaves] = n;
+    uint16_t root_limit = htree_limit(1), node_limit = htree_limit(0);
+    uint32_t nodes = leaves <= root_limit ? 0 : (leaves + node_limit - 1) / node_limit;
+    if (nodes > root_limit || 1 + nodes + leaves > max_blocks) {
+        free(sorted);
+        free(starts);
+        return -ENOSPC;
+    }
+
+    // block 0 keeps . and .. and the hash version, the index is laid out again behind them
+    memset(out, 0, BLOCK_SIZE);
+    memcpy(out, root, HTREE_ROOT_ENTRIES);
+    ((struct dx_root_info *)(out + 2 * EXT4_DE_DOT_SIZE))->indirect_levels = nodes ? 1 : 0;
+    struct dx_entry *root_entries = (struct dx_entry *)(out + HTREE_ROOT_ENTRIES);
+    HTREE_COUNTLIMIT(root_entries)->limit = root_limit;
+    HTREE_COUNTLIMIT(root_entries)->count = nodes ? nodes : leaves;
+
+    uint32_t first_leaf = 1 + nodes;
+    for (uint32_t l = 0; l < leaves; l++) {
+        uint8_t *buf = out + (uint64_t)(first_leaf + l) * BLOCK_SIZE;
+        dentry_block_init(buf);
+        uint32_t offset = 0;
+        struct ext4_dir_entry_2 *de = NULL;
+        for (uint32_t i = starts[l]; i < starts[l + 1]; i++) {
+            de = (struct ext4_dir_entry_2 *)(buf + offset);
+            memcpy(de, sorted[i].de, DE_REAL_REC_LEN(sorted[i].de));
+            de->rec_len = DE_REAL_REC_LEN(sorted[i].de);
+            offset += de->rec_len;
+        }
+        if (de) {
+            de->rec_len += BLOCK_SIZE - EXT4_DE_TAIL_SIZE - offset;
+        }
+
+        // a hash split between two leaves is continued in the second one
+        uint32_t hash = 0;
+        if (l > 0) {
+            hash = sorted[starts[l]].hash + (sorted[starts[l] - 1].hash == sorted[starts[l]].hash);
+        }
+        struct dx_entry *entries = root_entries;
+        uint32_t slot = l;
+        if (nodes) {
+            uint32_t node = l / node_limit;
+            slot = l % node_limit;
+            uint8_t *node_buf = out + (uint64_t)(1 + node) * BLOCK_SIZE;
+            if (slot == 0) {
+                uint32_t count = leaves - l < node_limit ? leaves - l : node_limit;
+                htree_node_init(node_buf, count);
+                root_entries[node].block = 1 + node;
+                if (node > 0) {
+                    root_entries[node].hash = hash;
+                }
+            }
+            entries = (struct dx_entry *)(node_buf + HTREE_NODE_ENTRIES);
+        }
+        // the first entry has the dx_countlimit in place of its hash
+        if (slot > 0) {
+            entries[slot].hash = hash;
+        }
+        entries[slot].block = first_leaf + l;
+    }
+    free(sorted);
+    free(starts);
+    return 1 + nodes + leaves;
+}
+
+int htree_status(char *buf) {
+    int buf_cnt = 0;
+    buf_cnt += sprintf(buf + buf_cnt,
+                       "  htree[lookup:continued:fallback]\t [%lu/%lu/%lu]\n",
+                       htree_stat.lookup,
+                       htree_stat.continued,
+                       htree_stat.fallback);
+    buf_cnt += sprintf(buf + buf_cnt,
+                       "  htree[created:split:grow]\t [%lu/%lu/%lu]\n",
+                       htree_stat.created,
+                       htree_stat.split,
+                       htree_stat.grow);
+    return buf_cnt;
+}
@@ -0,0 +1,65 @@
+#ifndef HTREE_H
+#define HTREE_H
+
+#include <stdint.h>
+
+#include "ext4/ext4_dentry.h"
+#include "ext4/ext4_inode.h"
+
+/**
+ * @brief ext4 hash of a name, see lib/ext2fs/dirhash.c of e2fsprogs
+ *
+ * @param version EXT4_HASH_*, the unsigned variants included
+ * @param seed s_hash_seed, the default seed is used if it is all zero
+ * @return uint32_t hash with the lowest bit clear, the bit marks a hash continued in the next leaf
+ */
+uint32_t htree_hash(const char *name, uint32_t name_len, int version, const uint32_t *seed);
+
+/**
+ * @brief whether directories are indexed by hash when they grow past one block (dir_index feature)
+ */
+int htree_enabled();
+
+/**
+ * @brief turn a directory of one full block into a hash-indexed one: its dentries move to a new leaf and
+ * block 0 becomes the root of the index
+ *
+ * @return int -EINVAL if block 0 doesn't start with . and .., -ENOSPC if no block is left
+ */
+int htree_create(struct ext4_inode *inode, uint32_t inode_idx);
+
+/**
+ * @brief find a dentry in a hash-indexed directory, only the leaves of the hash are read
+ *
+ * @param de_before if not NULL, set the dentry before the found one in its leaf
+ * @param de set the dentry, in the current dcache block
+ * @return int -ENOENT if not found, -EINVAL if the index is not usable and the directory must be scanned
+ */
+int htree_find(struct ext4_inode *inode, uint32_t inode_idx, const char *name, uint32_t name_len,
+               struct ext4_dir_entry_2 **de_before, struct ext4_dir_entry_2 **de);
+
+/**
+ * @brief add a dentry in the leaf of its hash, a full leaf is split in two and a full index gets one more
+ * level, dcache is left on the block of the new dentry
+ *
+ * @return int -ENOSPC if no block is left or both levels of the index are full, -EINVAL if the index is not
+ * usable
+ */
+int htree_add(struct ext4_inode *inode, uint32_t inode_idx, uint32_t new_inode_idx, const char *name, int file_type);
+
+/**
+ * @brief lay out a hash-indexed directory again from its live dentries: block 0 with the root, the nodes if
+ * the root can't point to every leaf, then the leaves filled up in hash order
+ *
+ * @param root block 0 of the directory, its . and .. and dx_root_info are kept
+ * @param des the live dentries after . and ..
+ * @param out the new blocks of the directory, from lblock 0
+ * @param max_blocks blocks of out
+ * @return int blocks laid out, -ENOSPC if they don't fit in max_blocks or in two levels of index
+ */
+int htree_pack(const uint8_t *root, struct ext4_dir_entry_2 *const *des, uint32_t n, uint8_t *out,
+               uint32_t max_blocks);
+
+int htree_status(char *buf);
+
+#endif
@@ -32,7 +32,6 @@
 #include "logging.h"
 
 extern struct ext4_super_block sb;
-extern struct decache_entry *root;
 extern struct ext4_group_desc *gdt;
 extern struct dcache *dcache;
 
@@ -71,7 +70,7 @@ static uint32_t __inode_get_data_pblock_tind(uint32_t lblock, uint32_t tindex_bl
 /**
  * @brief Get pblock for a given inode and lblock.  If extent is not NULL, it will
  * store the length of extent, that is, the number of consecutive pblocks
- * that are also consecutive lblocks (not counting the requested one).
+ * that are also consecutive lblocks (starting from the requested one).
  *
  * @param inode
  * @param lblock
@@ -81,11 +80,23 @@ static uint32_t __inode_get_data_pblock_tind(uint32_t lblock, uint32_t tindex_bl
 uint64_t inode_get_data_pblock(struct ext4_inode *inode, uint32_t lblock, uint32_t *extent_len) {
     if (inode->i_flags & EXT4_EXTENTS_FL) {
         // inode use ext4 extents
+        struct ext4_extent_header *eh = (struct ext4_extent_header *)inode->i_block;
+        if (eh->eh_depth > 0) {
+            // deeper trees are walked once into a map kept with the cached inode
+            struct extent_map *map = extent_map_get(&ICACHE_EXTENT_MAP(inode), &inode->i_block);
+            if (map) {
+                return extent_map_get_pblock(map, lblock, extent_len);
+            }
+        }
         return extent_get_pblock(&inode->i_block, lblock, extent_len);
     } else {
         // old ext2/3 style, for backward compatibility
         // direct block, indirect block, dindirect block, tindirect block
         ASSERT(lblock <= BYTES2BLOCKS(EXT4_INODE_GET_SIZE(inode)));
+        if (extent_len) {
+            // no extent info, only one block is known to be consecutive
+            *extent_len = 1;
+        }
 
         if (lblock < EXT4_NDIR_BLOCKS) {
             return inode->i_block[lblock];
@@ -109,7 +120,6 @@ uint64_t inode_get_data_pblock(struct ext4_inode *inode, uint32_t lblock, uint32
     return 0;
 }
 
-// TODO: ext4 extents data pblock
 int inode_get_all_pblocks(struct ext4_inode *inode, struct pblock_arr *pblock_arr) {
     // uint64_t inode_block_count = EXT4_INODE_GET_SIZE(inode);
     if (inode->i_flags & EXT4_EXTENTS_FL) {
@@ -131,8 +141,8 @@ int inode_get_all_pblocks(struct ext4_inode *inode, struct pblock_arr *pblock_ar
             }
             INFO("get all pblocks done");
         } else {
-            // FIXME: recusively get all pblocks when eh->eh_depth > 0
-            ASSERT(0);
+            // index blocks are freed along with the data
+            return extent_get_all_pblocks(&inode->i_block, pblock_arr);
         }
     } else {
         // old ext2/3 style, for backward compatibility
@@ -157,9 +167,6 @@ int inode_get_by_number(uint32_t inode_idx, struct ext4_inode **inode) {
         DEBUG("Not found inode_idx %d in icache", inode_idx);
         *inode = icache_insert(inode_idx, 1);
     }
-
-    // update lru count of the inode
-    ICACHE_LRU_INC(*inode);
     return 0;
 }
 
@@ -174,16 +181,31 @@ uint64_t get_path_token_len(const char *path) {
 uint32_t inode_get_idx_by_path(const char *path) {
     uint32_t inode_idx = 0;
     struct ext4_inode *inode;
+    const char *full_path = path;
+    size_t full_len = strlen(path);
 
     DEBUG("Looking up: %s", path);
 
-    // first try to find in dcache
-    struct decache_entry *dc_entry = decache_find(&path);
-    inode_idx = dc_entry ? dc_entry->inode_idx : root->inode_idx;
+    // the whole path first, then component by component
+    inode_idx = pcache_find(full_path, full_len);
+    if (inode_idx) {
+        DEBUG("Found inode_idx %d in pcache", inode_idx);
+        return inode_idx;
+    }
+
+    struct pcache_trace trace;
+    trace.depth = 0;
+    inode_idx = decache_find(&path, &trace);
+    if (inode_idx == DECACHE_NEGATIVE) {
+        DEBUG("negative entry in decache, %s doesn't exist", path);
+        return 0;
+    }
+    if (inode_idx == 0) {
+        inode_idx = EXT4_ROOT_INO;
+    }
     DEBUG("Found inode_idx %d, path = %s", inode_idx, path);
 
     do {
-        uint64_t offset = 0;
         struct ext4_dir_entry_2 *de = NULL;
 
         path = skip_trailing_backslash(path);
@@ -195,45 +217,28 @@ uint32_t inode_get_idx_by_path(const char *path) {
         }
 
         // load inode by inode_idx
+        pcache_trace_add(&trace, inode_idx);
         inode_get_by_number(inode_idx, &inode);
-        dcache_init(inode, inode_idx);
-        while ((de = dentry_next(inode, inode_idx, offset))) {
-            offset += de->rec_len;
-            if (de->inode_idx == 0 && de->name_len == 0) {
-                // reach the ext4_dir_entry_tail
-                ASSERT(((struct ext4_dir_entry_tail *)de)->det_reserved_ft == EXT4_FT_DIR_CSUM);
-                INFO("reach the last dentry");
-                de = NULL;
-                break;
-            }
-            INFO("get dentry %s[%d]", de->name, de->inode_idx);
-
-            // if length not equal, continue
-            if (path_len != de->name_len || strncmp(path, de->name, path_len)) {
-                INFO("not match dentry %s", de->name);
-                continue;
-            }
-
-            // Found the entry
-            INFO("Found entry %s, inode %d", de->name, de->inode_idx);
-            inode_idx = de->inode_idx;
-
-            // if the entry is a directory, add it to the cache
-
+        // a hash-indexed directory only reads the leaf of the name, others are scanned
+        if ((de = dentry_lookup(inode, inode_idx, path, path_len, NULL))) {
+            INFO("Found entry %.*s, inode %d", de->name_len, de->name, de->inode_idx);
             INFO("Add dir entry %s:%d to dentry cache", path, path_len);
-            dc_entry = decache_insert(dc_entry, path, path_len, inode_idx);
-
-            break;
+            decache_insert(inode_idx, path, path_len, de->inode_idx);
+            inode_idx = de->inode_idx;
         }
 
-        /* Couldn't find the entry */
+        /* Couldn't find the entry, remember it so the next lookup of this name skips the scan */
         if (de == NULL) {
+            decache_insert(inode_idx, path, path_len, 0);
             inode_idx = 0;
             INFO("Couldn't find entry %s", path);
             break;
         }
     } while ((path = strchr(path, '/')));
 
+    if (inode_idx) {
+        pcache_insert(full_path, full_len, inode_idx, &trace);
+    }
     return inode_idx;
 }
 
@@ -313,6 +318,13 @@ int inode_check_permission(struct ext4_inode *inode, access_mode_t mode) {
 
 // find the path's directory inode_idx
 uint32_t inode_get_parent_idx_by_path(const char *path) {
+    // the parent is a prefix of path, look it up in place first
+    const char *last_slash = strrchr(path, '/');
+    uint32_t parent_idx = last_slash ? pcache_find(path, last_slash - path + 1) : 0;
+    if (parent_idx) {
+        return parent_idx;
+    }
+
     char *tmp = strdup(path);
     char *last_slashp = strrchr(tmp, '/');
     if (last_slashp == path) {
@@ -320,7 +332,7 @@ uint32_t inode_get_parent_idx_by_path(const char *path) {
         return 0;
     }
     *(last_slashp + 1) = '\0';
-    uint32_t parent_idx = inode_get_idx_by_path(tmp);
+    parent_idx = inode_get_idx_by_path(tmp);
     free(tmp);
     return parent_idx;
 }
@@ -370,6 +382,7 @@ int inode_create(uint32_t inode_idx, mode_t mode, struct ext4_inode **inode) {
     // new inode has one ext4 extent
     struct ext4_extent *ee = (struct ext4_extent *)(eh + 1);
     memset(ee, 0, 4 * sizeof(struct ext4_extent));
+    extent_map_drop(&ICACHE_EXTENT_MAP(*inode));
     ICACHE_SET_DIRTY(*inode);  // mark new inode as dirty
     INFO("new inode %u created", inode_idx);
     return 0;
@@ -404,9 +417,54 @@ int inode_init_pblock(struct ext4_inode *inode, uint64_t pblock_idx) {
     ee->ee_block = 0;  // logical block 0
     EXT4_EXT_SET_PADDR(ee, pblock_idx);
     ee->ee_len = EXT4_INODE_PBLOCK_NUM;
+    extent_map_drop(&ICACHE_EXTENT_MAP(inode));
 
     EXT4_INODE_SET_BLOCKS(inode, EXT4_INODE_PBLOCK_NUM);
     ICACHE_SET_DIRTY(inode);
     bitmap_pblock_set(pblock_idx, EXT4_INODE_PBLOCK_NUM, 1);
     return 0;
-}
\ No newline at end of file
+}
+
+struct inode_grow_ctx {
+    struct ext4_inode *inode;
+    uint32_t inode_idx;
+};
+
+// a leaf of the extent tree takes a chunk of its own, the blocks after the first one stay unused
+static uint64_t inode_grow_leaf(void *arg) {
+    struct inode_grow_ctx *ctx = arg;
+    uint64_t pblock = bitmap_pblock_find(ctx->inode_idx, EXT4_INODE_PBLOCK_NUM);
+    if (pblock == UINT64_MAX) {
+        return 0;
+    }
+    bitmap_pblock_set(pblock, EXT4_INODE_PBLOCK_NUM, 1);
+    EXT4_INODE_SET_BLOCKS(ctx->inode, EXT4_INODE_GET_BLOCKS(ctx->inode) + EXT4_INODE_PBLOCK_NUM);
+    return pblock;
+}
+
+int inode_grow(struct ext4_inode *inode, uint32_t inode_idx, uint32_t lblock, uint32_t chunks) {
+    struct inode_grow_ctx ctx = {inode, inode_idx};
+    uint64_t goal = lblock ? inode_get_data_pblock(inode, lblock - 1, NULL) + 1 : 0;
+    uint32_t n;
+    for (n = 0; n < chunks; n++) {
+        uint64_t pblock = bitmap_pblock_find_near(inode_idx, goal);
+        if (pblock == UINT64_MAX) {
+            break;
+        }
+        bitmap_pblock_set(pblock, EXT4_INODE_PBLOCK_NUM, 1);
+        if (extent_append(inode->i_block, lblock, pblock, EXT4_INODE_PBLOCK_NUM, inode_grow_leaf, &ctx) < 0) {
+            bitmap_pblock_set(pblock, EXT4_INODE_PBLOCK_NUM, 0);
+            break;
+        }
+        EXT4_INODE_SET_BLOCKS(inode, EXT4_INODE_GET_BLOCKS(inode) + EXT4_INODE_PBLOCK_NUM);
+        lblock += EXT4_INODE_PBLOCK_NUM;
+        goal = pblock + EXT4_INODE_PBLOCK_NUM;
+    }
+    if (n == 0) {
+        return -ENOSPC;
+    }
+    extent_map_drop(&ICACHE_EXTENT_MAP(inode));
+    ICACHE_SET_DIRTY(inode);
+    DEBUG("inode %u grows by %u blocks to lblock %u", inode_idx, n * EXT4_INODE_PBLOCK_NUM, lblock);
+    return n;
+}
@@ -59,4 +59,14 @@ int inode_get_parent_by_path(const char *path, struct ext4_inode **inode, uint32
 int inode_write_back(uint32_t inode_idx, struct ext4_inode *inode);
 int inode_mode2type(mode_t mode);
 int inode_init_pblock(struct ext4_inode *inode, uint64_t pblock_idx);
+
+/**
+ * @brief allocate chunks of EXT4_INODE_PBLOCK_NUM blocks and map them from lblock on, the first one next to
+ * the block before lblock if it is free so that the last extent only gets longer
+ *
+ * @param lblock the first unmapped lblock of the inode
+ * @param chunks
+ * @return int chunks allocated, fewer if the disk or the extent tree is full, -ENOSPC if none
+ */
+int inode_grow(struct ext4_inode *inode, uint32_t inode_idx, uint32_t lblock, uint32_t chunks);
 #endif
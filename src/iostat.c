@@ -0,0 +1,239 @@
+#include "iostat.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/*
+ * Every thread doing disk I/O owns a table of call sites, only that thread updates it so no lock or
+ * atomic read-modify-write is needed on the fast path. The tables are linked in iostat.tables for
+ * iostat_status to merge, a table is folded into iostat.retired when its thread exits (fuse worker
+ * threads come and go).
+ */
+
+struct iostat_table {
+    struct iostat_site sites[IOSTAT_SITES];
+    uint64_t lost;  // requests of call sites that did not fit in sites
+    struct iostat_table *next;
+};
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_once_t once;
+    pthread_key_t key;
+    struct iostat_table *tables;  // tables of live threads
+    struct iostat_table retired;  // counters of exited threads
+} iostat = {.lock = PTHREAD_MUTEX_INITIALIZER, .once = PTHREAD_ONCE_INIT};
+
+static __thread struct iostat_table *iostat_local = NULL;
+
+// single writer, a plain store is enough, the reader only needs to see no torn values
+#define IOSTAT_ADD(__x, __v) __atomic_store_n(&(__x), (__x) + (__v), __ATOMIC_RELAXED)
+#define IOSTAT_GET(__x)      __atomic_load_n(&(__x), __ATOMIC_RELAXED)
+
+uint64_t iostat_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// find the slot of (func, line, dir) in sites, take a free one if not found, NULL if sites is full
+static struct iostat_site *iostat_slot(struct iostat_site *sites, int n, const char *func, int line, int dir) {
+    uint32_t hash = ((uintptr_t)func >> 3) * 31 + line * 2 + dir;
+    for (int i = 0; i < n; i++) {
+        struct iostat_site *site = &sites[(hash + i) % n];
+        const char *f = __atomic_load_n(&site->func, __ATOMIC_ACQUIRE);
+        if (f == NULL) {
+            site->line = line;
+            site->dir = dir;
+            __atomic_store_n(&site->func, func, __ATOMIC_RELEASE);
+            return site;
+        }
+        if (f == func && site->line == line && site->dir == dir) {
+            return site;
+        }
+    }
+    return NULL;
+}
+
+// add the counters of src to the same call site in sites, return -1 if sites is full
+static int iostat_merge(struct iostat_site *sites, int n, struct iostat_site *src) {
+    const char *func = __atomic_load_n(&src->func, __ATOMIC_ACQUIRE);
+    if (func == NULL) {
+        return 0;
+    }
+    struct iostat_site *dst = iostat_slot(sites, n, func, src->line, src->dir);
+    if (dst == NULL) {
+        return -1;
+    }
+    dst->count += IOSTAT_GET(src->count);
+    dst->bytes += IOSTAT_GET(src->bytes);
+    dst->ns += IOSTAT_GET(src->ns);
+    for (int i = 0; i < IOSTAT_HIST; i++) {
+        dst->hist[i] += IOSTAT_GET(src->hist[i]);
+    }
+    return 0;
+}
+
+// iostat.key destructor, called when a thread that owns a table exits
+static void iostat_thread_exit(void *arg) {
+    struct iostat_table *table = arg;
+    pthread_mutex_lock(&iostat.lock);
+    for (int i = 0; i < IOSTAT_SITES; i++) {
+        if (iostat_merge(iostat.retired.sites, IOSTAT_SITES, &table->sites[i]) < 0) {
+            iostat.retired.lost += table->sites[i].count;
+        }
+    }
+    iostat.retired.lost += table->lost;
+    for (struct iostat_table **t = &iostat.tables; *t; t = &(*t)->next) {
+        if (*t == table) {
+            *t = table->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&iostat.lock);
+    free(table);
+}
+
+static void iostat_key_create() {
+    pthread_key_create(&iostat.key, iostat_thread_exit);
+}
+
+static struct iostat_table *iostat_table_get() {
+    if (iostat_local) {
+        return iostat_local;
+    }
+    pthread_once(&iostat.once, iostat_key_create);
+    struct iostat_table *table = calloc(1, sizeof(struct iostat_table));
+    if (table == NULL) {
+        return NULL;
+    }
+    pthread_mutex_lock(&iostat.lock);
+    table->next = iostat.tables;
+    iostat.tables = table;
+    pthread_mutex_unlock(&iostat.lock);
+    pthread_setspecific(iostat.key, table);
+    iostat_local = table;
+    return table;
+}
+
+void iostat_account(const char *func, int line, enum iostat_dir dir, size_t bytes, uint64_t start) {
+    uint64_t ns = iostat_now() - start;
+    struct iostat_table *table = iostat_table_get();
+    if (table == NULL) {
+        return;
+    }
+    struct iostat_site *site = iostat_slot(table->sites, IOSTAT_SITES, func, line, dir);
+    if (site == NULL) {
+        IOSTAT_ADD(table->lost, 1);
+        return;
+    }
+    int bucket = ns ? 64 - __builtin_clzll(ns) : 0;
+    if (bucket >= IOSTAT_HIST) {
+        bucket = IOSTAT_HIST - 1;
+    }
+    IOSTAT_ADD(site->count, 1);
+    IOSTAT_ADD(site->bytes, bytes);
+    IOSTAT_ADD(site->ns, ns);
+    IOSTAT_ADD(site->hist[bucket], 1);
+}
+
+// upper bound of the bucket holding the pct percentile, in us
+static double iostat_percentile(struct iostat_site *site, int pct) {
+    uint64_t target = (site->count * pct + 99) / 100;
+    uint64_t sum = 0;
+    for (int i = 0; i < IOSTAT_HIST; i++) {
+        sum += site->hist[i];
+        if (sum >= target) {
+            return i ? (double)(1ULL << i) / 1000 : 0;
+        }
+    }
+    return (double)(1ULL << (IOSTAT_HIST - 1)) / 1000;
+}
+
+static int iostat_cmp(const void *a, const void *b) {
+    const struct iostat_site *x = a, *y = b;
+    if (!x->func != !y->func) {
+        return x->func ? -1 : 1;  // free slots last
+    }
+    if (x->ns != y->ns) {
+        return x->ns < y->ns ? 1 : -1;
+    }
+    return 0;
+}
+
+int iostat_status(char *buf, size_t size) {
+    // sites of different threads are merged, leave room for all of them to differ
+    int n = IOSTAT_SITES * 2;
+    struct iostat_site *sites = calloc(n, sizeof(struct iostat_site));
+    uint64_t lost = 0;
+    if (sites == NULL) {
+        return snprintf(buf, size, "  iostat: out of memory\n");
+    }
+
+    pthread_mutex_lock(&iostat.lock);
+    struct iostat_table *t = &iostat.retired;
+    while (t) {
+        for (int i = 0; i < IOSTAT_SITES; i++) {
+            if (iostat_merge(sites, n, &t->sites[i]) < 0) {
+                lost += IOSTAT_GET(t->sites[i].count);
+            }
+        }
+        lost += IOSTAT_GET(t->lost);
+        t = t == &iostat.retired ? iostat.tables : t->next;
+    }
+    pthread_mutex_unlock(&iostat.lock);
+
+    qsort(sites, n, sizeof(struct iostat_site), iostat_cmp);
+
+    int buf_cnt = 0;
+    int len = snprintf(buf,
+                       size,
+                       "  %-32s %s %10s %12s %9s %9s %9s\n",
+                       "call site",
+                       "rw",
+                       "count",
+                       "bytes",
+                       "avg(us)",
+                       "p50(us)",
+                       "p99(us)");
+    if ((size_t)len >= size) {
+        free(sites);
+        return 0;
+    }
+    buf_cnt += len;
+    for (int i = 0; i < n && sites[i].func; i++) {
+        struct iostat_site *site = &sites[i];
+        if (site->count == 0) {
+            continue;
+        }
+        char name[64];
+        snprintf(name, sizeof(name), "%s:%d", site->func, site->line);
+        len = snprintf(buf + buf_cnt,
+                       size - buf_cnt,
+                       "  %-32s %2s %10lu %12lu %9.1f %9.1f %9.1f\n",
+                       name,
+                       site->dir == IOSTAT_READ ? "r" : "w",
+                       site->count,
+                       site->bytes,
+                       (double)site->ns / site->count / 1000,
+                       iostat_percentile(site, 50),
+                       iostat_percentile(site, 99));
+        if ((size_t)len >= size - buf_cnt) {
+            // out of room, the remaining call sites are the cheapest ones
+            buf[buf_cnt] = '\0';
+            break;
+        }
+        buf_cnt += len;
+    }
+    if (lost) {
+        len = snprintf(buf + buf_cnt, size - buf_cnt, "  lost %lu requests, too many call sites\n", lost);
+        if ((size_t)len < size - buf_cnt) {
+            buf_cnt += len;
+        }
+    }
+    free(sites);
+    return buf_cnt;
+}
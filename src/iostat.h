@@ -0,0 +1,42 @@
+#ifndef IOSTAT_H
+#define IOSTAT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define IOSTAT_SITES 128  // call sites tracked per thread, more are counted as lost
+#define IOSTAT_HIST  32   // latency histogram buckets, bucket i counts requests of [2^(i-1), 2^i) ns
+
+enum iostat_dir { IOSTAT_READ, IOSTAT_WRITE };
+
+// one (call site, direction) of the disk layer
+struct iostat_site {
+    const char *func;  // NULL if the slot is free
+    int line;
+    int dir;
+    uint64_t count;
+    uint64_t bytes;
+    uint64_t ns;  // total latency
+    uint64_t hist[IOSTAT_HIST];
+};
+
+/**
+ * @brief monotonic time in ns, pass it to iostat_account when the request is done
+ */
+uint64_t iostat_now();
+
+/**
+ * @brief account a request of bytes issued at func:line, started at start (see iostat_now)
+ *
+ * Counters are per thread and never locked, they are merged by iostat_status.
+ */
+void iostat_account(const char *func, int line, enum iostat_dir dir, size_t bytes, uint64_t start);
+
+/**
+ * @brief print the call sites sorted by total latency into buf, as many as fit in size
+ *
+ * @return int bytes written
+ */
+int iostat_status(char *buf, size_t size);
+
+#endif
@@ -13,6 +13,7 @@
 #include <errno.h>
 #include <execinfo.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <linux/limits.h>
 #include <signal.h>
 #include <stddef.h>
@@ -21,44 +22,89 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "arena.h"
+#include "cache.h"
 #include "common.h"
+#include "compact.h"
 #include "disk.h"
 #include "ext4/ext4.h"
 #include "inode.h"
 #include "logging.h"
+#include "mem.h"
 #include "ops.h"
+#include "readahead.h"
 #include "ctl.h"
 
 #ifndef EXT4FUSE_VERSION
 #define EXT4FUSE_VERSION "v0.0.1"
 #endif
 
+#define OPT_UNSET UINT_MAX  // a size option not given, taken from the memory budget or the default
+
+// an op that looks up a path or touches dentries holds compaction off while it runs, see compact.h
+#define LOCKED_OP(__op, __params, __args) \
+    static int locked_##__op __params {   \
+        compact_lock_shared();            \
+        int __ret = op_##__op __args;     \
+        compact_unlock_shared();          \
+        return __ret;                     \
+    }
+
+LOCKED_OP(getattr, (const char *path, struct stat *st, struct fuse_file_info *fi), (path, st, fi))
+LOCKED_OP(access, (const char *path, int mask), (path, mask))
+LOCKED_OP(opendir, (const char *path, struct fuse_file_info *fi), (path, fi))
+LOCKED_OP(readdir,
+          (const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi,
+           enum fuse_readdir_flags flags),
+          (path, buf, filler, offset, fi, flags))
+LOCKED_OP(readlink, (const char *path, char *buf, size_t bufsize), (path, buf, bufsize))
+LOCKED_OP(mkdir, (const char *path, mode_t mode), (path, mode))
+LOCKED_OP(link, (const char *from, const char *to), (from, to))
+LOCKED_OP(symlink, (const char *from, const char *to), (from, to))
+LOCKED_OP(unlink, (const char *path), (path))
+LOCKED_OP(rmdir, (const char *path), (path))
+LOCKED_OP(rename, (const char *from, const char *to, unsigned int flags), (from, to, flags))
+LOCKED_OP(chmod, (const char *path, mode_t mode, struct fuse_file_info *fi), (path, mode, fi))
+LOCKED_OP(chown, (const char *path, uid_t uid, gid_t gid, struct fuse_file_info *fi), (path, uid, gid, fi))
+LOCKED_OP(utimens, (const char *path, const struct timespec ts[2], struct fuse_file_info *fi), (path, ts, fi))
+LOCKED_OP(open, (const char *path, struct fuse_file_info *fi), (path, fi))
+LOCKED_OP(flush, (const char *path, struct fuse_file_info *fi), (path, fi))
+LOCKED_OP(fsync, (const char *path, int isdatasync, struct fuse_file_info *fi), (path, isdatasync, fi))
+LOCKED_OP(read,
+          (const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi),
+          (path, buf, size, offset, fi))
+LOCKED_OP(write,
+          (const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi),
+          (path, buf, size, offset, fi))
+LOCKED_OP(create, (const char *path, mode_t mode, struct fuse_file_info *fi), (path, mode, fi))
+
 static struct fuse_operations e4f_ops = {
     .init = op_init,
-    .getattr = op_getattr,
-    .access = op_access,
-    .readdir = op_readdir,
-    // .releasedir = op_releasedir,
-    .readlink = op_readlink,
+    .getattr = locked_getattr,
+    .access = locked_access,
+    .opendir = locked_opendir,
+    .readdir = locked_readdir,
+    .releasedir = op_releasedir,
+    .readlink = locked_readlink,
     // .mknod = op_mknod,
-    .mkdir = op_mkdir,
-    .link = op_link,
-    .symlink = op_symlink,
-    .unlink = op_unlink,
-    .rmdir = op_rmdir,
-    .rename = op_rename,
-    .chmod = op_chmod,
-    .chown = op_chown,
+    .mkdir = locked_mkdir,
+    .link = locked_link,
+    .symlink = locked_symlink,
+    .unlink = locked_unlink,
+    .rmdir = locked_rmdir,
+    .rename = locked_rename,
+    .chmod = locked_chmod,
+    .chown = locked_chown,
     // .truncate = op_truncate,
-    .utimens = op_utimens,
-    .open = op_open,
-    .flush = op_flush,
-    // .fsync = op_fsync,
+    .utimens = locked_utimens,
+    .open = locked_open,
+    .flush = locked_flush,
+    .fsync = locked_fsync,
     // .release = op_release,
-    .read = op_read,
-    .write = op_write,
+    .read = locked_read,
+    .write = locked_write,
     // .statfs = op_statfs,
-    .create = op_create,
+    .create = locked_create,
     .destroy = op_destory,
     .statfs = op_statfs,
     .lock = op_lock,
@@ -70,9 +116,36 @@ static struct fuse_operations e4f_ops = {
 static struct e4f {
     char *disk;
     char *logfile;
+    char *io;                 // disk io engine: pread(default) or uring
+    int mmap;                 // map the whole disk image, metadata blocks are used in place
+    int direct;               // bypass the host page cache with O_DIRECT
+    unsigned readahead;       // max readahead window in KiB, 0 to disable
+    char *backend;            // disk backend: file(default) or ram
+    int hugepage;             // back the ram disk and the buffer arena with hugepages
+    unsigned arena;           // cap of the buffer arena in MiB, 0 to disable
+    unsigned bcache;          // capacity of the metadata buffer cache in blocks
+    unsigned icache;          // capacity of the inode cache in inodes
+    unsigned decache;         // memory bound of the dentry cache in KiB
+    double negative_timeout;  // seconds the kernel caches a failed lookup
+    unsigned pcache;          // capacity of the path cache in paths, 0 to disable
+    char *cache_mem;          // memory budget of all the caches, like 512M or 2G
 } e4f;
 
-static struct fuse_opt e4f_opts[] = {{"logfile=%s", offsetof(struct e4f, logfile), 0}, FUSE_OPT_END};
+static struct fuse_opt e4f_opts[] = {{"logfile=%s", offsetof(struct e4f, logfile), 0},
+                                     {"io=%s", offsetof(struct e4f, io), 0},
+                                     {"mmap", offsetof(struct e4f, mmap), 1},
+                                     {"direct", offsetof(struct e4f, direct), 1},
+                                     {"readahead=%u", offsetof(struct e4f, readahead), 0},
+                                     {"backend=%s", offsetof(struct e4f, backend), 0},
+                                     {"hugepage", offsetof(struct e4f, hugepage), 1},
+                                     {"arena=%u", offsetof(struct e4f, arena), 0},
+                                     {"bcache=%u", offsetof(struct e4f, bcache), 0},
+                                     {"icache=%u", offsetof(struct e4f, icache), 0},
+                                     {"decache=%u", offsetof(struct e4f, decache), 0},
+                                     {"negative_timeout=%lf", offsetof(struct e4f, negative_timeout), 0},
+                                     {"pcache=%u", offsetof(struct e4f, pcache), 0},
+                                     {"cache_mem=%s", offsetof(struct e4f, cache_mem), 0},
+                                     FUSE_OPT_END};
 
 static int e4f_opt_proc(void *data, const char *arg, int key, struct fuse_args *outargs) {
     (void)data;
@@ -123,6 +196,19 @@ int main(int argc, char *argv[]) {
     // Default options
     e4f.disk = NULL;
     e4f.logfile = DEFAULT_LOG_FILE;
+    e4f.io = NULL;
+    e4f.mmap = 0;
+    e4f.direct = 0;
+    e4f.readahead = OPT_UNSET;
+    e4f.backend = NULL;
+    e4f.hugepage = 0;
+    e4f.arena = ARENA_DEFAULT_MB;
+    e4f.bcache = OPT_UNSET;
+    e4f.icache = OPT_UNSET;
+    e4f.decache = OPT_UNSET;
+    e4f.negative_timeout = DECACHE_NEG_TIMEOUT;
+    e4f.pcache = OPT_UNSET;
+    e4f.cache_mem = NULL;
 
     if (fuse_opt_parse(&args, &e4f, e4f_opts, e4f_opt_proc) == -1) {
         return EXIT_FAILURE;
@@ -139,7 +225,30 @@ int main(int argc, char *argv[]) {
         return EXIT_FAILURE;
     }
 
-    if (disk_open(e4f.disk) < 0) {
+    int disk_flags = 0;
+    if (e4f.io && strcmp(e4f.io, "uring") == 0) {
+        disk_flags |= DISK_F_URING;
+    } else if (e4f.io && strcmp(e4f.io, "pread") != 0) {
+        fprintf(stderr, "Unknown io engine: %s, should be pread or uring\n", e4f.io);
+        return EXIT_FAILURE;
+    }
+    if (e4f.mmap) {
+        disk_flags |= DISK_F_MMAP;
+    }
+    if (e4f.direct) {
+        disk_flags |= DISK_F_DIRECT;
+    }
+    if (e4f.backend && strcmp(e4f.backend, "ram") == 0) {
+        disk_flags |= DISK_F_RAM;
+    } else if (e4f.backend && strcmp(e4f.backend, "file") != 0) {
+        fprintf(stderr, "Unknown disk backend: %s, should be file or ram\n", e4f.backend);
+        return EXIT_FAILURE;
+    }
+    if (e4f.hugepage) {
+        disk_flags |= DISK_F_HUGEPAGE;
+    }
+
+    if (disk_open(e4f.disk, disk_flags) < 0) {
         fprintf(stderr, "disk_open: %s: %s\n", e4f.disk, strerror(errno));
         return EXIT_FAILURE;
     }
@@ -156,6 +265,47 @@ int main(int argc, char *argv[]) {
         fprintf(stderr, "Magic number mismatch, partition doesn't contain EXT4 filesystem\n");
         return EXIT_FAILURE;
     }
+
+    uint64_t cache_mem = 0;
+    if (e4f.cache_mem && (cache_mem = mem_parse_size(e4f.cache_mem)) == 0) {
+        fprintf(stderr, "Invalid cache_mem: %s, should be a size like 512M or 2G\n", e4f.cache_mem);
+        return EXIT_FAILURE;
+    }
+    mem_config(cache_mem);
+    // the caches not sized explicitly get their share of the budget
+    if (cache_mem) {
+        uint32_t log_block_size;
+        off_t log_block_size_offset = BOOT_SECTOR_SIZE + offsetof(struct ext4_super_block, s_log_block_size);
+        if (disk_read(log_block_size_offset, sizeof(log_block_size), &log_block_size) < 0) {
+            fprintf(stderr, "Failed to read disk: %s\n", e4f.disk);
+            return EXIT_FAILURE;
+        }
+        uint64_t block_size = 1024ULL << log_block_size;
+        if (e4f.bcache == OPT_UNSET)
+            e4f.bcache = mem_share(MEM_BCACHE) / (block_size + sizeof(struct bcache_buf));
+        if (e4f.icache == OPT_UNSET)
+            e4f.icache = mem_share(MEM_ICACHE) / ICACHE_INODE_MEM;
+        if (e4f.decache == OPT_UNSET)
+            e4f.decache = mem_share(MEM_DECACHE) >> 10;
+        if (e4f.pcache == OPT_UNSET)
+            e4f.pcache = mem_share(MEM_PCACHE) / PCACHE_PATH_MEM;
+        // the readahead cache holds 4 windows, see readahead_init
+        if (e4f.readahead == OPT_UNSET && mem_share(MEM_READAHEAD) / 4 < (RA_DEFAULT_KB << 10))
+            e4f.readahead = mem_share(MEM_READAHEAD) / 4 >> 10;
+    }
+    e4f.readahead = e4f.readahead == OPT_UNSET ? RA_DEFAULT_KB : e4f.readahead;
+    e4f.bcache = e4f.bcache == OPT_UNSET ? BCACHE_DEFAULT_BLOCKS : e4f.bcache;
+    e4f.icache = e4f.icache == OPT_UNSET ? ICACHE_DEFAULT_COUNT : e4f.icache;
+    e4f.decache = e4f.decache == OPT_UNSET ? DECACHE_DEFAULT_KB : e4f.decache;
+    e4f.pcache = e4f.pcache == OPT_UNSET ? PCACHE_DEFAULT_COUNT : e4f.pcache;
+    // the readahead thread is started in op_init, after fuse daemonizes
+    readahead_config(e4f.readahead);
+    arena_config(e4f.arena, e4f.hugepage);
+    bcache_config(e4f.bcache);
+    icache_config(e4f.icache);
+    decache_config(e4f.decache, e4f.negative_timeout);
+    pcache_config(e4f.pcache);
+
     res = fuse_main(args.argc, args.argv, &e4f_ops, NULL);
 
     fuse_opt_free_args(&args);
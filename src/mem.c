@@ -0,0 +1,306 @@
+#include "mem.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "arena.h"
+#include "bitmap.h"
+#include "cache.h"
+#include "logging.h"
+#include "readahead.h"
+
+/*
+ * With a budget every cache is sized from its share in main, so the caches stay within it by themselves;
+ * extent maps and arena overflow are the only memory that can go past it. A thread checks the usage every
+ * MEM_CHECK_MS and shrinks the caches by the excess. It also waits for memory pressure: a PSI trigger on
+ * the memory.pressure of our cgroup (the system wide /proc/pressure/memory outside of a cgroup) and the
+ * high counter of memory.events, bumped when the cgroup goes over memory.high. A pressure event shrinks
+ * every cache by 1/MEM_PRESSURE_SHRINK whether there is a budget or not.
+ *
+ * The icache and the readahead cache are fixed: their entries and buffers are allocated once at init and
+ * requests use inodes and extent maps without holding a reference, so nothing can be dropped from under
+ * them. Their share is left out: the excess is what the other caches use over the rest of the budget and
+ * a pressure event takes 1/MEM_PRESSURE_SHRINK of what the other caches use.
+ */
+
+static const struct {
+    const char *name;
+    uint64_t (*usage)();
+    uint64_t (*shrink)(uint64_t bytes);  // NULL if the memory is fixed once the cache is initialized
+    uint32_t share;                      // percent of the budget
+} mem_caches[MEM_CACHES] = {
+    [MEM_BCACHE] = {"bcache", bcache_mem, bcache_shrink, 50},
+    [MEM_ICACHE] = {"icache", icache_mem, NULL, 20},
+    [MEM_DECACHE] = {"decache", decache_mem, decache_shrink, 15},
+    [MEM_PCACHE] = {"pcache", pcache_mem, pcache_shrink, 10},
+    [MEM_READAHEAD] = {"readahead", readahead_mem, NULL, 5},
+};
+
+static struct {
+    uint64_t budget;  // 0 if there is none
+    pthread_t thread;
+    int running;
+    int stop_fd;    // eventfd to stop the thread
+    int psi_fd;     // PSI trigger, -1 if not available
+    int events_fd;  // memory.events of the cgroup, -1 if not available
+    uint64_t high;  // last high count of memory.events
+    uint64_t pressure;  // memory pressure events
+    uint64_t over;      // times the usage was found over the budget
+    uint64_t shrunk;    // bytes freed by the shrinker
+} mem = {.stop_fd = -1, .psi_fd = -1, .events_fd = -1};
+
+void mem_config(uint64_t budget) {
+    mem.budget = budget;
+}
+
+uint64_t mem_parse_size(const char *s) {
+    char *end;
+    errno = 0;
+    uint64_t size = strtoull(s, &end, 10);
+    if (errno || end == s) {
+        return 0;
+    }
+    switch (*end) {
+        case 'T':
+        case 't':
+            size <<= 10;
+            // fall through
+        case 'G':
+        case 'g':
+            size <<= 10;
+            // fall through
+        case 'M':
+        case 'm':
+            size <<= 10;
+            // fall through
+        case 'K':
+        case 'k':
+            size <<= 10;
+            end++;
+            break;
+        default:
+            break;
+    }
+    return *end == '\0' ? size : 0;
+}
+
+uint64_t mem_share(enum mem_cache id) {
+    return mem.budget / 100 * mem_caches[id].share;
+}
+
+static uint64_t mem_usage(int shrinkable) {
+    uint64_t used = 0;
+    for (int i = 0; i < MEM_CACHES; i++) {
+        if (!shrinkable || mem_caches[i].shrink) {
+            used += mem_caches[i].usage();
+        }
+    }
+    return used;
+}
+
+// the part of the budget shared by the caches with a shrinker
+static uint64_t mem_shrinkable_budget() {
+    uint64_t budget = 0;
+    for (int i = 0; i < MEM_CACHES; i++) {
+        if (mem_caches[i].shrink) {
+            budget += mem_share(i);
+        }
+    }
+    return budget;
+}
+
+uint64_t mem_shrink(uint64_t bytes) {
+    uint64_t usage[MEM_CACHES];
+    uint64_t total = 0;
+    for (int i = 0; i < MEM_CACHES; i++) {
+        usage[i] = mem_caches[i].shrink ? mem_caches[i].usage() : 0;
+        total += usage[i];
+    }
+    if (total == 0) {
+        return 0;
+    }
+    uint64_t freed = 0;
+    for (int i = 0; i < MEM_CACHES; i++) {
+        if (usage[i]) {
+            freed += mem_caches[i].shrink((uint64_t)((double)bytes * usage[i] / total));
+        }
+    }
+    uint64_t trimmed = arena_trim();
+    __atomic_add_fetch(&mem.shrunk, freed, __ATOMIC_RELAXED);
+    INFO("shrink caches by %lu KiB, freed %lu KiB, %lu KiB back to the kernel", bytes >> 10, freed >> 10,
+         trimmed >> 10);
+    return freed;
+}
+
+// the cgroup v2 directory of this process, "" if it is not in one
+static void mem_cgroup_dir(char *dir, size_t size) {
+    dir[0] = '\0';
+    FILE *f = fopen("/proc/self/cgroup", "r");
+    if (f == NULL) {
+        return;
+    }
+    char line[PATH_MAX];
+    while (fgets(line, sizeof(line), f)) {
+        if (strncmp(line, "0::", 3) == 0) {
+            line[strcspn(line, "\n")] = '\0';
+            snprintf(dir, size, "/sys/fs/cgroup%s", line + 3);
+            break;
+        }
+    }
+    fclose(f);
+}
+
+static int mem_psi_open(const char *path) {
+    int fd = open(path, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    if (write(fd, MEM_PSI_TRIGGER, strlen(MEM_PSI_TRIGGER) + 1) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// read the high count of memory.events, 0 if it can't be read
+static uint64_t mem_events_high() {
+    char buf[512];
+    ssize_t n = pread(mem.events_fd, buf, sizeof(buf) - 1, 0);
+    if (n <= 0) {
+        return 0;
+    }
+    buf[n] = '\0';
+    char *high = strstr(buf, "\nhigh ");
+    return high ? strtoull(high + 6, NULL, 10) : 0;
+}
+
+static void *mem_thread(void *arg) {
+    (void)arg;
+    for (;;) {
+        // poll ignores the negative fds
+        struct pollfd fds[3] = {
+            {.fd = mem.stop_fd, .events = POLLIN},
+            {.fd = mem.psi_fd, .events = POLLPRI},
+            {.fd = mem.events_fd, .events = POLLPRI},
+        };
+        int n = poll(fds, 3, MEM_CHECK_MS);
+        if (n < 0 && errno != EINTR) {
+            ERR("memory watcher poll: %s", strerror(errno));
+            break;
+        }
+        if (fds[0].revents) {
+            break;
+        }
+        int pressure = 0;
+        if (fds[1].revents & POLLERR) {
+            // the cgroup is gone
+            close(mem.psi_fd);
+            mem.psi_fd = -1;
+        } else if (fds[1].revents & POLLPRI) {
+            pressure = 1;
+        }
+        if (fds[2].revents & (POLLPRI | POLLERR)) {
+            uint64_t high = mem_events_high();
+            pressure |= high != mem.high;
+            mem.high = high;
+        }
+
+        uint64_t used = mem_usage(1);
+        uint64_t budget = mem_shrinkable_budget();
+        if (pressure) {
+            mem.pressure++;
+            mem_shrink(used / MEM_PRESSURE_SHRINK);
+        } else if (mem.budget && used > budget) {
+            mem.over++;
+            mem_shrink(used - budget);
+        }
+    }
+    return NULL;
+}
+
+int mem_init() {
+    char dir[PATH_MAX + 16];  // "/sys/fs/cgroup" and the path of /proc/self/cgroup
+    char path[PATH_MAX + 64];
+    mem_cgroup_dir(dir, sizeof(dir));
+    if (dir[0]) {
+        snprintf(path, sizeof(path), "%s/memory.pressure", dir);
+        mem.psi_fd = mem_psi_open(path);
+        snprintf(path, sizeof(path), "%s/memory.events", dir);
+        mem.events_fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (mem.events_fd >= 0) {
+            mem.high = mem_events_high();
+        }
+    }
+    if (mem.psi_fd < 0) {
+        mem.psi_fd = mem_psi_open("/proc/pressure/memory");
+    }
+    if (mem.psi_fd < 0 && mem.events_fd < 0) {
+        WARNING("no memory pressure notification, caches are only shrunk to the budget");
+        if (mem.budget == 0) {
+            return 0;
+        }
+    }
+
+    mem.stop_fd = eventfd(0, EFD_CLOEXEC);
+    if (mem.stop_fd < 0 || pthread_create(&mem.thread, NULL, mem_thread, NULL) != 0) {
+        ERR("fail to create memory watcher thread");
+        mem_exit();
+        return -1;
+    }
+    mem.running = 1;
+    INFO("memory watcher init, budget %lu KiB, psi %s, memory.events %s",
+         mem.budget >> 10,
+         mem.psi_fd >= 0 ? "on" : "off",
+         mem.events_fd >= 0 ? "on" : "off");
+    return 0;
+}
+
+void mem_exit() {
+    if (mem.running) {
+        uint64_t one = 1;
+        if (write(mem.stop_fd, &one, sizeof(one)) == sizeof(one)) {
+            pthread_join(mem.thread, NULL);
+        }
+        mem.running = 0;
+    }
+    int *fds[] = {&mem.stop_fd, &mem.psi_fd, &mem.events_fd};
+    for (int i = 0; i < 3; i++) {
+        if (*fds[i] >= 0) {
+            close(*fds[i]);
+            *fds[i] = -1;
+        }
+    }
+}
+
+int mem_status(char *buf) {
+    int buf_cnt = 0;
+    uint64_t used = mem_usage(0);
+    if (mem.budget) {
+        buf_cnt += sprintf(buf + buf_cnt, "  mem[used:budget]\t [%lu/%lu] KiB\n", used >> 10, mem.budget >> 10);
+    } else {
+        buf_cnt += sprintf(buf + buf_cnt, "  mem[used]\t\t %lu KiB, no budget\n", used >> 10);
+    }
+    buf_cnt += sprintf(buf + buf_cnt, "  mem[");
+    for (int i = 0; i < MEM_CACHES; i++) {
+        buf_cnt += sprintf(buf + buf_cnt, "%s:", mem_caches[i].name);
+    }
+    buf_cnt += sprintf(buf + buf_cnt, "bitmap]\t [");
+    for (int i = 0; i < MEM_CACHES; i++) {
+        buf_cnt += sprintf(buf + buf_cnt, "%lu/", mem_caches[i].usage() >> 10);
+    }
+    buf_cnt += sprintf(buf + buf_cnt, "%lu] KiB\n", bitmap_mem() >> 10);
+    buf_cnt += sprintf(buf + buf_cnt,
+                       "  mem[pressure:over budget:shrunk]\t [%lu/%lu/%lu KiB]\n",
+                       mem.pressure,
+                       mem.over,
+                       __atomic_load_n(&mem.shrunk, __ATOMIC_RELAXED) >> 10);
+    return buf_cnt;
+}
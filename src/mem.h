@@ -0,0 +1,49 @@
+#ifndef MEM_H
+#define MEM_H
+
+#include <stdint.h>
+
+#define MEM_CHECK_MS        1000                    // how often the usage is checked against the budget
+#define MEM_PRESSURE_SHRINK 4                       // a memory pressure event shrinks the caches by 1/4
+#define MEM_PSI_TRIGGER     "some 150000 1000000"  // stalled 150ms within 1s, see Documentation/accounting/psi
+
+// caches sharing the memory budget, see mem_share
+enum mem_cache { MEM_BCACHE, MEM_ICACHE, MEM_DECACHE, MEM_PCACHE, MEM_READAHEAD, MEM_CACHES };
+
+/**
+ * @brief set the memory budget of all the caches, must be called before the caches are configured
+ *
+ * @param budget bytes, 0 for no budget: every cache keeps its own bound
+ */
+void mem_config(uint64_t budget);
+
+/**
+ * @brief parse a size like 512M or 2G (K, M, G, T suffixes, powers of 1024)
+ *
+ * @return uint64_t bytes, 0 if s is not a size
+ */
+uint64_t mem_parse_size(const char *s);
+
+/**
+ * @brief bytes of the budget given to a cache, 0 if there is no budget
+ */
+uint64_t mem_share(enum mem_cache id);
+
+/**
+ * @brief start the thread that enforces the budget and listens to memory pressure (PSI), called after fuse
+ * daemonizes
+ */
+int mem_init();
+void mem_exit();
+
+/**
+ * @brief evict clean objects from every cache in proportion to its usage, then give the freed arena slabs
+ * back to the kernel
+ *
+ * @return uint64_t bytes freed
+ */
+uint64_t mem_shrink(uint64_t bytes);
+
+int mem_status(char *buf);
+
+#endif
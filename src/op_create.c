@@ -55,53 +55,15 @@ int op_create(const char *path, mode_t mode, struct fuse_file_info *fi) {
         return -ENOSPC;
     }
 
-    // check if the parent inode has empty space for a new dentry
-    struct ext4_dir_entry_2 *de = dentry_last(parent_inode, parent_idx);
-    if (de == NULL) {
-        ERR("fail to find the last dentry");
-        return -ENOENT;
+    // add a new dentry in the parent directory, in the first block with room for it
+    int err;
+    if ((err = dentry_add(parent_inode, parent_idx, inode_idx, file_name, inode_mode2type(mode))) < 0) {
+        ERR("fail to add dentry %s", file_name);
+        return err;
     }
 
-    // create a new dentry, and write back to disk
-    
-    if (dentry_has_enough_space(de, name_len) < 0) {
-        // FIXME: try to find a new block for dir
-        // TEST-CASE: [012]
-        INFO("across block boundary");
-        de->rec_len += sizeof(struct ext4_dir_entry_tail);
-        dcache_write_back();
-
-        uint64_t block_num = EXT4_INODE_GET_BLOCKS(parent_inode);
-        uint64_t next_lblock = dcache->lblock + 1;
-        if (block_num > next_lblock) {
-            dcache_load_lblock(parent_inode, next_lblock);
-            // create dentry tail
-            struct ext4_dir_entry_tail *de_tail =
-                (struct ext4_dir_entry_tail *)(dcache->buf + BLOCK_SIZE - EXT4_DE_TAIL_SIZE);
-            de_tail->det_reserved_zero1 = 0;
-            de_tail->det_rec_len = EXT4_DE_TAIL_SIZE;
-            de_tail->det_reserved_zero2 = 0;
-            de_tail->det_reserved_ft = EXT4_FT_DIR_CSUM;
-            de_tail->det_checksum = 0;  // TODO: checksum
-
-            de = (struct ext4_dir_entry_2 *)dcache->buf;
-            de->rec_len = BLOCK_SIZE - EXT4_DE_TAIL_SIZE;
-            de->inode_idx = inode_idx;
-            de->name_len = name_len;
-            de->file_type = inode_mode2type(mode);
-            memcpy(de->name, file_name, name_len);
-            de->name[name_len] = '\0';
-            dcache_write_back();
-            ICACHE_SET_LAST_DE(parent_inode, NULL);
-        } else {
-            ASSERT(0);
-        }
-    } else {
-        // create a new dentry in the parent directory
-        struct ext4_dir_entry_2 *new_de = dentry_create(de, file_name, inode_idx, inode_mode2type(mode));
-        ICACHE_SET_LAST_DE(parent_inode, new_de);
-        dcache_write_back();
-    }
+    // replaces a negative entry of the name, if any
+    decache_insert(parent_idx, file_name, name_len, inode_idx);
 
     // create a new inode
     struct ext4_inode *inode;
@@ -117,5 +79,9 @@ int op_create(const char *path, mode_t mode, struct fuse_file_info *fi) {
     // update gdt
     // gdt_update(inode_idx);
 
+    // create also opens the file, open() won't be called
+    if (fi) {
+        fi->fh = (uintptr_t)kfs_file_alloc(inode_idx);
+    }
     return 0;
 }
\ No newline at end of file
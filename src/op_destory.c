@@ -3,45 +3,55 @@
 #include <pthread.h>
 #include <stdlib.h>
 
+#include "arena.h"
 #include "bitmap.h"
 #include "cache.h"
+#include "compact.h"
 #include "disk.h"
 #include "ext4/ext4.h"
 #include "ext4/ext4_basic.h"
 #include "ext4/ext4_super.h"
 #include "inode.h"
 #include "logging.h"
+#include "mem.h"
 #include "ops.h"
+#include "readahead.h"
 
 extern struct dcache *dcache;
 extern struct icache *icache;
 extern struct bitmap i_bitmap;
 extern struct bitmap d_bitmap;
-extern struct decache_entry *root;
 extern pthread_t socket_thread_id;
 
 void op_destory(void *data) {
     DEBUG("ext4 fuse fs destory");
-    decache_free(root);
-    INFO("free root dentry done");
+    mem_exit();  // before the caches it shrinks are freed
+    readahead_exit();
+    compact_exit();  // before the inodes it compacts are written back
+    decache_exit();
+    pcache_exit();
+    INFO("free dentry cache done");
     // write back all the dirty bitmaps
     for (int i = 0; i < i_bitmap.group_num; i++) {
         if (i_bitmap.group[i].status == BITMAP_S_DIRTY) {
             INFO("write back dirty i_bitmap %d", i);
-            disk_write(i_bitmap.group[i].off, EXT4_INODES_PER_GROUP(sb) / 8, i_bitmap.group[i].bitmap);
+            disk_write_queued(i_bitmap.group[i].off, EXT4_INODES_PER_GROUP(sb) / 8, i_bitmap.group[i].bitmap);
         }
         if (d_bitmap.group[i].status == BITMAP_S_DIRTY) {
             INFO("write back dirty d_bitmap %d", i);
-            disk_write(d_bitmap.group[i].off, EXT4_BLOCKS_PER_GROUP(sb) / 8, d_bitmap.group[i].bitmap);
+            disk_write_queued(d_bitmap.group[i].off, EXT4_BLOCKS_PER_GROUP(sb) / 8, d_bitmap.group[i].bitmap);
         }
-        free(i_bitmap.group[i].bitmap);
-        free(d_bitmap.group[i].bitmap);
+        // bitmaps borrowed from the mapped image are released by disk_close
+        if (!disk_is_mapped(i_bitmap.group[i].bitmap))
+            arena_free(i_bitmap.group[i].bitmap);
+        if (!disk_is_mapped(d_bitmap.group[i].bitmap))
+            arena_free(d_bitmap.group[i].bitmap);
     }
     free(i_bitmap.group);
     free(d_bitmap.group);
     INFO("free inode & data bitmap done");
 
-    free(dcache);
+    dcache_exit();
     INFO("free dcache done");
 
     // write back all the dirty inodes
@@ -51,7 +61,11 @@ void op_destory(void *data) {
             icache_write_back(&icache->entries[i]);
         }
     }
+    // inodes are written back into their inode-table blocks in bcache
+    bcache_flush();
     free(icache->entries);
+    free(icache->hash);
+    pthread_mutex_destroy(&icache->lock);
     free(icache);
     INFO("free icache done");
 
@@ -62,17 +76,22 @@ void op_destory(void *data) {
         if (EXT4_GDT_DIRTY_FLAG(&gdt[i]) == EXT4_GDT_DIRTY) {
             INFO("write back dirty group descriptor %d", i);
             EXT4_GDT_SET_CLEAN(&gdt[i]);  // set it as clean before write back to disk
-            disk_write(bg_off + i * EXT4_DESC_SIZE(sb), EXT4_DESC_SIZE(sb), &gdt[i]);
+            disk_write_queued(bg_off + i * EXT4_DESC_SIZE(sb), EXT4_DESC_SIZE(sb), &gdt[i]);
         }
     }
     free(gdt);
     INFO("free group descriptors done");
 
-    disk_write(BOOT_SECTOR_SIZE, sizeof(struct ext4_super_block), &sb);
+    disk_write_queued(BOOT_SECTOR_SIZE, sizeof(struct ext4_super_block), &sb);
     INFO("write back super block done");
     INFO("ext4 fuse fs destory done");
 
     pthread_cancel(socket_thread_id);
     pthread_join(socket_thread_id, NULL);
-    disk_close();
+    // writes the queued metadata out and flushes the backend
+    if (disk_close() < 0) {
+        ERR("fail to flush the disk");
+    }
+    bcache_exit();
+    arena_exit();
 }
\ No newline at end of file
@@ -33,6 +33,11 @@ int op_flush(const char *path, struct fuse_file_info *fi) {
         dcache_write_back();
     }
 
+    // metadata writes above are only queued, write them out in disk order
+    if (bcache_flush() < 0 || disk_flush() < 0) {
+        return -EIO;
+    }
+
     DEBUG("finish flush");
     return 0;
 }
\ No newline at end of file
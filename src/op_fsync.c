@@ -0,0 +1,18 @@
+#include "disk.h"
+#include "logging.h"
+#include "ops.h"
+
+int op_fsync(const char *path, int isdatasync, struct fuse_file_info *fi) {
+    DEBUG("fsync path %s", path);
+    UNUSED(isdatasync);
+
+    // op_flush writes the inode and the metadata out, only the backend is left to make durable
+    int ret = op_flush(path, fi);
+    if (ret < 0) {
+        return ret;
+    }
+    if (disk_sync() < 0) {
+        return -EIO;
+    }
+    return 0;
+}
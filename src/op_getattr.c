@@ -19,6 +19,36 @@
 #include "logging.h"
 #include "ops.h"
 
+void getattr_inode(struct ext4_inode *inode, uint32_t inode_idx, struct stat *st) {
+    memset(st, 0, sizeof(struct stat));  // clear the struct
+    // get umask
+    struct fuse_context *cntx = fuse_get_context();
+    mode_t umask_val = cntx ? cntx->umask : 022;
+
+    st->st_mode = inode->i_mode & ~umask_val;
+    st->st_nlink = inode->i_links_count;
+    st->st_size = EXT4_INODE_GET_SIZE(inode);
+    // The 'st_ino' field is ignored except if the 'use_ino' mount option is given
+    st->st_ino = inode_idx;
+
+    // Lower 32-bits of "block" count. If the huge_file feature flag is not set on the filesystem, the file consumes
+    // i_blocks_lo 512-byte blocks on disk. If huge_file is set and EXT4_HUGE_FILE_FL is NOT set in inode.i_flags, then
+    // the file consumes i_blocks_lo + (i_blocks_hi << 32) 512-byte blocks on disk. If huge_file is set and
+    // EXT4_HUGE_FILE_FL IS set in inode.i_flags, then this file consumes (i_blocks_lo + i_blocks_hi << 32) filesystem
+    // blocks on disk.
+    if (!(sb.s_flags & EXT4_HUGE_FILE_FL)) {
+        st->st_blocks = inode->i_blocks_lo;
+    } else {
+        st->st_blocks = inode->i_blocks_lo + (((uint64_t)inode->osd2.linux2.l_i_blocks_high) << 32);
+    }
+    st->st_uid = EXT4_INODE_GET_UID(inode);
+    st->st_gid = EXT4_INODE_GET_GID(inode);
+    st->st_atime = inode->i_atime;
+    st->st_mtime = inode->i_mtime;
+    st->st_ctime = inode->i_ctime;
+    st->st_blksize = BLOCK_SIZE;
+}
+
 /** Get file attributes.
  *
  * Similar to stat().  The 'st_dev' and 'st_blksize' fields are
@@ -39,39 +69,11 @@ int op_getattr(const char *path, struct stat *stbuf, struct fuse_file_info *fi)
 
     struct ext4_inode *inode;
     uint32_t inode_idx;
-    memset(stbuf, 0, sizeof(struct stat));  // clear the struct
     if (inode_get_by_path(path, &inode, &inode_idx) < 0) {
         DEBUG("fail to get inode %s", path);
         return -ENOENT;
     }
 
-    // get umask
-    struct fuse_context *cntx = fuse_get_context();
-    mode_t umask_val = cntx ? cntx->umask : 022;
-
-    stbuf->st_mode = inode->i_mode & ~umask_val;
-    stbuf->st_nlink = inode->i_links_count;
-    stbuf->st_size = EXT4_INODE_GET_SIZE(inode);
-    // The 'st_ino' field is ignored except if the 'use_ino' mount option is given
-    stbuf->st_ino = inode_idx;
-
-    // Lower 32-bits of "block" count. If the huge_file feature flag is not set on the filesystem, the file consumes
-    // i_blocks_lo 512-byte blocks on disk. If huge_file is set and EXT4_HUGE_FILE_FL is NOT set in inode.i_flags, then
-    // the file consumes i_blocks_lo + (i_blocks_hi << 32) 512-byte blocks on disk. If huge_file is set and
-    // EXT4_HUGE_FILE_FL IS set in inode.i_flags, then this file consumes (i_blocks_lo + i_blocks_hi << 32) filesystem
-    // blocks on disk.
-    if (!(sb.s_flags & EXT4_HUGE_FILE_FL)) {
-        stbuf->st_blocks = inode->i_blocks_lo;
-    } else {
-        stbuf->st_blocks = inode->i_blocks_lo + (((uint64_t)inode->osd2.linux2.l_i_blocks_high) << 32);
-    }
-    stbuf->st_uid = EXT4_INODE_GET_UID(inode);
-    stbuf->st_gid = EXT4_INODE_GET_GID(inode);
-    stbuf->st_atime = inode->i_atime;
-    stbuf->st_mtime = inode->i_mtime;
-    stbuf->st_ctime = inode->i_ctime;
-    stbuf->st_blksize = BLOCK_SIZE;
-
-    ICACHE_LRU_INC(inode);
+    getattr_inode(inode, inode_idx, stbuf);
     return 0;
 }
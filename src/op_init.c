@@ -13,15 +13,19 @@
 #include <pthread.h>
 
 #include "ctl.h"
+#include "arena.h"
 #include "bitmap.h"
 #include "cache.h"
+#include "compact.h"
 #include "disk.h"
 #include "ext4/ext4.h"
 #include "ext4/ext4_basic.h"
 #include "ext4/ext4_super.h"
 #include "inode.h"
 #include "logging.h"
+#include "mem.h"
 #include "ops.h"
+#include "readahead.h"
 
 unsigned fuse_capable;
 
@@ -72,12 +76,20 @@ int super_group_fill(void) {
 void *op_init(struct fuse_conn_info *info, struct fuse_config *cfg) {
     INFO("Using FUSE protocol %d.%d", info->proto_major, info->proto_minor);
     cfg->kernel_cache = 1;  // Enable kernel cache
+    // failed lookups are also cached by the kernel, our own ops invalidate its negative dentries
+    cfg->negative_timeout = decache_negative_timeout();
     fuse_capable = info->capable;
+    // readdir fills the attributes of the dentries, the kernel asks for them when lookups follow a listing
+    info->want |= info->capable & (FUSE_CAP_READDIRPLUS | FUSE_CAP_READDIRPLUS_AUTO);
     // Initialize the super block
     super_fill();        // superblock
     super_group_fill();  // group descriptors
+    arena_init();        // before anything allocates block buffers
     bitmap_init();
     cache_init();
+    readahead_init();
+    compact_init();
+    mem_init();
 
     
     // Create a thread for network listening
@@ -45,15 +45,13 @@ int op_link(const char *from, const char *to) {
         return -ENOENT;
     }
 
-    struct ext4_dir_entry_2 *last_de = dentry_last(to_dir_inode, to_dir_inode_idx);
     char *name = strrchr(to, '/') + 1;
     uint64_t name_len = strlen(name);
-    if (dentry_has_enough_space(last_de, name_len) < 0) {
-        ERR("No space for new dentry");
-        return -ENOSPC;
+    int err;
+    if ((err = dentry_add(to_dir_inode, to_dir_inode_idx, inode_idx, name, inode_mode2type(inode->i_mode))) < 0) {
+        ERR("fail to add dentry %s", name);
+        return err;
     }
-    struct ext4_dir_entry_2 *new_de = dentry_create(last_de, name, inode_idx, inode_mode2type(inode->i_mode));
-    dcache_write_back();
-    ICACHE_SET_LAST_DE(to_dir_inode, new_de);
+    decache_insert(to_dir_inode_idx, name, name_len, inode_idx);
     return 0;
 }
\ No newline at end of file
@@ -46,27 +46,15 @@ int op_mkdir(const char *path, mode_t mode) {
         return -ENOSPC;
     }
 
-    // check if the parent dentry has empty space for a new dentry
-    struct ext4_dir_entry_2 *de = dentry_last(parent_inode, parent_idx);
-    if (de == NULL) {
-        ERR("parent inode has no dentry");
-        return -ENOENT;
-    }
-
-    // create a new dentry, and write back to disk
+    // create a new dentry in the parent directory, and write back to disk
     char *dir_name = strrchr(path, '/') + 1;
     uint64_t name_len = strlen(dir_name);
-    if (dentry_has_enough_space(de, name_len) < 0) {
-        // FIXME: try to find a new block for dir
-        // TEST-CASE: [012]
-        ERR("No space for new dentry");
-        return -ENOSPC;
+    int err;
+    if ((err = dentry_add(parent_inode, parent_idx, dir_idx, dir_name, inode_mode2type(mode))) < 0) {
+        ERR("fail to add dentry %s", dir_name);
+        return err;
     }
-
-    // create a new dentry in the parent directory
-    struct ext4_dir_entry_2 *new_de = dentry_create(de, dir_name, dir_idx, inode_mode2type(mode));
-    ICACHE_SET_LAST_DE(parent_inode, new_de);
-    dcache_write_back();
+    decache_insert(parent_idx, dir_name, name_len, dir_idx);
 
     // set parent inode link count + 1 because ..
     parent_inode->i_links_count++;
@@ -88,9 +76,9 @@ int op_mkdir(const char *path, mode_t mode) {
     gdt_update(dir_idx);
 
     // add . and .. for the new dentry
-    dentry_init(parent_idx, dir_idx);
+    dentry_init(parent_idx, dir_idx, dir_pblock_idx);
     INFO("add . and .. for the new dentry");
-    disk_write_block(dir_pblock_idx, dcache->buf);
+    dcache_write_back();
     INFO("write back . and .. for the new dentry to disk");
     return 0;
 }
\ No newline at end of file
@@ -16,6 +16,7 @@
 #include "ext4/ext4_inode.h"
 #include "inode.h"
 #include "logging.h"
+#include "ops.h"
 
 int op_open(const char *path, struct fuse_file_info *fi) {
     DEBUG("open %s with flags %o", path, fi->flags);
@@ -38,8 +39,14 @@ int op_open(const char *path, struct fuse_file_info *fi) {
         return -EACCES;
     }
 
-    fi->fh = inode_idx;
-    DEBUG("%s is inode %d", path, fi->fh);
+    fi->fh = (uintptr_t)kfs_file_alloc(inode_idx);
+    DEBUG("%s is inode %d", path, inode_idx);
 
     return 0;
 }
+
+struct kfs_file *kfs_file_alloc(uint32_t inode_idx) {
+    struct kfs_file *file = calloc(1, sizeof(struct kfs_file));
+    file->fh = (struct kfs_fh){inode_idx, KFS_FH_FILE};
+    return file;
+}
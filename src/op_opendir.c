@@ -0,0 +1,119 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "cache.h"
+#include "common.h"
+#include "dentry.h"
+#include "inode.h"
+#include "logging.h"
+#include "ops.h"
+
+#define KFS_DIR_MIN_CAP 64  // dentries of the first allocation of a listing
+
+// make room for one more dentry and its name
+static int kfs_dir_reserve(struct kfs_dir *dir, uint32_t name_len) {
+    if (dir->cnt == dir->cap) {
+        uint32_t cap = dir->cap ? dir->cap * 2 : KFS_DIR_MIN_CAP;
+        uint32_t *inode_idxs = realloc(dir->inode_idxs, cap * sizeof(uint32_t));
+        if (inode_idxs == NULL) {
+            return -ENOMEM;
+        }
+        dir->inode_idxs = inode_idxs;
+        uint32_t *name_offs = realloc(dir->name_offs, cap * sizeof(uint32_t));
+        if (name_offs == NULL) {
+            return -ENOMEM;
+        }
+        dir->name_offs = name_offs;
+        uint8_t *file_types = realloc(dir->file_types, cap * sizeof(uint8_t));
+        if (file_types == NULL) {
+            return -ENOMEM;
+        }
+        dir->file_types = file_types;
+        dir->cap = cap;
+    }
+    if (dir->names_len + name_len + 1 > dir->names_cap) {
+        uint32_t names_cap = dir->names_cap ? dir->names_cap * 2 : KFS_DIR_MIN_CAP * 16;
+        while (dir->names_len + name_len + 1 > names_cap) {
+            names_cap *= 2;
+        }
+        char *names = realloc(dir->names, names_cap);
+        if (names == NULL) {
+            return -ENOMEM;
+        }
+        dir->names = names;
+        dir->names_cap = names_cap;
+    }
+    return 0;
+}
+
+int kfs_dir_load(struct kfs_dir *dir) {
+    struct ext4_inode *inode;
+    if (inode_get_by_number(dir->fh.inode_idx, &inode) < 0) {
+        return -ENOENT;
+    }
+    dir->cnt = 0;
+    dir->names_len = 0;
+    dir->streamed = 0;
+
+    struct ext4_dir_entry_2 *de;
+    uint64_t offset = 0;
+    dcache_init(inode, dir->fh.inode_idx);
+    while ((de = dentry_next(inode, dir->fh.inode_idx, offset))) {
+        offset = DE_NEXT_OFFSET(de, offset);
+        if (de->inode_idx == 0 || de->name_len == 0) {
+            // unused dentry or the ext4_dir_entry_tail of a block
+            continue;
+        }
+        if (kfs_dir_reserve(dir, de->name_len) < 0) {
+            ERR("no memory for the listing of inode %u", dir->fh.inode_idx);
+            return -ENOMEM;
+        }
+        dir->inode_idxs[dir->cnt] = de->inode_idx;
+        dir->name_offs[dir->cnt] = dir->names_len;
+        dir->file_types[dir->cnt] = de->file_type <= EXT4_FT_SYMLINK ? de->file_type : EXT4_FT_UNKNOWN;
+        memcpy(dir->names + dir->names_len, de->name, de->name_len);
+        dir->names_len += de->name_len;
+        dir->names[dir->names_len++] = '\0';
+        dir->cnt++;
+    }
+    DEBUG("listing of inode %u: %u dentries, %u bytes of names", dir->fh.inode_idx, dir->cnt, dir->names_len);
+    return 0;
+}
+
+void kfs_dir_free(struct kfs_dir *dir) {
+    free(dir->inode_idxs);
+    free(dir->name_offs);
+    free(dir->file_types);
+    free(dir->names);
+    memset(dir, 0, sizeof(struct kfs_dir));
+}
+
+int op_opendir(const char *path, struct fuse_file_info *fi) {
+    DEBUG("opendir %s", path);
+
+    struct ext4_inode *inode;
+    uint32_t inode_idx;
+    if (inode_get_by_path(path, &inode, &inode_idx) < 0) {
+        DEBUG("fail to get inode %s", path);
+        return -ENOENT;
+    }
+    if (!S_ISDIR(inode->i_mode)) {
+        return -ENOTDIR;
+    }
+
+    struct kfs_dir *dir = calloc(1, sizeof(struct kfs_dir));
+    if (dir == NULL) {
+        return -ENOMEM;
+    }
+    dir->fh = (struct kfs_fh){inode_idx, KFS_FH_DIR};
+    int ret = kfs_dir_load(dir);
+    if (ret < 0) {
+        kfs_dir_free(dir);
+        free(dir);
+        return ret;
+    }
+    fi->fh = (uintptr_t)dir;
+    return 0;
+}
@@ -49,16 +49,57 @@ static size_t truncate_size(struct ext4_inode *inode, size_t size, size_t offset
     return size;
 }
 
+// segments of one op_read, submitted together by disk_readv
+struct read_batch {
+    struct disk_iovec iov[DISK_BATCH_MAX];
+    int cnt;
+};
+
+static void read_batch_add(struct read_batch *batch, off_t where, size_t size, char *p) {
+    struct disk_iovec *last = batch->cnt ? &batch->iov[batch->cnt - 1] : NULL;
+    if (last && last->where + (off_t)last->size == where && (char *)last->p + last->size == p) {
+        last->size += size;
+        return;
+    }
+    if (batch->cnt == DISK_BATCH_MAX) {
+        disk_readv(batch->iov, batch->cnt);
+        batch->cnt = 0;
+    }
+    batch->iov[batch->cnt++] = (struct disk_iovec){where, size, p};
+}
+
+/**
+ * @brief read size bytes starting from byte off of pblock, the blocks prefetched by readahead are
+ * copied from memory, the rest are added to batch
+ */
+static void read_pblocks(struct read_batch *batch, uint64_t pblock, uint32_t off, size_t size, char *buf) {
+    if (!readahead_enabled()) {
+        read_batch_add(batch, BLOCKS2BYTES(pblock) + off, size, buf);
+        return;
+    }
+    while (size) {
+        size_t len = BLOCK_SIZE - off < size ? BLOCK_SIZE - off : size;
+        if (racache_read(pblock, off, len, buf) < 0) {
+            read_batch_add(batch, BLOCKS2BYTES(pblock) + off, len, buf);
+        }
+        pblock++;
+        off = 0;
+        buf += len;
+        size -= len;
+    }
+}
+
 /**
- * @brief read the first block, make sure align to BLOCK SIZE
+ * @brief read the first block, make sure the rest of the read is aligned to BLOCK SIZE
  *
  * @param inode
+ * @param batch
  * @param buf
  * @param size
  * @param offset
- * @return size_t read bytes
+ * @return size_t bytes read
  */
-static size_t first_read(struct ext4_inode *inode, char *buf, size_t size, off_t offset) {
+static size_t first_read(struct ext4_inode *inode, struct read_batch *batch, char *buf, size_t size, off_t offset) {
     uint32_t start_lblock = offset / BLOCK_SIZE;
     /* Reason for the -1 is that offset = 0 and size = BLOCK_SIZE is all on the
      * same block.  Meaning that byte at offset + size is not actually read. */
@@ -72,18 +113,19 @@ static size_t first_read(struct ext4_inode *inode, char *buf, size_t size, off_t
           start_block_off,
           start_pblock);
 
+    size_t first_size;
     if (start_lblock == end_lblock) {
         // only one block to read, finished
-        disk_read(BLOCKS2BYTES(start_pblock) + start_block_off, size, buf);
-        return size;
+        first_size = size;
     } else {
         // more than one block to read, read the first part of the first block if offset is not aligned
-        size_t size_to_block_end = ALIGN_TO_BLOCKSIZE(offset) - offset;
-        ASSERT((offset + size_to_block_end) % BLOCK_SIZE == 0);
-
-        disk_read(BLOCKS2BYTES(start_pblock) + start_block_off, size_to_block_end, buf);
-        return size_to_block_end;
+        first_size = ALIGN_TO_BLOCKSIZE(offset) - offset;
+        ASSERT((offset + first_size) % BLOCK_SIZE == 0);
+    }
+    if (first_size) {
+        read_pblocks(batch, start_pblock, start_block_off, first_size, buf);
     }
+    return first_size;
 }
 
 /** Read data from an open file
@@ -112,9 +154,10 @@ int op_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_
     //     return size;
     // }
 
-    if (fi && fi->fh > 0) {
-        if (inode_get_by_number(fi->fh, &inode) < 0) {
-            DEBUG("fail to get inode %d", fi->fh);
+    struct kfs_file *file = KFS_FILE(fi);
+    if (file) {
+        if (inode_get_by_number(file->fh.inode_idx, &inode) < 0) {
+            DEBUG("fail to get inode %d", file->fh.inode_idx);
             return -ENOENT;
         }
     } else {
@@ -133,16 +176,17 @@ int op_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_
         DEBUG("file is empty, return 0");
         return 0;
     }
-    ret = first_read(inode, buf, size, un_offset);
+
+    // all the extents of this request are collected into one vectored read, see disk_readv
+    struct read_batch batch;
+    batch.cnt = 0;
+
+    ret = first_read(inode, &batch, buf, size, un_offset);
     INFO("first read %d bytes", ret);
-    if (ret == size) {
-        // all bytes read
-        return ret;
-    }
 
     buf += ret;
     un_offset += ret;
-    ASSERT(un_offset % BLOCK_SIZE == 0);  // after first read, un_offset should be block aligned
+    ASSERT(ret == size || un_offset % BLOCK_SIZE == 0);  // after first read, un_offset should be block aligned
     INFO("left to read %d bytes from offset %d", size - ret, un_offset);
 
     uint32_t extent_len;
@@ -159,11 +203,22 @@ int op_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_
             INFO("last read %d bytes", read_bytes);
         }
 
-        ret += disk_read(BLOCKS2BYTES(pblock), read_bytes, buf);
+        read_pblocks(&batch, pblock, 0, read_bytes, buf);
+
+        ret += read_bytes;
         buf += read_bytes;
         DEBUG("Read %zd/%zd bytes from %d consecutive blocks", ret, size, extent_len);
     }
 
+    if (batch.cnt) {
+        disk_readv(batch.iov, batch.cnt);
+    }
+
+    // prefetch the next window if the stream is sequential
+    if (file) {
+        readahead_update(&file->ra, inode, offset, size);
+    }
+
     /* We always read as many bytes as requested (after initial truncation) */
     ASSERT(size == ret);
     return ret;
@@ -8,55 +8,108 @@
  */
 
 #include <string.h>
+#include <sys/stat.h>
 
 #include "cache.h"
 #include "common.h"
-#include "dentry.h"
+#include "inode.h"
 #include "logging.h"
 #include "ops.h"
 
-extern struct dcache *dcache;
+#define READDIR_PLUS_BATCH 64  // dentries whose inodes are loaded together for READDIRPLUS
 
-static char *get_printable_name(char *s, struct ext4_dir_entry_2 *entry) {
-    memcpy(s, entry->name, entry->name_len);
-    s[entry->name_len] = 0;
-    return s;
+// file type of a dentry as st_mode, enough for the kernel to fill d_type
+static const mode_t readdir_ft_mode[] = {
+    [EXT4_FT_UNKNOWN] = 0,
+    [EXT4_FT_REG_FILE] = S_IFREG,
+    [EXT4_FT_DIR] = S_IFDIR,
+    [EXT4_FT_CHRDEV] = S_IFCHR,
+    [EXT4_FT_BLKDEV] = S_IFBLK,
+    [EXT4_FT_FIFO] = S_IFIFO,
+    [EXT4_FT_SOCK] = S_IFSOCK,
+    [EXT4_FT_SYMLINK] = S_IFLNK,
+};
+
+static void readdir_fill_type(struct kfs_dir *dir, uint32_t i, struct stat *st) {
+    memset(st, 0, sizeof(struct stat));
+    st->st_ino = dir->inode_idxs[i];
+    // file_type comes from disk, a type this table doesn't know is reported as unknown
+    uint8_t ft = dir->file_types[i] < ARRAY_SIZE(readdir_ft_mode) ? dir->file_types[i] : EXT4_FT_UNKNOWN;
+    st->st_mode = readdir_ft_mode[ft];
 }
 
-int op_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi,
-               enum fuse_readdir_flags flags) {
-    DEBUG("readdir path %s offset %d", path, offset);
+// pass the names from the dentry at first on, their inodes are prefetched for the lookups that usually follow
+static void readdir_names(struct kfs_dir *dir, void *buf, fuse_fill_dir_t filler, uint32_t first) {
+    struct stat st;
+    uint32_t i;
+    for (i = first; i < dir->cnt; i++) {
+        readdir_fill_type(dir, i, &st);
+        if (filler(buf, dir->names + dir->name_offs[i], &st, i + 1, 0) != 0)
+            break;
+    }
+    icache_prefetch(dir->inode_idxs + first, i - first);
+}
 
-    UNUSED(fi);
-    char name_buf[EXT4_NAME_LEN + 1];
-    struct ext4_dir_entry_2 *de = NULL;
+/**
+ * @brief pass the names from the dentry at first on with their attributes, so that the kernel doesn't have to look
+ * them up one by one. The inodes are loaded in batches with one prefetch of their inode-table blocks
+ */
+static void readdir_plus(struct kfs_dir *dir, void *buf, fuse_fill_dir_t filler, uint32_t first) {
+    struct stat st;
     struct ext4_inode *inode;
-
-    /* We can use inode_get_by_number, but first we need to implement opendir */
-    uint32_t inode_idx;
-    if (inode_get_by_path(path, &inode, &inode_idx) < 0) {
-        DEBUG("fail to get inode %s", path);
-        return -ENOENT;
+    for (uint32_t batch = first; batch < dir->cnt; batch += READDIR_PLUS_BATCH) {
+        uint32_t end = batch + READDIR_PLUS_BATCH < dir->cnt ? batch + READDIR_PLUS_BATCH : dir->cnt;
+        icache_prefetch(dir->inode_idxs + batch, end - batch);
+        for (uint32_t i = batch; i < end; i++) {
+            const char *name = dir->names + dir->name_offs[i];
+            if (inode_get_by_number(dir->inode_idxs[i], &inode) < 0) {
+                // the type only, the kernel looks it up
+                readdir_fill_type(dir, i, &st);
+                if (filler(buf, name, &st, i + 1, 0) != 0)
+                    return;
+                continue;
+            }
+            getattr_inode(inode, dir->inode_idxs[i], &st);
+            if (filler(buf, name, &st, i + 1, FUSE_FILL_DIR_PLUS) != 0)
+                return;
+        }
     }
+}
 
-    dcache_init(inode, inode_idx);
-    while ((de = dentry_next(inode, inode_idx, offset))) {
-        offset += de->rec_len;
+int op_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi,
+               enum fuse_readdir_flags flags) {
+    DEBUG("readdir path %s offset %d", path, offset);
 
-        if (de->inode_idx == 0 && de->name_len == 0) {
-            // reach the ext4_dir_entry_tail
-            ASSERT(((struct ext4_dir_entry_tail *)de)->det_reserved_ft == EXT4_FT_DIR_CSUM);
-            INFO("inode %u last dentry", inode_idx);
-            break;
-        }
-        DEBUG("pass dentry %s[%u:%u]", de->name, de->inode_idx, de->rec_len);
-        /* Providing offset to the filler function seems slower... */
-        get_printable_name(name_buf, de);
-        if (name_buf[0]) {
-            if (filler(buf, name_buf, NULL, offset, 0) != 0)
-                break;
+    struct kfs_dir *dir = KFS_DIR(fi);
+    struct kfs_dir once = {.fh.type = KFS_FH_DIR};
+    int ret = 0;
+    if (dir == NULL) {
+        // not opened by op_opendir, list the directory for this call only
+        struct ext4_inode *inode;
+        if (inode_get_by_path(path, &inode, &once.fh.inode_idx) < 0) {
+            DEBUG("fail to get inode %s", path);
+            return -ENOENT;
         }
+        dir = &once;
+        ret = kfs_dir_load(dir);
+    } else if (offset == 0 && dir->streamed) {
+        // rewinddir, the dentries added or removed since opendir must show up
+        ret = kfs_dir_load(dir);
+    }
+    if (ret < 0) {
+        kfs_dir_free(&once);
+        return ret;
     }
+    dir->streamed = 1;
 
+    // the cookie is the index of the next dentry, anything past the listing is the end of the directory
+    if (offset >= 0 && (uint64_t)offset < dir->cnt) {
+        if (flags & FUSE_READDIR_PLUS) {
+            readdir_plus(dir, buf, filler, offset);
+        } else {
+            readdir_names(dir, buf, filler, offset);
+        }
+    }
+    kfs_dir_free(&once);
     return 0;
 }
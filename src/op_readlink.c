@@ -13,6 +13,7 @@
 #include <string.h>
 #include <sys/stat.h>
 
+#include "arena.h"
 #include "common.h"
 #include "disk.h"
 #include "ext4/ext4.h"
@@ -37,10 +38,14 @@ static int get_link_dest(struct ext4_inode *inode, char *buf, size_t bufsize) {
             DEBUG("inode size %lu >= bufsize %lu, need to truncate", inode_size, bufsize);
         }
         uint64_t pblock = inode_get_data_pblock(inode, 0, NULL);
-        char *block_data = malloc(EXT4_BLOCK_SIZE(sb));
-        disk_read_block(pblock, (uint8_t *)block_data);
+        char *block_data = disk_map_block(pblock);
+        if (block_data == NULL) {
+            block_data = arena_alloc(EXT4_BLOCK_SIZE(sb));
+            disk_read_block(pblock, (uint8_t *)block_data);
+        }
         strncpy(buf, block_data, bufsize - 1);
-        free(block_data);
+        if (!disk_is_mapped(block_data))
+            arena_free(block_data);
     }
 
     buf[inode_size] = 0;
@@ -1,5 +1,6 @@
 
 #include <stddef.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/types.h>
 
@@ -16,5 +17,7 @@
 
 int op_release(const char *path, struct fuse_file_info *fi) {
     DEBUG("release %s", path);
+    free(KFS_FILE(fi));
+    fi->fh = 0;
     return 0;
 }
\ No newline at end of file
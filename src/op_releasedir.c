@@ -0,0 +1,16 @@
+#include <stdlib.h>
+
+#include "common.h"
+#include "logging.h"
+#include "ops.h"
+
+int op_releasedir(const char *path, struct fuse_file_info *fi) {
+    DEBUG("releasedir %s", path);
+    struct kfs_dir *dir = KFS_DIR(fi);
+    if (dir) {
+        kfs_dir_free(dir);
+        free(dir);
+        fi->fh = 0;
+    }
+    return 0;
+}
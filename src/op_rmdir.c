@@ -36,6 +36,7 @@ int op_rmdir(const char *path) {
         struct pblock_arr p_arr;
         inode_get_all_pblocks(inode, &p_arr);
         bitmap_pblock_free(&p_arr);
+        extent_map_drop(&ICACHE_EXTENT_MAP(inode));
         ICACHE_SET_INVAL(inode);
     } else {
         ICACHE_SET_DIRTY(inode);
@@ -48,12 +49,14 @@ int op_rmdir(const char *path) {
         DEBUG("fail to get dir inode %s", path);
         return -ENOENT;
     }
-    if (dentry_delete(d_inode, d_inode_idx, strrchr(path, '/') + 1) < 0) {
-        ERR("fail to delete dentry %s", strrchr(path, '/') + 1);
+    char *name = strrchr(path, '/') + 1;
+    if (dentry_delete(d_inode, d_inode_idx, name) < 0) {
+        ERR("fail to delete dentry %s", name);
         return -ENOENT;
     }
     dcache_write_back();
-    decache_delete(path);
+    decache_delete(d_inode_idx, name, strlen(name));
+    pcache_dir_changed(d_inode_idx);
 
     DEBUG("rmdir %s done", path);
     return 0;
@@ -66,16 +66,13 @@ int op_symlink(const char *from, const char *to) {
         return -ENOENT;
     }
 
-    struct ext4_dir_entry_2 *last_de = dentry_last(to_dir_inode, to_dir_inode_idx);
     char *name = strrchr(to, '/') + 1;
     uint64_t name_len = strlen(name);
-    if (dentry_has_enough_space(last_de, name_len) < 0) {
-        ERR("No space for new dentry");
-        return -ENOSPC;
+    if ((err = dentry_add(to_dir_inode, to_dir_inode_idx, inode_idx, name, EXT4_FT_SYMLINK)) < 0) {
+        ERR("fail to add dentry %s", name);
+        return err;
     }
-    struct ext4_dir_entry_2 *new_de = dentry_create(last_de, name, inode_idx, EXT4_FT_SYMLINK);
-    ICACHE_SET_LAST_DE(inode, new_de);
-    dcache_write_back();
+    decache_insert(to_dir_inode_idx, name, name_len, inode_idx);
 
     return 0;
 }
\ No newline at end of file
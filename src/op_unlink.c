@@ -30,6 +30,7 @@ int unlink_inode(struct ext4_inode *inode, uint32_t inode_idx) {
             struct pblock_arr p_arr;
             inode_get_all_pblocks(inode, &p_arr);
             bitmap_pblock_free(&p_arr);
+            extent_map_drop(&ICACHE_EXTENT_MAP(inode));
         }
 
         // write back dirty inode
@@ -74,7 +75,8 @@ int op_unlink(const char *path) {
     unlink_inode(inode, inode_idx);
 
     INFO("delete inode %s[%d] decache entry", name, inode_idx);
-    decache_delete(path);  // delete from decache
+    decache_delete(d_inode_idx, name, strlen(name));  // delete from decache
+    pcache_dir_changed(d_inode_idx);
 
     DEBUG("unlinked inode %d", inode_idx);
     return 0;
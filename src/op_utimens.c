@@ -39,8 +39,8 @@ int op_utimens(const char *path, const struct timespec tv[2], struct fuse_file_i
     struct ext4_inode *inode;
 
     uint32_t inode_idx;
-    if (fi && fi->fh) {
-        inode_idx = fi->fh;
+    if (KFS_FH(fi)) {
+        inode_idx = KFS_FH_INODE(fi);
     } else {
         inode_idx = inode_get_idx_by_path(path);
     }
@@ -61,7 +61,7 @@ int op_utimens(const char *path, const struct timespec tv[2], struct fuse_file_i
     // the inode do not need to be written back to disk for now
     // we just update it in cache(memory), and it will be written back to disk when:
     //
-    // - the icache_entry is replaced by a new inode (see icache_lru_replace)
+    // - the icache_entry is replaced by a new inode (see icache_victim)
     // - fsync is called
     // - fs is destroyed(unmount)
 
@@ -1,5 +1,7 @@
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/types.h>
 
@@ -14,6 +16,52 @@
 #include "logging.h"
 #include "ops.h"
 
+/*
+ * A write past the blocks of the file maps new chunks after its last extent with inode_grow, contiguous to
+ * it when the blocks there are free. A new block the write doesn't cover whole is zeroed first, so the gap
+ * before offset and the end of the last block never show what the disk held before.
+ */
+static int write_grow(struct ext4_inode *inode, uint32_t inode_idx, uint64_t lblock, off_t offset, size_t size) {
+    uint32_t end = extent_end(inode->i_block);
+    if (lblock < end) {
+        // extents are only appended, a hole can't be filled in the middle of the tree
+        ERR("lblock %lu of inode %u is a hole, it can not be filled", lblock, inode_idx);
+        return -EOPNOTSUPP;
+    }
+    uint64_t last = (offset + size - 1) / BLOCK_SIZE;
+    uint32_t chunks = (last + 1 - end + EXT4_INODE_PBLOCK_NUM - 1) / EXT4_INODE_PBLOCK_NUM;
+    int n = inode_grow(inode, inode_idx, end, chunks);
+    if (n < 0) {
+        ERR("no block left for inode %u at lblock %u", inode_idx, end);
+        return n;
+    }
+
+    char *zero = NULL;
+    for (uint64_t b = end; b < end + (uint64_t)n * EXT4_INODE_PBLOCK_NUM; b++) {
+        if (BLOCKS2BYTES(b) >= (uint64_t)offset && BLOCKS2BYTES(b + 1) <= offset + size) {
+            continue;
+        }
+        if (zero == NULL && (zero = calloc(1, BLOCK_SIZE)) == NULL) {
+            return -ENOMEM;
+        }
+        disk_write_block(inode_get_data_pblock(inode, b, NULL), zero);
+    }
+    free(zero);
+    return 0;
+}
+
+// write the batch, then drop its blocks from the readahead cache: a prefetch that read them before the
+// write landed sees the gen bumped and is thrown away
+static int write_flush(struct disk_iovec *iov, int iov_cnt, size_t iov_bytes) {
+    if (disk_writev(iov, iov_cnt) != iov_bytes) {
+        return -EIO;
+    }
+    for (int i = 0; i < iov_cnt; i++) {
+        racache_invalidate(iov[i].where / BLOCK_SIZE, BYTES2BLOCKS(iov[i].where % BLOCK_SIZE + iov[i].size));
+    }
+    return 0;
+}
+
 /** Write data to an open file
  *
  * Write should return exactly the number of bytes requested
@@ -38,15 +86,13 @@ int op_write(const char *path, const char *buf, size_t size, off_t offset, struc
     //     return size;
     // }
 
-    int ret = 0;
-    size_t remain = size;
-
     struct ext4_inode *inode;
     uint32_t inode_idx;
 
-    if (fi && fi->fh > 0) {
-        if (inode_get_by_number(fi->fh, &inode) < 0) {
-            DEBUG("fail to get inode %d", fi->fh);
+    if (KFS_FH(fi)) {
+        inode_idx = KFS_FH_INODE(fi);
+        if (inode_get_by_number(inode_idx, &inode) < 0) {
+            DEBUG("fail to get inode %d", inode_idx);
             return -ENOENT;
         }
     } else {
@@ -62,53 +108,81 @@ int op_write(const char *path, const char *buf, size_t size, off_t offset, struc
         return -EACCES;
     }
 
-    uint64_t start_lblock = offset / BLOCK_SIZE;
-    uint64_t end_lblock = (offset + size - 1) / BLOCK_SIZE;
-    uint32_t start_block_off = offset % BLOCK_SIZE;
-
-    uint32_t extend_len = 0;
-
-    if (start_lblock == end_lblock) {
-        // only one block to write
-        uint64_t pblock_idx;
-        if (EXT4_INODE_GET_BLOCKS(inode) == 0) {
-            DEBUG("inode %d has no blocks", inode_idx);
-            pblock_idx = bitmap_pblock_find(inode_idx, EXT4_INODE_PBLOCK_NUM);
-            inode_init_pblock(inode, pblock_idx);
-        } else {
-            pblock_idx = inode_get_data_pblock(inode, start_lblock, &extend_len);
-        }
-        ret = disk_write(BLOCKS2BYTES(pblock_idx) + start_block_off, size, (void *)buf);
-        if (ret != size) {
-            return -EIO;
-        }
-        remain -= ret;
-    } else {
-        // FIXME : 读出数据与原始数据不一致
-        uint32_t extent_len = 0;
-        for (uint64_t lblock = start_lblock; lblock <= end_lblock; ++lblock) {
-            uint32_t block_off = (lblock == start_lblock) ? start_block_off : 0;
-            size_t block_size =
-                (lblock == end_lblock) ? (offset + size - (lblock * BLOCK_SIZE)) : (BLOCK_SIZE - block_off);
-
-            assert(block_size <= BLOCK_SIZE);
+    if (size == 0) {
+        return 0;
+    }
 
-            uint64_t pblock = extent_get_pblock(inode->i_block, lblock, &extent_len);
+    if (EXT4_INODE_GET_BLOCKS(inode) == 0) {
+        DEBUG("inode %d has no blocks", inode_idx);
+        uint64_t pblock_idx = bitmap_pblock_find(inode_idx, EXT4_INODE_PBLOCK_NUM);
+        if (pblock_idx == UINT64_MAX) {
+            return -ENOSPC;
+        }
+        inode_init_pblock(inode, pblock_idx);
+    }
 
-            ret = disk_write(BLOCKS2BYTES(pblock) + block_off, block_size, (void *)buf);
+    // all the extents of this request are collected into one vectored write, see disk_writev
+    struct disk_iovec iov[DISK_BATCH_MAX];
+    int iov_cnt = 0;
+    size_t iov_bytes = 0;
+    size_t ret = 0;
+
+    uint32_t extent_len;
+    uint64_t pblock;
+    size_t write_bytes;
+    int err = 0;
+    uint64_t lblock = offset / BLOCK_SIZE;
+    uint32_t block_off = offset % BLOCK_SIZE;
+    while (ret < size) {
+        pblock = inode_get_data_pblock(inode, lblock, &extent_len);
+        if (pblock == 0) {
+            if ((err = write_grow(inode, inode_idx, lblock, offset, size)) < 0) {
+                break;
+            }
+            pblock = inode_get_data_pblock(inode, lblock, &extent_len);
+            if (pblock == 0) {
+                // the disk or the extent tree filled up before this block
+                err = -ENOSPC;
+                break;
+            }
+        }
+        write_bytes = extent_len * BLOCK_SIZE - block_off;
+        if (size - ret < write_bytes) {
+            write_bytes = size - ret;
+        }
+        DEBUG("pblock %lu, extent_len %u, write %zu bytes", pblock, extent_len, write_bytes);
 
-            if (ret != block_size) {
+        if (iov_cnt == DISK_BATCH_MAX) {
+            if (write_flush(iov, iov_cnt, iov_bytes) < 0) {
                 return -EIO;
             }
-            remain -= ret;
-            buf += block_size;
+            iov_cnt = 0;
+            iov_bytes = 0;
         }
+        iov[iov_cnt].where = BLOCKS2BYTES(pblock) + block_off;
+        iov[iov_cnt].size = write_bytes;
+        iov[iov_cnt].p = (void *)(buf + ret);
+        iov_cnt++;
+        iov_bytes += write_bytes;
+
+        ret += write_bytes;
+        lblock += (block_off + write_bytes) / BLOCK_SIZE;
+        block_off = 0;
+    }
+
+    if (iov_cnt && write_flush(iov, iov_cnt, iov_bytes) < 0) {
+        return -EIO;
+    }
+    if (ret == 0) {
+        return err;
     }
 
-    EXT4_INODE_SET_SIZE(inode, (offset + size));
+    // only grow the file, writing in the middle must not truncate it
+    if (offset + ret > EXT4_INODE_GET_SIZE(inode)) {
+        EXT4_INODE_SET_SIZE(inode, (offset + ret));
+    }
     ICACHE_SET_DIRTY(inode);
     DEBUG("write done");
 
-    ASSERT(remain == 0);
     return ret;
 }
\ No newline at end of file
@@ -2,6 +2,52 @@
 #pragma once
 #include "common.h"
 #include "ext4/ext4.h"
+#include "readahead.h"
+
+#define KFS_FH_FILE 1
+#define KFS_FH_DIR  2
+
+// head of every handle stored in fi->fh, ops that take both files and directories only look at it
+struct kfs_fh {
+    uint32_t inode_idx;
+    uint8_t type;  // KFS_FH_FILE or KFS_FH_DIR
+};
+
+#define KFS_FH(__fi)       ((__fi) ? (struct kfs_fh *)(uintptr_t)(__fi)->fh : NULL)
+#define KFS_FH_INODE(__fi) (KFS_FH(__fi) ? KFS_FH(__fi)->inode_idx : 0)
+
+// per open file, stored in fi->fh by op_open/op_create and freed by op_release
+struct kfs_file {
+    struct kfs_fh fh;
+    struct readahead ra;  // sequential read detection
+};
+
+#define KFS_FILE(__fi) \
+    (KFS_FH(__fi) && KFS_FH(__fi)->type == KFS_FH_FILE ? (struct kfs_file *)KFS_FH(__fi) : NULL)
+
+// in op_open.c
+struct kfs_file *kfs_file_alloc(uint32_t inode_idx);
+
+// listing of an open directory, stored in fi->fh by op_opendir and freed by op_releasedir. The cookie of a
+// dentry is its index in the listing plus one, so it stays valid whatever happens to the directory
+struct kfs_dir {
+    struct kfs_fh fh;
+    int streamed;  // read since the listing was taken, a rewind takes a new one
+    uint32_t cnt;
+    uint32_t cap;
+    uint32_t *inode_idxs;  // inode of every dentry
+    uint32_t *name_offs;   // offset of the name of every dentry in names
+    uint8_t *file_types;   // EXT4_FT_* of every dentry
+    char *names;           // NUL terminated names
+    uint32_t names_len;
+    uint32_t names_cap;
+};
+
+#define KFS_DIR(__fi) (KFS_FH(__fi) && KFS_FH(__fi)->type == KFS_FH_DIR ? (struct kfs_dir *)KFS_FH(__fi) : NULL)
+
+// in op_opendir.c
+int kfs_dir_load(struct kfs_dir *dir);
+void kfs_dir_free(struct kfs_dir *dir);
 
 void *op_init(struct fuse_conn_info *info, struct fuse_config *cfg);
 int op_readlink(const char *path, char *buf, size_t bufsize);
@@ -27,6 +73,7 @@ int op_chmod(const char *, mode_t, struct fuse_file_info *fi);
 int op_chown(const char *path, uid_t uid, gid_t gid, struct fuse_file_info *fi);
 int op_truncate(const char *path, off_t size, struct fuse_file_info *fi);
 int op_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi);
+int op_opendir(const char *path, struct fuse_file_info *fi);
 int op_releasedir(const char *path, struct fuse_file_info *fi);
 int op_statfs(const char *path, struct statvfs *stbuf);
 int op_fsync(const char *path, int isdatasync, struct fuse_file_info *fi);
@@ -34,6 +81,8 @@ int op_lock(const char *path, struct fuse_file_info *fi, int cmd, struct flock *
 off_t op_lseek(const char *, off_t off, int whence, struct fuse_file_info *);
 int op_ioctl(const char *path, int cmd, void *arg, struct fuse_file_info *fi, unsigned int flags, void *data);
 
+// in op_getattr.c, fill st from a loaded inode
+void getattr_inode(struct ext4_inode *inode, uint32_t inode_idx, struct stat *st);
 // in op_unlink.c
 int unlink_inode(struct ext4_inode *inode, uint32_t inode_idx);
 // in ctl.c
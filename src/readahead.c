@@ -0,0 +1,295 @@
+#include "readahead.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "disk.h"
+#include "ext4/ext4.h"
+#include "inode.h"
+#include "logging.h"
+
+/*
+ * op_read feeds every read of an open file to readahead_update. A read starting where the last one ended
+ * is sequential, the window starts at RA_WINDOW_MIN blocks and doubles on every sequential read up to the
+ * max window, any other read resets it. The next window is mapped to pblocks in the caller (so the inode
+ * is never touched by another thread) and queued to a background thread, which reads the blocks into a
+ * direct-mapped cache keyed by pblock. op_read looks up that cache before going to the disk.
+ */
+
+struct ra_request {
+    uint64_t pblock;
+    uint32_t count;
+};
+
+struct racache_entry {
+    uint64_t pblock;
+    int valid;
+    int used;  // read by op_read at least once
+};
+
+static uint32_t ra_max_kb = RA_DEFAULT_KB;
+static uint32_t ra_max = 0;  // max window in blocks, 0 if readahead is disabled
+
+static struct {
+    pthread_mutex_t lock;
+    struct racache_entry *entries;
+    uint8_t *data;
+    uint32_t count;
+    uint64_t gen;  // bumped by every invalidation, prefetched data older than it is dropped
+} racache = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct ra_request reqs[RA_QUEUE_LEN];
+    uint32_t head;
+    uint32_t tail;
+    int stop;
+} ra_queue = {.lock = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER};
+
+static struct {
+    uint64_t hit;       // blocks served from the cache
+    uint64_t miss;      // blocks read from disk by op_read
+    uint64_t prefetch;  // blocks read by the readahead thread
+    uint64_t dropped;   // prefetch requests dropped because the queue is full
+    uint64_t unused;    // prefetched blocks evicted before being read
+    uint32_t window;    // largest window reached
+} ra_stat;
+
+static pthread_t ra_thread_id;
+
+void readahead_config(uint32_t max_kb) {
+    ra_max_kb = max_kb;
+}
+
+int readahead_enabled() {
+    return ra_max != 0;
+}
+
+static void racache_insert(uint64_t pblock, uint32_t count, uint8_t *buf, uint64_t gen) {
+    pthread_mutex_lock(&racache.lock);
+    if (gen != racache.gen) {
+        // some blocks were written while we were reading, the data may be stale
+        DEBUG("drop prefetched pblock %lu +%u", pblock, count);
+        pthread_mutex_unlock(&racache.lock);
+        return;
+    }
+    for (uint32_t i = 0; i < count; i++) {
+        struct racache_entry *entry = &racache.entries[(pblock + i) % racache.count];
+        if (entry->valid && !entry->used) {
+            ra_stat.unused++;
+        }
+        entry->pblock = pblock + i;
+        entry->valid = 1;
+        entry->used = 0;
+        memcpy(racache.data + BLOCKS2BYTES((pblock + i) % racache.count), buf + BLOCKS2BYTES(i), BLOCK_SIZE);
+    }
+    ra_stat.prefetch += count;
+    pthread_mutex_unlock(&racache.lock);
+}
+
+int racache_read(uint64_t pblock, uint32_t off, uint32_t len, void *p) {
+    ASSERT(off + len <= BLOCK_SIZE);
+    int ret = -1;
+    pthread_mutex_lock(&racache.lock);
+    struct racache_entry *entry = &racache.entries[pblock % racache.count];
+    if (entry->valid && entry->pblock == pblock) {
+        memcpy(p, racache.data + BLOCKS2BYTES(pblock % racache.count) + off, len);
+        entry->used = 1;
+        ra_stat.hit++;
+        ret = 0;
+    } else {
+        ra_stat.miss++;
+    }
+    pthread_mutex_unlock(&racache.lock);
+    return ret;
+}
+
+void racache_invalidate(uint64_t pblock, uint32_t count) {
+    if (!ra_max) {
+        return;
+    }
+    pthread_mutex_lock(&racache.lock);
+    racache.gen++;
+    if (count > racache.count) {
+        count = racache.count;
+    }
+    for (uint32_t i = 0; i < count; i++) {
+        struct racache_entry *entry = &racache.entries[(pblock + i) % racache.count];
+        if (entry->pblock == pblock + i) {
+            entry->valid = 0;
+        }
+    }
+    pthread_mutex_unlock(&racache.lock);
+}
+
+static void ra_enqueue(uint64_t pblock, uint32_t count) {
+    pthread_mutex_lock(&ra_queue.lock);
+    if (ra_queue.tail - ra_queue.head == RA_QUEUE_LEN) {
+        ra_stat.dropped++;
+    } else {
+        ra_queue.reqs[ra_queue.tail++ % RA_QUEUE_LEN] = (struct ra_request){pblock, count};
+        pthread_cond_signal(&ra_queue.cond);
+    }
+    pthread_mutex_unlock(&ra_queue.lock);
+}
+
+static void *ra_thread(void *arg) {
+    UNUSED(arg);
+    uint8_t *buf = malloc(BLOCKS2BYTES(ra_max));
+    while (1) {
+        pthread_mutex_lock(&ra_queue.lock);
+        while (ra_queue.head == ra_queue.tail && !ra_queue.stop) {
+            pthread_cond_wait(&ra_queue.cond, &ra_queue.lock);
+        }
+        if (ra_queue.stop) {
+            pthread_mutex_unlock(&ra_queue.lock);
+            break;
+        }
+        struct ra_request req = ra_queue.reqs[ra_queue.head++ % RA_QUEUE_LEN];
+        pthread_mutex_unlock(&ra_queue.lock);
+
+        pthread_mutex_lock(&racache.lock);
+        uint64_t gen = racache.gen;
+        pthread_mutex_unlock(&racache.lock);
+
+        DEBUG("prefetch pblock %lu +%u", req.pblock, req.count);
+        disk_read(BLOCKS2BYTES(req.pblock), BLOCKS2BYTES(req.count), buf);
+        racache_insert(req.pblock, req.count, buf, gen);
+    }
+    free(buf);
+    return NULL;
+}
+
+int readahead_init() {
+    ra_max = ra_max_kb * 1024 / BLOCK_SIZE;
+    if (ra_max == 0) {
+        INFO("readahead disabled");
+        return 0;
+    }
+    if (ra_max < RA_WINDOW_MIN) {
+        ra_max = RA_WINDOW_MIN;
+    }
+
+    // room for a few windows in flight
+    racache.count = ra_max * 4 > RA_CACHE_MIN ? ra_max * 4 : RA_CACHE_MIN;
+    racache.entries = calloc(racache.count, sizeof(struct racache_entry));
+    racache.data = malloc(BLOCKS2BYTES(racache.count));
+    ra_queue.head = ra_queue.tail = 0;
+    ra_queue.stop = 0;
+    if (pthread_create(&ra_thread_id, NULL, ra_thread, NULL) != 0) {
+        ERR("fail to create readahead thread, readahead disabled");
+        free(racache.entries);
+        free(racache.data);
+        ra_max = 0;
+        return -1;
+    }
+    INFO("readahead init, max window %u blocks, cache %u blocks", ra_max, racache.count);
+    return 0;
+}
+
+void readahead_exit() {
+    if (!ra_max) {
+        return;
+    }
+    pthread_mutex_lock(&ra_queue.lock);
+    ra_queue.stop = 1;
+    pthread_cond_signal(&ra_queue.cond);
+    pthread_mutex_unlock(&ra_queue.lock);
+    pthread_join(ra_thread_id, NULL);
+
+    free(racache.entries);
+    free(racache.data);
+    racache.entries = NULL;
+    racache.data = NULL;
+    ra_max = 0;
+    INFO("readahead exit");
+}
+
+void readahead_update(struct readahead *ra, struct ext4_inode *inode, off_t offset, size_t size) {
+    if (!ra_max) {
+        return;
+    }
+
+    off_t end = offset + size;
+    if (offset == ra->next_off) {
+        ra->window = ra->window ? ra->window * 2 : RA_WINDOW_MIN;
+        if (ra->window > ra_max) {
+            ra->window = ra_max;
+        }
+        if (ra->window > ra_stat.window) {
+            ra_stat.window = ra->window;
+        }
+    } else {
+        DEBUG("random read at %ld, expect %ld, reset window", offset, ra->next_off);
+        ra->window = 0;
+        ra->ra_lblock = 0;
+    }
+    ra->next_off = end;
+    if (ra->window == 0) {
+        return;
+    }
+
+    uint32_t lblock = end / BLOCK_SIZE;
+    uint32_t last_lblock = BYTES2BLOCKS(EXT4_INODE_GET_SIZE(inode));
+    uint32_t limit = lblock + ra->window;
+    if (limit > last_lblock) {
+        limit = last_lblock;
+    }
+    // still half a window prefetched ahead, wait for the stream to catch up
+    if (ra->ra_lblock >= lblock + ra->window / 2) {
+        return;
+    }
+    if (ra->ra_lblock > lblock) {
+        lblock = ra->ra_lblock;
+    }
+
+    uint64_t last_pblock = 0;
+    uint32_t extent_len;
+    while (lblock < limit) {
+        uint64_t pblock = inode_get_data_pblock(inode, lblock, &extent_len);
+        if (pblock == 0) {
+            break;
+        }
+        if (last_pblock && (pblock > last_pblock + RA_SEEK_MAX || pblock + RA_SEEK_MAX < last_pblock)) {
+            // the next extent is far away, don't pay a seek for a guess
+            DEBUG("stop readahead at lblock %u, pblock %lu is far from %lu", lblock, pblock, last_pblock);
+            break;
+        }
+        uint32_t count = extent_len < limit - lblock ? extent_len : limit - lblock;
+        ra_enqueue(pblock, count);
+        lblock += count;
+        last_pblock = pblock + count;
+    }
+    ra->ra_lblock = lblock;
+}
+
+uint64_t readahead_mem() {
+    if (!ra_max) {
+        return 0;
+    }
+    return (uint64_t)racache.count * (BLOCK_SIZE + sizeof(struct racache_entry));
+}
+
+int readahead_status(char *buf) {
+    int buf_cnt = 0;
+    if (!ra_max) {
+        buf_cnt += sprintf(buf + buf_cnt, "  readahead:\t\t disabled\n");
+        return buf_cnt;
+    }
+    pthread_mutex_lock(&racache.lock);
+    buf_cnt += sprintf(buf + buf_cnt, "  readahead[window:max]\t [%u/%u] blocks\n", ra_stat.window, ra_max);
+    buf_cnt += sprintf(buf + buf_cnt,
+                       "  readahead[hit:miss]\t [%lu/%lu] blocks\n",
+                       ra_stat.hit,
+                       ra_stat.miss);
+    buf_cnt += sprintf(buf + buf_cnt,
+                       "  readahead[prefetch:unused:dropped]\t [%lu/%lu/%lu]\n",
+                       ra_stat.prefetch,
+                       ra_stat.unused,
+                       ra_stat.dropped);
+    pthread_mutex_unlock(&racache.lock);
+    return buf_cnt;
+}
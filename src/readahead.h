@@ -0,0 +1,57 @@
+#ifndef READAHEAD_H
+#define READAHEAD_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "common.h"
+#include "ext4/ext4_inode.h"
+
+#define RA_WINDOW_MIN  4    // blocks, first window of a detected sequential stream
+#define RA_DEFAULT_KB  512  // default max window, -o readahead=<KiB>, 0 to disable
+#define RA_SEEK_MAX    256  // stop at an extent boundary if the next extent is farther than this (blocks)
+#define RA_QUEUE_LEN   64   // pending prefetch requests, new requests are dropped when full
+#define RA_CACHE_MIN   256  // min blocks of the readahead cache
+
+// sequential stream state of an open file
+struct readahead {
+    off_t next_off;     // offset of the next read if the stream is sequential
+    uint32_t window;    // current window in blocks, 0 if the stream is not sequential
+    uint32_t ra_lblock; // prefetch has been issued up to this lblock (exclusive)
+};
+
+/**
+ * @brief set the max readahead window, must be called before readahead_init
+ *
+ * @param max_kb 0 to disable readahead
+ */
+void readahead_config(uint32_t max_kb);
+int readahead_init();
+void readahead_exit();
+int readahead_enabled();
+
+/**
+ * @brief copy [off, off + len) of pblock from the readahead cache
+ *
+ * @return int 0 if hit, -1 if pblock is not cached
+ */
+int racache_read(uint64_t pblock, uint32_t off, uint32_t len, void *p);
+
+/**
+ * @brief drop count blocks from pblock in the readahead cache, called when they are written
+ */
+void racache_invalidate(uint64_t pblock, uint32_t count);
+
+/**
+ * @brief update the stream state after a read of [offset, offset + size), and prefetch the next
+ * window asynchronously if the stream is sequential
+ */
+void readahead_update(struct readahead *ra, struct ext4_inode *inode, off_t offset, size_t size);
+
+/**
+ * @brief memory of the readahead cache, fixed once readahead_init has sized it
+ */
+uint64_t readahead_mem();
+int readahead_status(char *buf);
+
+#endif
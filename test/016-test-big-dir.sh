@@ -0,0 +1,98 @@
+#!/bin/bash
+
+# Set the test directories
+TEST_DIR="./big_dir"
+OTHER_DIR="./big_dir_other"
+
+# File prefix and number of files, enough for the directory to be hash indexed
+FILE_PREFIX="big_dir_file_with_a_longish_name_"
+NUM_FILES=3000
+
+mkdir -p $TEST_DIR $OTHER_DIR
+
+# Create files, each holding its own name
+echo "Starting file creation..."
+for i in $(seq 1 $NUM_FILES); do
+  echo "$FILE_PREFIX$i" > "$TEST_DIR/$FILE_PREFIX$i"
+  if [[ ! -f "$TEST_DIR/$FILE_PREFIX$i" ]]; then
+    echo "File creation failed: $TEST_DIR/$FILE_PREFIX$i"
+    exit 1
+  fi
+done
+echo "File creation completed."
+
+# Look every file up
+echo "Starting file check..."
+for i in $(seq 1 $NUM_FILES); do
+  if [[ ! -f "$TEST_DIR/$FILE_PREFIX$i" ]]; then
+    echo "File does not exist: $TEST_DIR/$FILE_PREFIX$i"
+    exit 1
+  fi
+done
+if [ $(ls -1 $TEST_DIR | wc -l) -ne $NUM_FILES ]; then
+  echo "Expected $NUM_FILES files, but got $(ls -1 $TEST_DIR | wc -l)"
+  exit 1
+fi
+echo "File check completed."
+
+# Delete all but every tenth file
+echo "Starting file deletion..."
+for i in $(seq 1 $NUM_FILES); do
+  if (( i % 10 != 0 )); then
+    rm "$TEST_DIR/$FILE_PREFIX$i"
+  fi
+done
+echo "File deletion completed."
+
+# Wait past COMPACT_DELAY_SEC for the directory to be compacted
+sleep 3
+
+# List and look up the directory again
+echo "Starting check after compaction..."
+kept=$((NUM_FILES / 10))
+if [ $(ls -1 $TEST_DIR | wc -l) -ne $kept ]; then
+  echo "Expected $kept files, but got $(ls -1 $TEST_DIR | wc -l)"
+  exit 1
+fi
+for i in $(seq 1 $NUM_FILES); do
+  if (( i % 10 == 0 )); then
+    if [[ "$(cat "$TEST_DIR/$FILE_PREFIX$i")" != "$FILE_PREFIX$i" ]]; then
+      echo "File content is wrong: $TEST_DIR/$FILE_PREFIX$i"
+      exit 1
+    fi
+  elif [[ -e "$TEST_DIR/$FILE_PREFIX$i" ]]; then
+    echo "File not deleted: $TEST_DIR/$FILE_PREFIX$i"
+    exit 1
+  fi
+done
+echo "Check after compaction completed."
+
+# Rename onto an existing name in the same directory
+echo "Starting rename check..."
+mv -f "$TEST_DIR/${FILE_PREFIX}10" "$TEST_DIR/${FILE_PREFIX}20"
+if [[ -e "$TEST_DIR/${FILE_PREFIX}10" || "$(cat "$TEST_DIR/${FILE_PREFIX}20")" != "${FILE_PREFIX}10" ]]; then
+  echo "Rename onto an existing name failed: $TEST_DIR/${FILE_PREFIX}20"
+  exit 1
+fi
+
+# Rename onto an existing name in another directory
+echo "existing" > "$OTHER_DIR/target"
+mv -f "$TEST_DIR/${FILE_PREFIX}30" "$OTHER_DIR/target"
+if [[ -e "$TEST_DIR/${FILE_PREFIX}30" || "$(cat "$OTHER_DIR/target")" != "${FILE_PREFIX}30" ]]; then
+  echo "Rename onto an existing name failed: $OTHER_DIR/target"
+  exit 1
+fi
+if [ $(ls -1 $OTHER_DIR | wc -l) -ne 1 ] || [ $(ls -1 $TEST_DIR | wc -l) -ne $((kept - 2)) ]; then
+  echo "Wrong number of files after rename"
+  exit 1
+fi
+echo "Rename check completed."
+
+# Remove the test directories
+rm -rf $TEST_DIR $OTHER_DIR
+if [[ -e $TEST_DIR || -e $OTHER_DIR ]]; then
+  echo "Directory deletion failed"
+  exit 1
+fi
+
+echo "Test completed."
@@ -15,7 +15,7 @@ success=0
 fail=0
 
 # Files to ignore
-ignore_files=("012" "013" "014" "015")
+ignore_files=("014" "015")
 # ignore_files=()
 
 # List all files in the directory that match the pattern and sort by number